@@ -1,6 +1,9 @@
 #include "precomp.h"
 #include "helper.h"
 #include "renderer.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // -----------------------------------------------------------
 // Initialize the renderer
@@ -11,6 +14,7 @@ void Renderer::Init()
 	accumulator = (float4*)MALLOC64(SCRWIDTH * SCRHEIGHT * 16);
 	memset(accumulator, 0, SCRWIDTH * SCRHEIGHT * 16);
 	m_buildTime = scene.GetBuildTime();
+	m_serialBuildTime = scene.GetSerialBuildTime();
 	m_triangleCount = scene.GetTriangleCount();
 	m_maxTreeDepth = scene.GetMaxTreeDepth();
 }
@@ -22,6 +26,12 @@ float3 Renderer::Trace(Ray& ray, int depth)
 {
 	if (depth > depthLimit) return float3(0);
 	scene.FindNearest(ray);
+	return Shade(ray, depth);
+}
+
+// light transport at the nearest hit of a ray that has already been traced
+float3 Renderer::Shade(Ray& ray, int depth)
+{
 	//if (ray.objIdx == -1) return float3(0);
 	if (ray.objIdx == -1) return scene.GetSkyColor(ray); // or a fancy sky color
 	float3 I = ray.O + ray.t * ray.D;
@@ -134,15 +144,55 @@ void Renderer::Tick(float deltaTime)
 	if (animating) scene.SetTime(anim_time += deltaTime * 0.002f);
 	// pixel loop
 	Timer t;
+	float primaryTime = 0, primarySteps = 0;
+#ifdef RAY_PACKETS
+	// rows of packets are executed as OpenMP parallel tasks (disabled in DEBUG)
+#pragma omp parallel for schedule(dynamic) reduction(+:primaryTime, primarySteps)
+	for (int py = 0; py < SCRHEIGHT; py += RAY_PACKET_WIDTH)
+	{
+		// trace a packet of primary rays for each square of pixels on the row
+		for (int px = 0; px < SCRWIDTH; px += RAY_PACKET_WIDTH)
+		{
+			Ray rays[RAY_PACKET_SIZE];
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+				rays[i] = camera.GetPrimaryRay((float)(px + i % RAY_PACKET_WIDTH), (float)(py + i / RAY_PACKET_WIDTH));
+			Timer pt;
+			if (m_tracePackets) scene.FindNearestPacket(rays);
+			else for (int i = 0; i < RAY_PACKET_SIZE; i++) scene.FindNearest(rays[i]);
+			primaryTime += pt.elapsed();
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			{
+				int x = px + i % RAY_PACKET_WIDTH, y = py + i / RAY_PACKET_WIDTH;
+				Ray& primaryRay = rays[i];
+				// a packet charges each of its rays the steps of the whole packet
+				primarySteps += m_tracePackets ? primaryRay.traversed / (float)RAY_PACKET_SIZE : primaryRay.traversed;
+				float4 pixel = float4(Shade(primaryRay, 0), 0);
+
+				// for metrics
+				if (primaryRay.traversed > 0) m_rayHitCount++;
+				if (primaryRay.traversed > m_peakTraversal) m_peakTraversal = primaryRay.traversed;
+				if (primaryRay.tested > m_peakTests) m_peakTests = primaryRay.tested;
+				m_totalTraversal += primaryRay.traversed;
+				m_totalTests += primaryRay.tested;
+				// translate accumulator contents to rgb32 pixels
+				screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
+				accumulator[x + y * SCRWIDTH] = pixel;
+			}
+		}
+	}
+#else
 	// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel for schedule(dynamic) reduction(+:primaryTime)
 	for (int y = 0; y < SCRHEIGHT; y++)
 	{
 		// trace a primary ray for each pixel on the line
 		for (int x = 0; x < SCRWIDTH; x++)
 		{
 			Ray primaryRay = camera.GetPrimaryRay((float)x, (float)y);
-			float4 pixel = float4(Trace(primaryRay, 0), 0);
+			Timer pt;
+			scene.FindNearest(primaryRay);
+			primaryTime += pt.elapsed();
+			float4 pixel = float4(Shade(primaryRay, 0), 0);
 
 			// for metrics
 			if (primaryRay.traversed > 0) m_rayHitCount++;
@@ -155,6 +205,18 @@ void Renderer::Tick(float deltaTime)
 			accumulator[x + y * SCRWIDTH] = pixel;
 		}
 	}
+#endif
+	// primary throughput, from the time the threads spent tracing primary rays
+#ifdef _OPENMP
+	const float threads = (float)omp_get_max_threads();
+#else
+	const float threads = 1;
+#endif
+	m_primaryRps = (SCRWIDTH * SCRHEIGHT) / max(1e-6f, primaryTime / threads) * 1e-6f;
+#ifdef RAY_PACKETS
+	if (m_tracePackets) m_packetRps = m_primaryRps, m_packetSteps = primarySteps / (SCRWIDTH * SCRHEIGHT);
+	else m_singleRps = m_primaryRps, m_singleSteps = primarySteps / (SCRWIDTH * SCRHEIGHT);
+#endif
 	// performance report - running average - ms, MRays/s
 	/*static float avg = 10, alpha = 1;
 	avg = (1 - alpha) * avg + alpha * t.elapsed() * 1000;
@@ -217,10 +279,20 @@ void Renderer::UI()
 	ImGui::Text("Object id: %i", r.objIdx);
 	ImGui::Text("Triangle count: %i", m_triangleCount);
 	ImGui::Text("Build time: %lld", m_buildTime.count());
+	if (m_serialBuildTime.count() > 0)
+		ImGui::Text("Serial build time: %lld (%.2fx)", m_serialBuildTime.count(), (float)m_serialBuildTime.count() / max(1ll, (long long)m_buildTime.count()));
 	ImGui::Text("Max tree depth: %d", m_maxTreeDepth);
 	ImGui::Text("Frame: %5.2f ms (%.1ffps)", m_avg, m_fps);
 	//ImGui::Text("FPS: %.1ffps", m_fps);
 	ImGui::Text("RPS: %.1f Mrays/s", m_rps);
+	ImGui::Text("Primary rays: %.1f Mrays/s", m_primaryRps);
+#ifdef RAY_PACKETS
+	// toggle to measure the other mode; each line keeps the last frame traced that way
+	ImGui::Checkbox("Trace packets", &m_tracePackets);
+	ImGui::Text("Packets: %.2f steps per ray, %.1f Mrays/s", m_packetSteps, m_packetRps);
+	ImGui::Text("Single rays: %.2f steps per ray, %.1f Mrays/s", m_singleSteps, m_singleRps);
+	if (m_packetRps > 0 && m_singleRps > 0) ImGui::Text("Packet speedup: %.2fx", m_packetRps / m_singleRps);
+#endif
 	ImGui::Text("Camera pos: (%.2f, %.2f, %.2f)", camera.camPos.x, camera.camPos.y, camera.camPos.z);
 	ImGui::Text("Camera target: (%.2f, %.2f, %.2f)", camera.camTarget.x, camera.camTarget.y, camera.camTarget.z);
 }
\ No newline at end of file
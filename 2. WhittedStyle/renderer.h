@@ -22,6 +22,10 @@ namespace Tmpl8
 		float m_alpha = 1;
 		float m_fps = 0;
 		float m_rps = 0;
+		float m_primaryRps = 0; // Mrays/s of the primary ray packets, traversal only
+		bool m_tracePackets = true; // otherwise the rays of a packet are traced one by one, for comparison
+		float m_packetRps = 0, m_singleRps = 0; // the last primary Mrays/s with and without packets
+		float m_packetSteps = 0, m_singleSteps = 0; // traversal steps per primary ray, with and without packets
 		float m_rayHitCount = 0;
 		bool m_inspectTraversal = false;
 		bool m_inspectIntersectionTest = false;
@@ -33,6 +37,7 @@ namespace Tmpl8
 		float m_peakTests = 0;
 		// about the scene
 		std::chrono::microseconds m_buildTime;
+		std::chrono::microseconds m_serialBuildTime;
 		uint m_triangleCount = 0;
 		uint m_maxTreeDepth = 0;
 		float3 GetEdgeDebugColor(float2 uv);
@@ -40,6 +45,7 @@ namespace Tmpl8
 		// game flow methods
 		void Init();
 		float3 Trace( Ray& ray , int depth); 
+		float3 Shade(Ray& ray, int depth);
 		float3 DirectIllumination(float3 I, float3 N);
 		void Tick( float deltaTime );
 		void UI();
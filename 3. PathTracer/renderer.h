@@ -10,9 +10,21 @@
 #include "tlas_file_scene.h"
 
 #define EPSILON	0.001f
+#define WAVEFRONT_POOL_SIZE (1 << 16) // in-flight paths of the wavefront integrator
+#define WAVEFRONT_BATCH 256 // paths per job in the extend and shade stages
+#define WAVEFRONT_SORT_MIN 8192 // fewer bounce rays than this are extended in queue order
 
 namespace Tmpl8
 {
+	// a path in flight in the wavefront integrator; it owns the sample (pixel, pass) until it terminates
+	struct WavefrontPath
+	{
+		Ray ray;
+		float3 throughput = 1;
+		uint seed = 0;
+		int pixel = -1, pass = 0, depth = 0;
+	};
+
 	class Renderer : public TheApp
 	{
 	private:
@@ -22,6 +34,26 @@ namespace Tmpl8
 		float m_alpha = 1;
 		float m_fps = 0;
 		float m_rps = 0;
+		float m_primaryRps = 0; // Mrays/s of the primary ray packets, traversal only
+		float m_secondaryRps = 0; // Mrays/s of the other rays, including shading
+		float m_pathRps = 0; // Mrays/s of all rays, for comparing the integrators
+		bool m_wavefront = false;
+		// wavefront integrator: the path pool and the queues between its stages
+		WavefrontPath* m_paths = 0;
+		std::vector<uint> m_extendQueue, m_freeQueue;
+		float m_extendTime = 0, m_shadeTime = 0; // seconds per frame in the wavefront stages
+		int m_waves = 0;
+		// bounce ray sorting: the cost of the sort and the extend cost per ray with and without it
+		bool m_sortRays = true;
+		std::vector<uint> m_sortKeys, m_sortedKeys, m_sortedSlots;
+		float3 m_keyMin = 0, m_keyScale = 0; // quantization of the bounce ray origins
+		float m_sortTime = 0, m_sortedWaveTime = 0, m_sortedWaveRays = 0;
+		float m_sortedNsPerRay = 0, m_unsortedNsPerRay = 0; // running averages over frames
+		int m_sortedWaves = 0;
+		bool GeneratePath(WavefrontPath& path, int& nextPixel);
+		void SortExtendQueue();
+		uint RenderRecursive();
+		uint RenderWavefront();
 		bool m_inspectTraversal = false;
 		float3 GetEdgeDebugColor(float2 uv);
 	public:
@@ -30,8 +62,12 @@ namespace Tmpl8
 		void ClearAccumulator();
 		float3 HandleMirror(const Ray& ray, uint& seed, const float3& I, const float3& N, const int depth);
 		float3 HandleDielectric(const Ray& ray, uint& seed, const float3& I, const float3& N, const int depth);
+		Ray DielectricRay(const Ray& ray, uint& seed, const float3& I, const float3& N);
 		float3 Sample(Ray& ray, uint& seed, int depth = 0);
-		void ProcessTile(int tx, int ty, float& sum);
+		float3 Shade(Ray& ray, uint& seed, int depth);
+		void ProcessTile(int tx, int ty, float& sum, float& primaryTime);
+		void ExtendPaths(uint first, uint last);
+		void ShadePaths(uint first, uint last, std::vector<uint>& bounced, std::vector<uint>& bounceKeys, std::vector<uint>& terminated, float3& omin, float3& omax);
 		void Tick( float deltaTime );
 		void UI();
 		void Shutdown() { /* implement if you want to do things on shutdown */ }
@@ -9,6 +9,8 @@ void Renderer::Init()
 {
 	// create fp32 rgb pixel buffer to render to
 	accumulator = (float4*)MALLOC64(SCRWIDTH * SCRHEIGHT * 16);
+	m_paths = (WavefrontPath*)MALLOC64(WAVEFRONT_POOL_SIZE * sizeof(WavefrontPath));
+	for (int i = 0; i < WAVEFRONT_POOL_SIZE; i++) new (m_paths + i) WavefrontPath();
 	ClearAccumulator();
 }
 
@@ -25,6 +27,13 @@ float3 Renderer::HandleMirror(const Ray& ray, uint& seed, const float3& I, const
 }
 
 float3 Renderer::HandleDielectric(const Ray& ray, uint& seed, const float3& I, const float3& N, const int depth)
+{
+	Ray r = DielectricRay(ray, seed, I, N);
+	return Sample(r, seed, depth + 1);
+}
+
+// the reflected or the transmitted ray, picked by the Fresnel term
+Ray Renderer::DielectricRay(const Ray& ray, uint& seed, const float3& I, const float3& N)
 {
 	float3 R = reflect(ray.D, N);
 	Ray r(I + R * EPSILON, R);
@@ -39,17 +48,27 @@ float3 Renderer::HandleDielectric(const Ray& ray, uint& seed, const float3& I, c
 		float3 T = eta * ray.D + ((eta * cosi - sqrtf(fabs(cost2))) * N);
 		Ray t(I + T * EPSILON, T);
 		t.inside = !ray.inside;
-		if (RandomFloat(seed) > Fr) return Sample(t, seed, depth + 1);
+		if (RandomFloat(seed) > Fr) return t;
 	}
-	return Sample(r, seed, depth + 1);
+	return r;
 }
 
 // -----------------------------------------------------------
 // Evaluate light transport
 // -----------------------------------------------------------
+// rays traced by Sample on this thread, read back by the tile job that ran it
+static thread_local uint secondaryRayCount = 0;
+
 float3 Renderer::Sample(Ray& ray, uint& seed, int depth)
 {
+	if (depth > 0) secondaryRayCount++;
 	scene.FindNearest(ray);
+	return Shade(ray, seed, depth);
+}
+
+// light transport at the nearest hit of a ray that has already been traced
+float3 Renderer::Shade(Ray& ray, uint& seed, int depth)
+{
 	//if (ray.objIdx == -1) return float3(0);
 	if (ray.objIdx == -1) return scene.GetSkyColor(ray); // or a fancy sky color
 	if (depth >= depthLimit) return float3(0);
@@ -114,49 +133,326 @@ float3 Renderer::GetEdgeDebugColor(float2 uv)
 // -----------------------------------------------------------
 // Draw an 16x16 tile of pixels
 // -----------------------------------------------------------
-void Renderer::ProcessTile(int tx, int ty, float& sum)
+void Renderer::ProcessTile(int tx, int ty, float& sum, float& primaryTime)
 {
 	float scale = 1.0f / (spp + passes);
 	uint seed = InitSeed(tx + ty * SCRWIDTH + spp * 1799);
+#ifdef RAY_PACKETS
+	// camera rays are generated and traced in square packets, the rest of the path ray by ray
+	for (int py = 0; py < 16; py += RAY_PACKET_WIDTH) for (int px = 0; px < 16; px += RAY_PACKET_WIDTH)
+	{
+		for (int p = 0; p < passes; p++)
+		{
+			Ray rays[RAY_PACKET_SIZE];
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			{
+				int x = tx * 16 + px + i % RAY_PACKET_WIDTH, y = ty * 16 + py + i / RAY_PACKET_WIDTH;
+				rays[i] = camera.GetPrimaryRay((float)x + RandomFloat(seed), (float)y + RandomFloat(seed));
+			}
+			Timer t;
+			scene.FindNearestPacket(rays);
+			primaryTime += t.elapsed();
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			{
+				int x = tx * 16 + px + i % RAY_PACKET_WIDTH, y = ty * 16 + py + i / RAY_PACKET_WIDTH;
+				accumulator[x + y * SCRWIDTH] += float4(Shade(rays[i], seed, 0), 0);
+			}
+		}
+		for (int v = py; v < py + RAY_PACKET_WIDTH; v++) for (int u = px; u < px + RAY_PACKET_WIDTH; u++)
+		{
+			int x = tx * 16 + u, y = ty * 16 + v;
+			float4 pixel = accumulator[x + y * SCRWIDTH] * scale;
+			sum += pixel.x + pixel.y + pixel.z;
+			screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
+		}
+	}
+#else
 	for (int y = ty * 16, v = 0; v < 16; v++, y++) for (int x = tx * 16, u = 0; u < 16; u++, x++)
 	{
 		for (int p = 0; p < passes; p++)
-			accumulator[x + y * SCRWIDTH] +=
-			float4(Sample(camera.GetPrimaryRay((float)x + RandomFloat(seed),
-				(float)y + RandomFloat(seed)), seed), 0);
+		{
+			Ray ray = camera.GetPrimaryRay((float)x + RandomFloat(seed), (float)y + RandomFloat(seed));
+			Timer t;
+			scene.FindNearest(ray);
+			primaryTime += t.elapsed();
+			accumulator[x + y * SCRWIDTH] += float4(Shade(ray, seed, 0), 0);
+		}
 		float4 pixel = accumulator[x + y * SCRWIDTH] * scale;
 		sum += pixel.x + pixel.y + pixel.z;
 		screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
 	}
+#endif
 }
 static struct TileJob : public Job
 {
-	void Main() { renderer->ProcessTile(tx, ty, sum); }
-	Job* Init(Renderer* r, int x, int y) { renderer = r, tx = x, ty = y, sum = 0; return this; }
+	void Main()
+	{
+		Timer t;
+		secondaryRayCount = 0;
+		renderer->ProcessTile(tx, ty, sum, primaryTime);
+		tileTime = t.elapsed(), secondaryRays = secondaryRayCount;
+	}
+	Job* Init(Renderer* r, int x, int y) { renderer = r, tx = x, ty = y, sum = 0, primaryTime = 0; return this; }
 	Renderer* renderer;
 	int tx, ty;
 	float sum;
+	float primaryTime, tileTime; // seconds spent on this tile's primary rays, and on the whole tile
+	uint secondaryRays;
 } tileJob[4096];
 
 // -----------------------------------------------------------
-// Main application tick function - Executed once per frame
+// Depth-first: a tile per job, each path traced to the end
 // -----------------------------------------------------------
-void Renderer::Tick(float deltaTime)
+uint Renderer::RenderRecursive()
 {
-	// animation
-	if (animating) scene.SetTime(anim_time += deltaTime * 0.002f), ClearAccumulator();
-	// pixel loop
-	Timer t;
 	// render tiles using a simple job system
 	for (int jobIdx = 0, y = 0; y < SCRHEIGHT / 16; y++) for (int x = 0; x < SCRWIDTH / 16; x++)
 		jm->AddJob2(tileJob[jobIdx++].Init(this, x, y));
 	jm->RunJobs();
 	// gather energy received on tiles
 	energy = 0;
+	float primaryTime = 0, secondaryTime = 0, secondaryRays = 0;
 	for (int tiles = (SCRWIDTH / 16) * (SCRHEIGHT / 16), i = 0; i < tiles; i++)
+	{
 		energy += tileJob[i].sum;
+		primaryTime += tileJob[i].primaryTime;
+		secondaryTime += tileJob[i].tileTime - tileJob[i].primaryTime;
+		secondaryRays += tileJob[i].secondaryRays;
+	}
+	// primary and secondary throughput, from the time the workers spent on each
+	const float threads = (float)jm->GetNumThreads();
+	m_primaryRps = (SCRWIDTH * SCRHEIGHT * passes) / max(1e-6f, primaryTime / threads) * 1e-6f;
+	m_secondaryRps = secondaryRays / max(1e-6f, secondaryTime / threads) * 1e-6f;
+	return SCRWIDTH * SCRHEIGHT * passes + (uint)secondaryRays;
+}
+
+// -----------------------------------------------------------
+// Breadth-first: the paths in the pool advance one bounce per wave
+// -----------------------------------------------------------
+// Paths are generated into free slots, extended (nearest hit) and shaded in batches on the job system.
+// Shading either spawns the bounce ray into the next extend queue or terminates the path and returns
+// its slot to the free queue, where the next sample picks it up, so the queues stay full until the
+// frame runs out of samples. A pixel is owned by a single path at a time: its passes run one after
+// the other in the same slot, so paths add to the accumulator without synchronization.
+bool Renderer::GeneratePath(WavefrontPath& path, int& nextPixel)
+{
+	if (path.pixel >= 0 && path.pass + 1 < passes) path.pass++;
+	else if (nextPixel < SCRWIDTH * SCRHEIGHT) path.pixel = nextPixel++, path.pass = 0;
+	else return path.pixel = -1, false;
+	const int x = path.pixel % SCRWIDTH, y = path.pixel / SCRWIDTH;
+	path.seed = InitSeed(path.pixel + (spp + path.pass) * 1799);
+	path.ray = camera.GetPrimaryRay((float)x + RandomFloat(path.seed), (float)y + RandomFloat(path.seed));
+	path.throughput = 1, path.depth = 0;
+	return true;
+}
+
+void Renderer::ExtendPaths(uint first, uint last)
+{
+	for (uint i = first; i < last; i++) scene.FindNearest(m_paths[m_extendQueue[i]].ray);
+}
+
+// spreads the lowest 10 bits of v, leaving two zero bits between each
+static uint ExpandMortonBits(uint v)
+{
+	v &= 0x3ff;
+	v = (v | v << 16) & 0x30000ff;
+	v = (v | v << 8) & 0x300f00f;
+	v = (v | v << 4) & 0x30c30c3;
+	v = (v | v << 2) & 0x9249249;
+	return v;
+}
+
+// the transport of Shade, with the recursion replaced by a bounce ray and the path throughput;
+// bounce rays get the sort key of SortExtendQueue, and the bounds of their origins are grown
+void Renderer::ShadePaths(uint first, uint last, std::vector<uint>& bounced, std::vector<uint>& bounceKeys, std::vector<uint>& terminated, float3& omin, float3& omax)
+{
+	for (uint i = first; i < last; i++)
+	{
+		const uint slot = m_extendQueue[i];
+		WavefrontPath& path = m_paths[slot];
+		Ray& ray = path.ray;
+		float3 emitted(0);
+		bool bounce = false;
+		if (ray.objIdx == -1) emitted = scene.GetSkyColor(ray);
+		else if (path.depth < depthLimit)
+		{
+			float3 I = ray.O + ray.t * ray.D;
+			HitInfo hitInfo = scene.GetHitInfo(ray, I);
+			float3 N = hitInfo.normal;
+			Material* material = hitInfo.material;
+			float3 albedo = material->isAlbedoOverridden ? scene.GetAlbedo(ray.objIdx, I) : material->GetAlbedo(hitInfo.uv);
+			if (material->isLight) emitted = scene.GetLightColor();
+			else
+			{
+				float3 medium_scale(1);
+				if (ray.inside) medium_scale = expf(material->absorption * -ray.t);
+				float r = RandomFloat(path.seed);
+				if (r < material->reflectivity) // handle pure speculars
+				{
+					float3 R = reflect(ray.D, N);
+					path.throughput *= albedo * medium_scale;
+					ray = Ray(I + R * EPSILON, R);
+				}
+				else if (r < material->reflectivity + material->refractivity) // handle dielectrics
+				{
+					path.throughput *= albedo * medium_scale;
+					ray = DielectricRay(ray, path.seed, I, N);
+				}
+				else // diffuse surface
+				{
+					float3 R = diffusereflection(N, path.seed);
+					path.throughput *= medium_scale * albedo * INVPI * 2 * PI * dot(R, N);
+					ray = Ray(I + R * EPSILON, R);
+				}
+				bounce = true;
+			}
+		}
+		if (bounce)
+		{
+			// the key is the direction octant, followed by the Morton code of the origin
+			const float3 p = clamp((ray.O - m_keyMin) * m_keyScale, 0, 511);
+			const uint octant = (ray.D.x < 0 ? 1 : 0) | (ray.D.y < 0 ? 2 : 0) | (ray.D.z < 0 ? 4 : 0);
+			bounceKeys.push_back(octant << 27 | ExpandMortonBits((uint)p.x) << 2 | ExpandMortonBits((uint)p.y) << 1 | ExpandMortonBits((uint)p.z));
+			omin = fminf(omin, ray.O), omax = fmaxf(omax, ray.O);
+			path.depth++, bounced.push_back(slot);
+		}
+		else accumulator[path.pixel] += float4(path.throughput * emitted, 0), terminated.push_back(slot);
+	}
+}
+
+static struct ExtendJob : public Job
+{
+	void Main() { renderer->ExtendPaths(first, last); }
+	Job* Init(Renderer* r, uint f, uint l) { renderer = r, first = f, last = l; return this; }
+	Renderer* renderer;
+	uint first, last;
+} extendJob[WAVEFRONT_POOL_SIZE / WAVEFRONT_BATCH];
+
+static struct ShadeJob : public Job
+{
+	void Main() { bounced.clear(), bounceKeys.clear(), terminated.clear(); renderer->ShadePaths(first, last, bounced, bounceKeys, terminated, omin, omax); }
+	Job* Init(Renderer* r, uint f, uint l) { renderer = r, first = f, last = l, omin = float3(1e30f), omax = float3(-1e30f); return this; }
+	Renderer* renderer;
+	uint first, last;
+	std::vector<uint> bounced, bounceKeys, terminated; // slots for the next extend queue and the free queue
+	float3 omin, omax; // bounds of the bounce ray origins
+} shadeJob[WAVEFRONT_POOL_SIZE / WAVEFRONT_BATCH];
+
+// Reorders the bounce rays in the extend queue by their keys, so rays that start close together and
+// go the same way are traced one after the other and find the nodes they visit in the cache. The
+// keys are made by the shade stage, with the origins quantized in the origin bounds of the wave
+// before, which saves a pass over the scattered paths.
+void Renderer::SortExtendQueue()
+{
+	const uint N = (uint)m_extendQueue.size();
+	m_sortedKeys.resize(N), m_sortedSlots.resize(N);
+	// LSD radix sort of the 30-bit keys, 8 bits per pass
+	for (uint shift = 0; shift < 30; shift += 8)
+	{
+		uint offset[256] = {};
+		for (uint i = 0; i < N; i++) offset[(m_sortKeys[i] >> shift) & 255]++;
+		// a pass in which all keys have the same digit changes nothing
+		if (offset[(m_sortKeys[0] >> shift) & 255] == N) continue;
+		for (uint d = 0, sum = 0; d < 256; d++) { const uint c = offset[d]; offset[d] = sum, sum += c; }
+		for (uint i = 0; i < N; i++)
+		{
+			const uint slot = offset[(m_sortKeys[i] >> shift) & 255]++;
+			m_sortedKeys[slot] = m_sortKeys[i], m_sortedSlots[slot] = m_extendQueue[i];
+		}
+		m_sortKeys.swap(m_sortedKeys), m_extendQueue.swap(m_sortedSlots);
+	}
+}
+
+uint Renderer::RenderWavefront()
+{
+	// all slots start free, without a pixel
+	m_freeQueue.resize(WAVEFRONT_POOL_SIZE), m_extendQueue.clear();
+	for (uint i = 0; i < WAVEFRONT_POOL_SIZE; i++) m_paths[i].pixel = -1, m_freeQueue[i] = i;
+	int nextPixel = 0;
+	uint rays = 0;
+	m_extendTime = m_shadeTime = 0, m_waves = 0;
+	m_sortTime = m_sortedWaveTime = m_sortedWaveRays = 0, m_sortedWaves = 0;
+	while (1)
+	{
+		// sort the bounce rays; small queues are not worth it
+		const bool sortable = m_extendQueue.size() >= WAVEFRONT_SORT_MIN;
+		if (sortable && m_sortRays)
+		{
+			Timer t;
+			SortExtendQueue();
+			m_sortTime += t.elapsed(), m_sortedWaves++;
+		}
+		// generate: terminated paths continue with the next sample
+		for (const uint slot : m_freeQueue) if (GeneratePath(m_paths[slot], nextPixel)) m_extendQueue.push_back(slot);
+		m_freeQueue.clear();
+		if (m_extendQueue.empty()) break;
+		const uint count = (uint)m_extendQueue.size(), jobs = (count + WAVEFRONT_BATCH - 1) / WAVEFRONT_BATCH;
+		rays += count, m_waves++;
+		// extend: nearest hits for the whole queue
+		Timer t;
+		for (uint i = 0; i < jobs; i++) jm->AddJob2(extendJob[i].Init(this, i * WAVEFRONT_BATCH, min(count, (i + 1) * WAVEFRONT_BATCH)));
+		jm->RunJobs();
+		const float extendTime = t.elapsed();
+		m_extendTime += extendTime;
+		if (sortable) m_sortedWaveTime += extendTime, m_sortedWaveRays += count;
+		// shade: emission is accumulated, bounce rays are spawned
+		t.reset();
+		for (uint i = 0; i < jobs; i++) jm->AddJob2(shadeJob[i].Init(this, i * WAVEFRONT_BATCH, min(count, (i + 1) * WAVEFRONT_BATCH)));
+		jm->RunJobs();
+		m_shadeTime += t.elapsed();
+		// the per-job outputs become the queues of the next wave
+		m_extendQueue.clear(), m_sortKeys.clear();
+		float3 omin(1e30f), omax(-1e30f);
+		for (uint i = 0; i < jobs; i++)
+		{
+			m_extendQueue.insert(m_extendQueue.end(), shadeJob[i].bounced.begin(), shadeJob[i].bounced.end());
+			m_sortKeys.insert(m_sortKeys.end(), shadeJob[i].bounceKeys.begin(), shadeJob[i].bounceKeys.end());
+			m_freeQueue.insert(m_freeQueue.end(), shadeJob[i].terminated.begin(), shadeJob[i].terminated.end());
+			omin = fminf(omin, shadeJob[i].omin), omax = fmaxf(omax, shadeJob[i].omax);
+		}
+		// 9 bits per axis for the keys of the next wave
+		if (!m_extendQueue.empty())
+		{
+			float3 extent = omax - omin;
+			m_keyMin = omin;
+			for (int a = 0; a < 3; a++) m_keyScale[a] = extent[a] > 0 ? 512 * 0.9999f / extent[a] : 0;
+		}
+	}
+	// extend cost per ray of the waves that qualify for sorting, kept separately for sorted and
+	// unsorted frames, so toggling the sort shows how much traversal time it saves
+	if (m_sortedWaveRays > 0)
+	{
+		float& nsPerRay = m_sortRays ? m_sortedNsPerRay : m_unsortedNsPerRay;
+		const float frameNsPerRay = m_sortedWaveTime / m_sortedWaveRays * 1e9f;
+		nsPerRay = nsPerRay > 0 ? 0.9f * nsPerRay + 0.1f * frameNsPerRay : frameNsPerRay;
+	}
+	// resolve the accumulator
+	float scale = 1.0f / (spp + passes);
+	energy = 0;
+	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
+	{
+		float4 pixel = accumulator[i] * scale;
+		energy += pixel.x + pixel.y + pixel.z;
+		screen->pixels[i] = RGBF32_to_RGB8(&pixel);
+	}
+	return rays;
+}
+
+// -----------------------------------------------------------
+// Main application tick function - Executed once per frame
+// -----------------------------------------------------------
+void Renderer::Tick(float deltaTime)
+{
+	// animation
+	if (animating) scene.SetTime(anim_time += deltaTime * 0.002f), ClearAccumulator();
+	// pixel loop
+	Timer t;
+	const uint rays = m_wavefront ? RenderWavefront() : RenderRecursive();
+	const float frameTime = t.elapsed();
+	// all rays of the frame over wall time, comparable between the two integrators
+	m_pathRps = rays / max(1e-6f, frameTime) * 1e-6f;
 	// performance report - running average - ms, MRays/s
-	m_avg = (1 - m_alpha) * m_avg + m_alpha * t.elapsed() * 1000;
+	m_avg = (1 - m_alpha) * m_avg + m_alpha * frameTime * 1000;
 	if (m_alpha > 0.05f) m_alpha *= 0.75f;
 	m_fps = 1000.0f / m_avg, m_rps = (SCRWIDTH * SCRHEIGHT) / m_avg;
 	// handle user input
@@ -175,6 +471,7 @@ void Renderer::UI()
 	// animation toggle
 	bool changed = ImGui::Checkbox("Animate scene", &animating);
 	ImGui::Checkbox("Inspect Traversal", &m_inspectTraversal);
+	changed |= ImGui::Checkbox("Wavefront", &m_wavefront);
 	changed |= ImGui::SliderInt("spp", &passes, 1, 4, "%i");
 	ImGui::SliderFloat("Camera move speed", &camera.moveSpeed, 1.0f, 10.0f, "%.2f");
 	ImGui::SliderFloat("Camera turn speed", &camera.turnSpeed, 1.0f, 10.0f, "%.2f");
@@ -191,12 +488,59 @@ void Renderer::UI()
 	scene.FindNearest(r);
 	ImGui::Text("Object id: %i", r.objIdx);
 	ImGui::Text("Triangle count: %i", scene.GetTriangleCount());
+	ImGui::Text("Meshes: %i, instances: %i", scene.GetMeshCount(), scene.GetInstanceCount());
+	ImGui::Text("Scene load: %.1f ms, %.2f MB", scene.GetLoadTime().count() / 1000.f, scene.GetMemoryUsage() / (1024.f * 1024.f));
+	ImGui::Text("Scene update: %.2f ms, TLAS %s (%i refits, %i rebuilds)", scene.GetUpdateTime().count() / 1000.f,
+		scene.IsTLASRebuilt() ? "rebuilt" : "refitted", scene.GetTLASRefitCount(), scene.GetTLASRebuildCount());
+	if (scene.GetDeformedMeshCount() > 0)
+		ImGui::Text("Deformed meshes: %i, refit %.2f ms, rebuild %.2f ms (%i refits, %i rebuilds)", scene.GetDeformedMeshCount(),
+			scene.GetBLASRefitTime().count() / 1000.f, scene.GetBLASRebuildTime().count() / 1000.f, scene.GetBLASRefitCount(), scene.GetBLASRebuildCount());
 	ImGui::Text("Frame: %5.2f ms (%.1ffps)", m_avg, m_fps);
 	ImGui::Text("spp: %i", spp);
 	ImGui::Text("Energy: %fk", energy / 1000);
 	ImGui::Text("RPS: %.1f Mrays/s", m_rps);
+	ImGui::Text("All rays: %.1f Mrays/s", m_pathRps);
+	if (m_wavefront)
+	{
+		ImGui::Text("Extend: %.2f ms, shade: %.2f ms", m_extendTime * 1000, m_shadeTime * 1000);
+		ImGui::Text("Waves: %i", m_waves);
+		ImGui::Checkbox("Sort bounce rays", &m_sortRays);
+		ImGui::Text("Sort: %.2f ms, %i of %i waves", m_sortTime * 1000, m_sortedWaves, m_waves);
+		ImGui::Text("Extend: %.1f ns/ray sorted, %.1f ns/ray unsorted", m_sortedNsPerRay, m_unsortedNsPerRay);
+		// the traversal time the sort saves on this frame's qualifying rays, once both modes ran
+		if (m_sortedNsPerRay > 0 && m_unsortedNsPerRay > 0)
+			ImGui::Text("Sort saves %.2f ms of extend for %.2f ms of sorting", (m_unsortedNsPerRay - m_sortedNsPerRay) * m_sortedWaveRays * 1e-6f, m_sortTime * 1000);
+	}
+	else
+	{
+		ImGui::Text("Primary rays: %.1f Mrays/s", m_primaryRps);
+		ImGui::Text("Secondary rays: %.1f Mrays/s (incl. shading)", m_secondaryRps);
+	}
 	ImGui::Text("Camera Pos: (%.2f, %.2f, %.2f)", camera.camPos.x, camera.camPos.y, camera.camPos.z);
 	ImGui::Text("Camera Target: (%.2f, %.2f, %.2f)", camera.camTarget.x, camera.camTarget.y, camera.camTarget.z);
+	if (ImGui::CollapsingHeader("BLAS builds"))
+	{
+		// build throughput per object, to compare the linear builders with the SAH build
+		for (const BLASBuildInfo& info : scene.GetBLASBuildInfo())
+		{
+			ImGui::Text("%s: %i tris, %.2f ms, %.2f Mtris/s, SAH %.1f", info.builder, info.triangleCount,
+				info.buildTime.count() / 1000.f, info.triangleCount / (float)max(1ll, (long long)info.buildTime.count()), info.sahCost);
+			if (info.nodeCount > 0)
+				ImGui::Text("  %i nodes, %.2f references per triangle", info.nodeCount, info.duplication);
+			if (info.optimizeTime.count() > 0)
+				ImGui::Text("  optimized in %.2f ms, SAH %.1f -> %.1f", info.optimizeTime.count() / 1000.f, info.sahCostBeforeOptimize, info.sahCost);
+		}
+	}
+	if (ImGui::CollapsingHeader("Structure selection"))
+	{
+		// the structure each auto mesh got and what the candidates cost per sample ray
+		for (const BLASTuning& tuning : scene.GetBLASTunings())
+		{
+			ImGui::Text("%s: %s%s", tuning.modelLocation.c_str(), blasCandidateNames[tuning.best], tuning.cached ? " (cached)" : "");
+			for (int c = 0; c < BLAS_CANDIDATE_COUNT; c++)
+				ImGui::Text("  %s %.1f ns/ray", blasCandidateNames[c], tuning.nsPerRay[c]);
+		}
+	}
 	// reset accumulator if changes have been made
 	if (changed) ClearAccumulator();
 }
\ No newline at end of file
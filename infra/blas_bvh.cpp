@@ -1,7 +1,9 @@
 #include "precomp.h"
+#include <future>
 #include "blas_bvh.h"
+#include "bvh_builder.h"
 
-BLASBVH::BLASBVH(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat)
+BLASBVH::BLASBVH(const int idx, const std::string& modelPath, const BVHBuildSettings& settings)
 {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -57,13 +59,16 @@ BLASBVH::BLASBVH(const int idx, const std::string& modelPath, const mat4 transfo
     }
 
     objIdx = idx;
+    builder = settings.builder;
+    optimizeIterations = settings.optimizeIterations;
+    optimizeBudget = settings.optimizeBudget;
 
     for (int i = 0; i < indices.size(); i += 3)
     {
         Tri tri(
-            TransformPosition(vertices[indices[i]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 1]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 2]].position, scaleMat),
+            vertices[indices[i]].position,
+            vertices[indices[i + 1]].position,
+            vertices[indices[i + 2]].position,
             vertices[indices[i]].normal,
             vertices[indices[i + 1]].normal,
             vertices[indices[i + 2]].normal,
@@ -76,185 +81,1043 @@ BLASBVH::BLASBVH(const int idx, const std::string& modelPath, const mat4 transfo
     }
 
     Build();
-    SetTransform(transform);
 }
 
+// jobs for the linear builders, see BLASBVH::BuildLBVH
+static struct BLASLBVHJob : public Job
+{
+    void Main()
+    {
+        if (pass == 0) GrowCentroidBounds(bvh->triangles, bvh->triangleIndices.data(), first, count, cmin, cmax);
+        else if (pass == 1) bvh->ComputeMortonCodes(first, count, cmin, scale);
+        else if (pass == 2) bvh->CountRadixDigits(first, count, shift, digits);
+        else if (pass == 3) bvh->ScatterRadixDigits(first, count, shift, digits);
+        else bvh->BuildLBVHSubtrees(first, count);
+    }
+    BLASLBVHJob* Init(BLASBVH* b, int p, uint f, uint c)
+    {
+        bvh = b, pass = p, first = f, count = c;
+        return this;
+    }
+    BLASBVH* bvh;
+    int pass;
+    uint first, count, shift;
+    float3 cmin, cmax, scale;
+    uint digits[256]; // per digit count, then the first output slot of this job
+} blasLBVHJob[64];
+
+// runs the first jobCount LBVH jobs, on this thread if there is only one
+static void RunLBVHJobs(const uint jobCount, const int pass)
+{
+    for (uint i = 0; i < jobCount; i++) blasLBVHJob[i].pass = pass;
+    if (jobCount == 1)
+    {
+        blasLBVHJob[0].Main();
+        return;
+    }
+    JobManager* jm = JobManager::GetJobManager();
+    for (uint i = 0; i < jobCount; i++) jm->AddJob2(&blasLBVHJob[i]);
+    jm->RunJobs();
+}
+
+#define BLAS_BVH_NO_CUT 0xffffffff // refit a whole subtree, see BLASBVH::RefitNode
+
+// jobs for deforming BLASes, see BLASBVH::Deform
+static struct BLASDeformJob : public Job
+{
+    void Main()
+    {
+        if (pass == 0) bvh->DeformTriangles(first, count, *deform);
+        else for (uint i = first; i < first + count; i++) bvh->RefitNode(roots[i], 0, BLAS_BVH_NO_CUT);
+    }
+    BLASDeformJob* Init(BLASBVH* b, int p, uint f, uint c)
+    {
+        bvh = b, pass = p, first = f, count = c;
+        return this;
+    }
+    BLASBVH* bvh;
+    int pass;
+    uint first, count;
+    const TriDeformer* deform;
+    const uint* roots; // subtrees below the cut of the refit
+} blasDeformJob[64];
+
+// runs the first jobCount deform jobs, on this thread if there is only one
+static void RunDeformJobs(const uint jobCount)
+{
+    if (jobCount == 1)
+    {
+        blasDeformJob[0].Main();
+        return;
+    }
+    JobManager* jm = JobManager::GetJobManager();
+    for (uint i = 0; i < jobCount; i++) jm->AddJob2(&blasDeformJob[i]);
+    jm->RunJobs();
+}
+
+// copy of a deforming BLAS that is rebuilt on a thread of its own, see BLASBVH::Rebuild
+struct Tmpl8::BVHRebuild
+{
+    BLASBVH bvh;
+    std::future<void> done;
+};
+
 void BLASBVH::Build()
 {
+    RestoreSourceTriangles();
+    if (builder == BVH_BUILDER_SAH) BuildSAH();
+    else
+    {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        BuildLBVH(builder == BVH_BUILDER_HLBVH);
+        auto endTime = std::chrono::high_resolution_clock::now();
+        buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    }
+    // the builder reserves 2N-1 nodes, keep only the ones in use
+    bvhNodes.resize(nodesUsed);
+    bvhNodes.shrink_to_fit();
+    sahCost = sahCostBeforeOptimize = CalculateSAHCost();
+    if (optimizeIterations > 0 || optimizeBudget > 0) Optimize(optimizeIterations, optimizeBudget);
+    builtSahCost = sahCost;
+    duplication = (float)triangleIndices.size() / triangles.size();
+#ifdef BLAS_BVH_REORDER
+    ReorderTriangles();
+#endif
+    BuildTriAccel(triangles, triAccel);
+    BuildTriPacks();
+}
+
+void BLASBVH::BuildSAH()
+{
+#ifdef BLAS_BVH_SBVH
     auto startTime = std::chrono::high_resolution_clock::now();
-    triangleIndices.resize(triangles.size());
-    // populate triangle index array
-    for (int i = 0; i < triangles.size(); i++)
-    {
-        // setup indices
-        triangleIndices[i] = i;
-    }
-    // assign all triangles to root node
-    bvhNodes.resize(triangles.size() * 2 - 1);
-    BVHNode& root = bvhNodes[rootNodeIdx];
-    root.leftFirst = 0;
-    root.triCount = triangles.size();
-    UpdateNodeBounds(rootNodeIdx);
-    // subdivide recursively
-    Subdivide(rootNodeIdx, 0);
+    BuildSBVH();
     auto endTime = std::chrono::high_resolution_clock::now();
     buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+#else
+#ifdef BLAS_BVH_BUILD_COMPARE
+    auto serialStartTime = std::chrono::high_resolution_clock::now();
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, false);
+    auto serialEndTime = std::chrono::high_resolution_clock::now();
+    serialBuildTime = std::chrono::duration_cast<std::chrono::microseconds>(serialEndTime - serialStartTime);
+    std::vector<BVHNode> serialNodes(bvhNodes.begin(), bvhNodes.begin() + nodesUsed);
+    std::vector<uint> serialIndices = triangleIndices;
+#endif
+    auto startTime = std::chrono::high_resolution_clock::now();
+#ifdef BLAS_BVH_PARALLEL_BUILD
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, true);
+#else
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, false);
+#endif
+    auto endTime = std::chrono::high_resolution_clock::now();
+    buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+#ifdef BLAS_BVH_BUILD_COMPARE
+    // the parallel builder must produce exactly the same tree
+    assert(serialNodes.size() == nodesUsed);
+    assert(memcmp(serialNodes.data(), bvhNodes.data(), nodesUsed * sizeof(BVHNode)) == 0);
+    assert(serialIndices == triangleIndices);
+#endif
+#endif
+}
+
+void BLASBVH::ReorderTriangles()
+{
+    // store the triangles in leaf order, so the leaves index them directly;
+    // references duplicated by spatial splits become copies of the triangle
+    std::vector<Tri> ordered(triangleIndices.size());
+    for (uint i = 0; i < triangleIndices.size(); i++) ordered[i] = triangles[triangleIndices[i]];
+    duplicatedTriangles = ordered.size() - triangles.size();
+    triangles.swap(ordered);
+    // the rest pose of a deforming BLAS keeps matching the triangles
+    if (!restTriangles.empty())
+    {
+        std::vector<Tri> orderedRest(triangleIndices.size());
+        for (uint i = 0; i < triangleIndices.size(); i++) orderedRest[i] = restTriangles[triangleIndices[i]];
+        restTriangles.swap(orderedRest);
+    }
+    // a rebuild starts from the loaded triangles again, see RestoreSourceTriangles
+    if (duplicatedTriangles > 0) sourceTriangle.swap(triangleIndices);
+    std::vector<uint>().swap(triangleIndices);
+}
+
+void BLASBVH::RestoreSourceTriangles()
+{
+    // drop the copies of the duplicated triangles, so spatial splits do not split them again; the
+    // copies of a triangle are equal, as Deform moves each from the same rest pose
+    if (sourceTriangle.empty()) return;
+    const uint N = triangles.size() - duplicatedTriangles;
+    std::vector<Tri> source(N);
+    for (uint i = 0; i < triangles.size(); i++) source[sourceTriangle[i]] = triangles[i];
+    triangles.swap(source);
+    if (!restTriangles.empty())
+    {
+        std::vector<Tri> sourceRest(N);
+        for (uint i = 0; i < restTriangles.size(); i++) sourceRest[sourceTriangle[i]] = restTriangles[i];
+        restTriangles.swap(sourceRest);
+    }
+    std::vector<uint>().swap(sourceTriangle);
+    duplicatedTriangles = 0;
+}
+
+void BLASBVH::BuildTriPacks()
+{
+    // pack p holds leaf positions [8p, 8p + 8), a leaf tests the packs it overlaps
+    triPacks.clear();
+    if (!UseTriPacks()) return;
+    if (triangleIndices.empty())
+    {
+        std::vector<uint> order(triangles.size());
+        for (uint i = 0; i < order.size(); i++) order[i] = i;
+        AppendTriPacks(triAccel, order.data(), (uint)order.size(), triPacks);
+    }
+    else AppendTriPacks(triAccel, triangleIndices.data(), (uint)triangleIndices.size(), triPacks);
 }
 
 void BLASBVH::Refit()
 {
-    for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+    BuildTriAccel(triangles, triAccel);
+    BuildTriPacks();
+    RefitNodes();
+}
+
+// the nodes at depth cutDepth below nodeIdx, and the leaves above it
+static void CollectRefitCut(BVHNode* nodes, uint nodeIdx, uint depth, uint cutDepth, std::vector<uint>& cut)
+{
+    if (depth == cutDepth) cut.push_back(nodeIdx);
+    else if (!nodes[nodeIdx].isLeaf())
     {
-        BVHNode& node = bvhNodes[i];
-        if (node.isLeaf())
+        CollectRefitCut(nodes, nodes[nodeIdx].leftFirst, depth + 1, cutDepth, cut);
+        CollectRefitCut(nodes, nodes[nodeIdx].leftFirst + 1, depth + 1, cutDepth, cut);
+    }
+}
+
+void BLASBVH::RefitNodes()
+{
+    // Bottom-up over the tree as it is. The optimizer moves nodes around, so a child may have a lower
+    // index than its parent; the refit follows the child links instead of the node order. Larger trees
+    // are cut at the depth where there are enough subtrees to keep the workers busy: the workers refit
+    // the subtrees below the cut, this thread the few levels above it.
+    const uint workers = nodesUsed < BLAS_BVH_MIN_TASK_SIZE ? 1 : min(64u, JobManager::GetJobManager()->GetNumThreads());
+    uint cutDepth = BLAS_BVH_NO_CUT;
+    if (workers > 1)
+    {
+        cutDepth = 0;
+        while ((1u << cutDepth) < workers * 8) cutDepth++;
+        std::vector<uint> cut;
+        CollectRefitCut(bvhNodes.data(), rootNodeIdx, 0, cutDepth, cut);
+        const uint cutSize = cut.size();
+        const uint jobCount = min(workers, cutSize), jobSize = (cutSize + jobCount - 1) / jobCount;
+        for (uint i = 0; i < jobCount; i++)
         {
-            // leaf node: adjust bounds to contained triangles
-            UpdateNodeBounds(i);
-            continue;
+            const uint first = min(i * jobSize, cutSize);
+            blasDeformJob[i].Init(this, 1, first, min(jobSize, cutSize - first))->roots = cut.data();
         }
-        // interior node: adjust bounds to child node bounds
-        BVHNode& leftChild = bvhNodes[node.leftFirst];
-        BVHNode& rightChild = bvhNodes[node.leftFirst + 1];
-        node.aabbMin = fminf(leftChild.aabbMin, rightChild.aabbMin);
-        node.aabbMax = fmaxf(leftChild.aabbMax, rightChild.aabbMax);
+        RunDeformJobs(jobCount);
     }
+    RefitNode(rootNodeIdx, 0, cutDepth);
+    sahCost = CalculateSAHCost();
 }
 
-void BLASBVH::UpdateNodeBounds(uint nodeIdx)
+void BLASBVH::RefitNode(uint nodeIdx, uint depth, uint cutDepth)
 {
+    // the subtrees below the cut are refitted already
+    if (depth == cutDepth) return;
     BVHNode& node = bvhNodes[nodeIdx];
-    node.aabbMin = float3(1e30f);
-    node.aabbMax = float3(-1e30f);
-    for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+    if (node.isLeaf())
     {
-        uint leafTriIdx = triangleIndices[first + i];
-        Tri& leafTri = triangles[leafTriIdx];
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex0);
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex1);
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex2);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex0);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex1);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex2);
+        // leaf node: adjust bounds to contained triangles
+        UpdateNodeBounds(node);
+        return;
     }
+    RefitNode(node.leftFirst, depth + 1, cutDepth);
+    RefitNode(node.leftFirst + 1, depth + 1, cutDepth);
+    // interior node: adjust bounds to child node bounds
+    BVHNode& leftChild = bvhNodes[node.leftFirst];
+    BVHNode& rightChild = bvhNodes[node.leftFirst + 1];
+    node.aabbMin = fminf(leftChild.aabbMin, rightChild.aabbMin);
+    node.aabbMax = fmaxf(leftChild.aabbMax, rightChild.aabbMax);
 }
 
-void BLASBVH::Subdivide(uint nodeIdx, uint depth)
+void BLASBVH::Deform(const TriDeformer& deform)
 {
-    // terminate recursion
-    BVHNode& node = bvhNodes[nodeIdx];
-    if (node.triCount <= 2) return;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // the triangles as loaded are the rest pose
+    if (restTriangles.empty()) restTriangles = triangles;
+#ifdef BLAS_BVH_BACKGROUND_REBUILD
+    if (rebuild && rebuild->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready) FinishRebuild();
+#endif
+    // deform the triangles and their intersection data in parallel, then refit the tree to them
+    const uint N = triangles.size();
+    triAccel.resize(N);
+    const uint jobCount = N < BLAS_BVH_MIN_TASK_SIZE ? 1 : min(64u, JobManager::GetJobManager()->GetNumThreads() * 4);
+    const uint jobSize = (N + jobCount - 1) / jobCount;
+    for (uint i = 0; i < jobCount; i++)
+    {
+        const uint first = min(i * jobSize, N);
+        blasDeformJob[i].Init(this, 0, first, min(jobSize, N - first))->deform = &deform;
+    }
+    RunDeformJobs(jobCount);
+    BuildTriPacks();
+    RefitNodes();
+    refitCount++;
+    auto endTime = std::chrono::high_resolution_clock::now();
+    refitTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    // refitting keeps the topology, which gets worse as the triangles move away from where it was built
+    if (sahCost > builtSahCost * BLAS_BVH_REBUILD_RATIO) Rebuild();
+}
 
-#ifdef BLAS_BVH_SAH
-    // determine split axis using SAH
-    int axis;
-    float splitPos;
-    float splitCost = FindBestSplitPlane(node, axis, splitPos);
+void BLASBVH::DeformTriangles(uint first, uint count, const TriDeformer& deform)
+{
+    for (uint i = first; i < first + count; i++)
+    {
+        Tri& tri = triangles[i];
+        deform(restTriangles[i], tri);
+        tri.centroid = (tri.vertex0 + tri.vertex1 + tri.vertex2) * 0.3333f;
+        triAccel[i] = TriAccel(tri);
+    }
+}
 
-    float nosplitCost = CalculateNodeCost(node);
-    if (splitCost >= nosplitCost) return;
+void BLASBVH::Rebuild()
+{
+#ifdef BLAS_BVH_BACKGROUND_REBUILD
+    // A copy of the triangles is built with the serial SAH builder, which uses neither the job system
+    // nor shared state, so it runs next to the rendering. The triangles move on in the meantime, but
+    // the tree only groups them: Deform refits it to the current pose when it takes it over.
+    if (rebuild) return;
+    rebuild = new BVHRebuild();
+    BLASBVH& copy = rebuild->bvh;
+    copy.triangles = triangles;
+    copy.restTriangles = restTriangles;
+    copy.duplicatedTriangles = duplicatedTriangles;
+    copy.sourceTriangle = sourceTriangle;
+    rebuild->done = std::async(std::launch::async, [&copy]()
+    {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        copy.RestoreSourceTriangles();
+        BuildBVHNodes(copy.triangles, copy.bvhNodes, copy.triangleIndices, copy.nodesUsed, copy.maxDepth, false);
+        copy.bvhNodes.resize(copy.nodesUsed);
+        copy.bvhNodes.shrink_to_fit();
+        copy.builtSahCost = copy.CalculateSAHCost();
+#ifdef BLAS_BVH_REORDER
+        copy.ReorderTriangles();
+#endif
+        auto endTime = std::chrono::high_resolution_clock::now();
+        copy.rebuildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    });
 #else
-    // split plane axis and position
-    float3 extent = node.aabbMax - node.aabbMin;
-    int axis = 0;
-    if (extent.y > extent.x) axis = 1;
-    if (extent.z > extent[axis]) axis = 2;
-    float splitPos = node.aabbMin[axis] + extent[axis] * 0.5f;
+    // the builder of the BLAS on this thread, so a linear builder keeps the stall short
+    auto startTime = std::chrono::high_resolution_clock::now();
+    const std::chrono::microseconds loadBuildTime = buildTime;
+    Build();
+    auto endTime = std::chrono::high_resolution_clock::now();
+    rebuildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    buildTime = loadBuildTime;
+    rebuildCount++;
 #endif
-    // split the group in two halves
-    int i = node.leftFirst;
-    int j = i + node.triCount - 1;
-    while (i <= j)
-    {
-        if (triangles[triangleIndices[i]].centroid[axis] < splitPos)
-            i++;
-        else
-            swap(triangleIndices[i], triangleIndices[j--]);
-    }
+}
 
-    // creating child nodes for each half
-    int leftCount = i - node.leftFirst;
-    if (leftCount == 0 || leftCount == node.triCount) return;
-    // create child nodes
-    int leftChildIdx = nodesUsed++;
-    int rightChildIdx = nodesUsed++;
+BLASBVH::~BLASBVH()
+{
+    // a background rebuild still works on its copy
+    if (!rebuild) return;
+    rebuild->done.wait();
+    delete rebuild;
+}
 
-    bvhNodes[leftChildIdx].leftFirst = node.leftFirst;
-    bvhNodes[leftChildIdx].triCount = leftCount;
-    bvhNodes[rightChildIdx].leftFirst = i;
-    bvhNodes[rightChildIdx].triCount = node.triCount - leftCount;
-    node.leftFirst = leftChildIdx;
-    node.triCount = 0;
-    UpdateNodeBounds(leftChildIdx);
-    UpdateNodeBounds(rightChildIdx);
-    if (depth > maxDepth) maxDepth = depth;
-    // recurse
-    Subdivide(leftChildIdx, depth + 1);
-    Subdivide(rightChildIdx, depth + 1);
+void BLASBVH::FinishRebuild()
+{
+    // take over the tree of the copy, and its triangle order
+    rebuild->done.get();
+    BLASBVH& copy = rebuild->bvh;
+    bvhNodes.swap(copy.bvhNodes);
+    triangles.swap(copy.triangles);
+    restTriangles.swap(copy.restTriangles);
+    triangleIndices.swap(copy.triangleIndices);
+    sourceTriangle.swap(copy.sourceTriangle);
+    duplicatedTriangles = copy.duplicatedTriangles, duplication = 1; // the serial builder makes no spatial splits
+    nodesUsed = copy.nodesUsed, maxDepth = copy.maxDepth;
+    builtSahCost = copy.builtSahCost;
+    rebuildTime = copy.rebuildTime;
+    rebuildCount++;
+    delete rebuild;
+    rebuild = 0;
+}
+
+void BLASBVH::UpdateNodeBounds(uint nodeIdx)
+{
+    UpdateNodeBounds(bvhNodes[nodeIdx]);
+}
+
+void BLASBVH::UpdateNodeBounds(BVHNode& node)
+{
+    FitBVHNode(node, triangles, triangleIndices.empty() ? 0 : triangleIndices.data());
 }
 
-float BLASBVH::CalculateNodeCost(BVHNode& node)
+// Surface area of the overlap of two boxes, zero when they are disjoint; aabb::Area of the inverted box
+// Intersection gives would multiply two negative extents into a positive area.
+static float OverlapArea(const aabb& a, const aabb& b)
 {
-    float3 e = node.aabbMax - node.aabbMin; // extent of the node
-    float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-    return node.triCount * surfaceArea;
+    const aabb overlap = a.Intersection(b);
+    float3 e = overlap.bmax3 - overlap.bmin3;
+    if (e.x < 0 || e.y < 0 || e.z < 0) return 0;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
 }
 
-float BLASBVH::FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
+void BLASBVH::BuildSBVH()
 {
+    // every reference starts as the full bounds of its triangle
+    std::vector<SBVHRef> refs(triangles.size());
+    aabb rootBounds;
+    for (uint i = 0; i < triangles.size(); i++)
+    {
+        refs[i].bounds = triangles[i].GetBounds();
+        refs[i].triIdx = i;
+        rootBounds.Grow(refs[i].bounds);
+    }
+    triangleIndices.clear();
+    triangleIndices.reserve(triangles.size());
+    bvhNodes.clear();
+    bvhNodes.reserve(triangles.size() * 2);
+    bvhNodes.push_back(BVHNode());
+    nodesUsed = 1, maxDepth = 0;
+    sbvhRootArea = rootBounds.Area();
+    sbvhRefCount = triangles.size();
+    SubdivideSBVH(rootNodeIdx, refs, 0);
+    nodesUsed = bvhNodes.size();
+}
+
+void BLASBVH::SubdivideSBVH(uint nodeIdx, std::vector<SBVHRef>& refs, uint depth)
+{
+    aabb bounds;
+    for (const SBVHRef& ref : refs) bounds.Grow(ref.bounds);
+    bvhNodes[nodeIdx].aabbMin = bounds.bmin3;
+    bvhNodes[nodeIdx].aabbMax = bounds.bmax3;
+    if (depth > maxDepth) maxDepth = depth;
+
+    // object split over the reference centroids
+    int axis = -1;
+    float splitPos = 0;
+    aabb leftBounds, rightBounds;
     float bestCost = 1e30f;
-    for (int a = 0; a < 3; a++)
+    bool spatial = false;
+    // the traversal stack holds 64 entries
+    bool canSplit = refs.size() > 2 && depth < 60;
+    if (canSplit) bestCost = FindObjectSplit(refs, axis, splitPos, leftBounds, rightBounds);
+    // spatial split, only where the children of the object split overlap noticeably
+    if (canSplit && sbvhRefCount < triangles.size() * BLAS_BVH_SBVH_BUDGET &&
+        (axis == -1 || OverlapArea(leftBounds, rightBounds) > BLAS_BVH_SBVH_ALPHA * sbvhRootArea))
     {
-        float boundsMin = 1e30f, boundsMax = -1e30f;
-        for (int i = 0; i < node.triCount; i++)
+        int spatialAxis = -1;
+        float spatialPos = 0;
+        float spatialCost = FindSpatialSplit(refs, bounds, spatialAxis, spatialPos);
+        if (spatialCost < bestCost)
+            bestCost = spatialCost, axis = spatialAxis, splitPos = spatialPos, spatial = true;
+    }
+    std::vector<SBVHRef> leftRefs, rightRefs;
+    float nosplitCost = refs.size() * bounds.Area();
+    if (axis != -1 && bestCost < nosplitCost)
+    {
+        if (spatial) PartitionSpatial(refs, axis, splitPos, leftRefs, rightRefs);
+        else for (const SBVHRef& ref : refs)
         {
-            Tri& triangle = triangles[triangleIndices[node.leftFirst + i]];
-            boundsMin = min(boundsMin, triangle.centroid[a]);
-            boundsMax = max(boundsMax, triangle.centroid[a]);
+            if (ref.bounds.Center(axis) < splitPos) leftRefs.push_back(ref);
+            else rightRefs.push_back(ref);
         }
+    }
+    if (leftRefs.empty() || rightRefs.empty())
+    {
+        // leaf node: append the references to the triangle index list
+        BVHNode& node = bvhNodes[nodeIdx];
+        node.leftFirst = triangleIndices.size();
+        node.triCount = refs.size();
+        for (const SBVHRef& ref : refs) triangleIndices.push_back(ref.triIdx);
+        return;
+    }
+    std::vector<SBVHRef>().swap(refs);
+
+    // create child nodes
+    uint leftChildIdx = bvhNodes.size();
+    bvhNodes.push_back(BVHNode());
+    bvhNodes.push_back(BVHNode());
+    bvhNodes[nodeIdx].leftFirst = leftChildIdx;
+    bvhNodes[nodeIdx].triCount = 0;
+    // recurse
+    SubdivideSBVH(leftChildIdx, leftRefs, depth + 1);
+    SubdivideSBVH(leftChildIdx + 1, rightRefs, depth + 1);
+}
+
+float BLASBVH::FindObjectSplit(const std::vector<SBVHRef>& refs, int& axis, float& splitPos, aabb& leftBounds, aabb& rightBounds)
+{
+    float bestCost = 1e30f;
+    aabb centroidBounds;
+    for (const SBVHRef& ref : refs) centroidBounds.Grow(ref.bounds.Center());
+    for (int a = 0; a < 3; a++)
+    {
+        float boundsMin = centroidBounds.bmin[a], boundsMax = centroidBounds.bmax[a];
         if (boundsMin == boundsMax) continue;
         // populate the bins
-        Bin bin[BLAS_BVH_BINS];
-        float scale = BLAS_BVH_BINS / (boundsMax - boundsMin);
-        for (uint i = 0; i < node.triCount; i++)
+        Bin bin[BVH_BINS];
+        float scale = BVH_BINS / (boundsMax - boundsMin);
+        for (const SBVHRef& ref : refs)
         {
-            Tri& triangle = triangles[triangleIndices[node.leftFirst + i]];
-            int binIdx = min(BLAS_BVH_BINS - 1,
-                (int)((triangle.centroid[a] - boundsMin) * scale));
+            int binIdx = min(BVH_BINS - 1, (int)((ref.bounds.Center(a) - boundsMin) * scale));
             bin[binIdx].triCount++;
-            bin[binIdx].bounds.Grow(triangle.vertex0);
-            bin[binIdx].bounds.Grow(triangle.vertex1);
-            bin[binIdx].bounds.Grow(triangle.vertex2);
+            bin[binIdx].bounds.Grow(ref.bounds);
         }
-        // gather data for the 7 planes between the 8 bins
-        float leftArea[BLAS_BVH_BINS - 1], rightArea[BLAS_BVH_BINS - 1];
-        int leftCount[BLAS_BVH_BINS - 1], rightCount[BLAS_BVH_BINS - 1];
+        bestCost = EvaluateBins(bin, a, boundsMin, boundsMax, bestCost, axis, splitPos);
+    }
+    // bounds of the children of the best plane, for the overlap test
+    if (axis != -1) for (const SBVHRef& ref : refs)
+    {
+        if (ref.bounds.Center(axis) < splitPos) leftBounds.Grow(ref.bounds);
+        else rightBounds.Grow(ref.bounds);
+    }
+    return bestCost;
+}
+
+float BLASBVH::FindSpatialSplit(const std::vector<SBVHRef>& refs, const aabb& bounds, int& axis, float& splitPos)
+{
+    float bestCost = 1e30f;
+    for (int a = 0; a < 3; a++)
+    {
+        float boundsMin = bounds.bmin[a], boundsMax = bounds.bmax[a];
+        if (boundsMax - boundsMin <= 0) continue;
+        // clip each reference against the bins it overlaps
+        aabb binBounds[BLAS_BVH_SBVH_BINS];
+        int entryCount[BLAS_BVH_SBVH_BINS] = {}, exitCount[BLAS_BVH_SBVH_BINS] = {};
+        float binWidth = (boundsMax - boundsMin) / BLAS_BVH_SBVH_BINS;
+        for (const SBVHRef& ref : refs)
+        {
+            int first = clamp((int)((ref.bounds.bmin[a] - boundsMin) / binWidth), 0, BLAS_BVH_SBVH_BINS - 1);
+            int last = clamp((int)((ref.bounds.bmax[a] - boundsMin) / binWidth), first, BLAS_BVH_SBVH_BINS - 1);
+            SBVHRef rest = ref;
+            for (int i = first; i < last; i++)
+            {
+                SBVHRef left, right;
+                SplitReference(rest, a, boundsMin + binWidth * (i + 1), left, right);
+                binBounds[i].Grow(left.bounds);
+                rest = right;
+            }
+            binBounds[last].Grow(rest.bounds);
+            entryCount[first]++, exitCount[last]++;
+        }
+        // sweep the planes between the bins
+        float rightArea[BLAS_BVH_SBVH_BINS - 1];
+        int rightCount[BLAS_BVH_SBVH_BINS - 1];
         aabb leftBox, rightBox;
         int leftSum = 0, rightSum = 0;
-        for (int i = 0; i < BLAS_BVH_BINS - 1; i++)
+        for (int i = BLAS_BVH_SBVH_BINS - 1; i > 0; i--)
         {
-            leftSum += bin[i].triCount;
-            leftCount[i] = leftSum;
-            leftBox.Grow(bin[i].bounds);
-            leftArea[i] = leftBox.Area();
-            rightSum += bin[BLAS_BVH_BINS - 1 - i].triCount;
-            rightCount[BLAS_BVH_BINS - 2 - i] = rightSum;
-            rightBox.Grow(bin[BLAS_BVH_BINS - 1 - i].bounds);
-            rightArea[BLAS_BVH_BINS - 2 - i] = rightBox.Area();
+            rightSum += exitCount[i];
+            rightBox.Grow(binBounds[i]);
+            rightCount[i - 1] = rightSum, rightArea[i - 1] = rightBox.Area();
         }
-        // calculate SAH cost for the 7 planes
-        scale = (boundsMax - boundsMin) / BLAS_BVH_BINS;
-        for (int i = 0; i < BLAS_BVH_BINS - 1; i++)
+        for (int i = 0; i < BLAS_BVH_SBVH_BINS - 1; i++)
         {
-            float planeCost =
-                leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            leftSum += entryCount[i];
+            leftBox.Grow(binBounds[i]);
+            float planeCost = leftSum * leftBox.Area() + rightCount[i] * rightArea[i];
             if (planeCost < bestCost)
-                axis = a, splitPos = boundsMin + scale * (i + 1),
+                axis = a, splitPos = boundsMin + binWidth * (i + 1),
                 bestCost = planeCost;
         }
     }
     return bestCost;
 }
 
+void BLASBVH::PartitionSpatial(const std::vector<SBVHRef>& refs, int axis, float splitPos, std::vector<SBVHRef>& leftRefs, std::vector<SBVHRef>& rightRefs)
+{
+    // references on one side of the plane
+    aabb leftBounds, rightBounds;
+    std::vector<const SBVHRef*> straddling;
+    for (const SBVHRef& ref : refs)
+    {
+        if (ref.bounds.bmax[axis] <= splitPos) leftRefs.push_back(ref), leftBounds.Grow(ref.bounds);
+        else if (ref.bounds.bmin[axis] >= splitPos) rightRefs.push_back(ref), rightBounds.Grow(ref.bounds);
+        else straddling.push_back(&ref);
+    }
+    // straddling references are split, unless moving them to one side is cheaper
+    uint leftCount = leftRefs.size() + straddling.size(), rightCount = rightRefs.size() + straddling.size();
+    for (const SBVHRef* ref : straddling)
+    {
+        SBVHRef left, right;
+        SplitReference(*ref, axis, splitPos, left, right);
+        aabb splitLeft = aabb::Union(leftBounds, left.bounds), splitRight = aabb::Union(rightBounds, right.bounds);
+        float splitCost = splitLeft.Area() * leftCount + splitRight.Area() * rightCount;
+        float leftCost = aabb::Union(leftBounds, ref->bounds).Area() * leftCount + rightBounds.Area() * (rightCount - 1);
+        float rightCost = leftBounds.Area() * (leftCount - 1) + aabb::Union(rightBounds, ref->bounds).Area() * rightCount;
+        if (leftCost < splitCost && leftCost <= rightCost)
+        {
+            leftRefs.push_back(*ref), leftBounds.Grow(ref->bounds);
+            rightCount--;
+        }
+        else if (rightCost < splitCost)
+        {
+            rightRefs.push_back(*ref), rightBounds.Grow(ref->bounds);
+            leftCount--;
+        }
+        else
+        {
+            leftRefs.push_back(left), leftBounds = splitLeft;
+            rightRefs.push_back(right), rightBounds = splitRight;
+            sbvhRefCount++;
+        }
+    }
+}
+
+void BLASBVH::SplitReference(const SBVHRef& ref, int axis, float splitPos, SBVHRef& left, SBVHRef& right)
+{
+    // clip the triangle against the plane, then against the bounds of the reference
+    left.triIdx = right.triIdx = ref.triIdx;
+    left.bounds = aabb(), right.bounds = aabb();
+    const Tri& tri = triangles[ref.triIdx];
+    float3 vertices[3] = { tri.vertex0, tri.vertex1, tri.vertex2 };
+    for (int i = 0; i < 3; i++)
+    {
+        float3 v0 = vertices[i], v1 = vertices[(i + 1) % 3];
+        const float p0 = v0[axis], p1 = v1[axis];
+        if (p0 <= splitPos) left.bounds.Grow(v0);
+        if (p0 >= splitPos) right.bounds.Grow(v0);
+        if ((p0 < splitPos && splitPos < p1) || (p1 < splitPos && splitPos < p0))
+        {
+            float3 p = v0 + (v1 - v0) * clamp((splitPos - p0) / (p1 - p0), 0.0f, 1.0f);
+            p[axis] = splitPos;
+            left.bounds.Grow(p), right.bounds.Grow(p);
+        }
+    }
+    left.bounds = left.bounds.Intersection(ref.bounds);
+    right.bounds = right.bounds.Intersection(ref.bounds);
+}
+
+float BLASBVH::CalculateSAHCost()
+{
+    // cost of the tree relative to the root box, with traversal steps and triangle tests weighted equally
+    float cost = 0;
+    for (uint i = 0; i < nodesUsed; i++)
+    {
+        BVHNode& node = bvhNodes[i];
+        float3 e = node.aabbMax - node.aabbMin;
+        float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
+        cost += node.isLeaf() ? node.triCount * surfaceArea : surfaceArea;
+    }
+    float3 e = bvhNodes[rootNodeIdx].aabbMax - bvhNodes[rootNodeIdx].aabbMin;
+    return cost / (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+// spreads the lowest 21 bits of v, leaving two zero bits between each
+static uint64_t ExpandMortonBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+static uint64_t HighestMortonBit(uint64_t v)
+{
+    v |= v >> 1, v |= v >> 2, v |= v >> 4, v |= v >> 8, v |= v >> 16, v |= v >> 32;
+    return v ^ (v >> 1);
+}
+
+// number of leading codes that go left: the codes are sorted and share all bits above the
+// highest bit in which the first and the last one differ, so split where that bit becomes 1
+static uint SplitMortonRange(const uint64_t* codes, const uint count)
+{
+    const uint64_t a = codes[0], b = codes[count - 1];
+    if (a == b) return count / 2; // identical codes: median split
+    const uint64_t bit = HighestMortonBit(a ^ b);
+    uint lo = 0, hi = count - 1;
+    while (lo < hi)
+    {
+        const uint mid = (lo + hi) / 2;
+        if (codes[mid] & bit) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+}
+
+void BLASBVH::BuildLBVH(bool sahTop)
+{
+    const uint N = triangles.size();
+    triangleIndices.resize(N);
+    for (uint i = 0; i < N; i++) triangleIndices[i] = i;
+    bvhNodes.resize(N * 2 - 1);
+    nodesUsed = 1, maxDepth = 0;
+    // the passes over the triangles are split into equal ranges
+    const uint jobCount = clamp((int)(N / 16384), 1, 64);
+    const uint jobSize = (N + jobCount - 1) / jobCount;
+    for (uint i = 0; i < jobCount; i++)
+    {
+        blasLBVHJob[i].Init(this, 0, i * jobSize, min(jobSize, N - i * jobSize));
+        blasLBVHJob[i].cmin = float3(1e30f), blasLBVHJob[i].cmax = float3(-1e30f);
+    }
+    RunLBVHJobs(jobCount, 0);
+    float3 cmin(1e30f), cmax(-1e30f);
+    for (uint i = 0; i < jobCount; i++) cmin = fminf(cmin, blasLBVHJob[i].cmin), cmax = fmaxf(cmax, blasLBVHJob[i].cmax);
+    // Morton codes of the centroids, quantized to BLAS_BVH_MORTON_BITS / 3 bits per axis
+    const float cells = (float)(1 << (BLAS_BVH_MORTON_BITS / 3));
+    float3 scale, extent = cmax - cmin;
+    for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0 ? cells * 0.9999f / extent[a] : 0;
+    for (uint i = 0; i < jobCount; i++) blasLBVHJob[i].cmin = cmin, blasLBVHJob[i].scale = scale;
+    mortonCodes.resize(N);
+    RunLBVHJobs(jobCount, 1);
+    // parallel LSD radix sort of the codes, 8 bits per pass: the jobs count the digits of their
+    // range, a prefix sum turns the counts into output slots, and the jobs scatter their range
+    sortedCodes.resize(N);
+    sortedIndices.resize(N);
+    for (uint shift = 0; shift < BLAS_BVH_MORTON_BITS; shift += 8)
+    {
+        for (uint i = 0; i < jobCount; i++) blasLBVHJob[i].shift = shift;
+        RunLBVHJobs(jobCount, 2);
+        // a pass in which all codes have the same digit changes nothing
+        uint offset = 0;
+        bool skip = false;
+        for (uint d = 0; d < 256; d++)
+        {
+            uint total = 0;
+            for (uint i = 0; i < jobCount; i++)
+            {
+                const uint c = blasLBVHJob[i].digits[d];
+                blasLBVHJob[i].digits[d] = offset + total;
+                total += c;
+            }
+            if (total == N) skip = true;
+            offset += total;
+        }
+        if (skip) continue;
+        RunLBVHJobs(jobCount, 3);
+        mortonCodes.swap(sortedCodes);
+        triangleIndices.swap(sortedIndices);
+    }
+    // clusters: runs of triangles that share the top BLAS_BVH_HLBVH_BITS bits per axis
+    const uint clusterShift = (BLAS_BVH_MORTON_BITS / 3 - BLAS_BVH_HLBVH_BITS) * 3;
+    std::vector<uint> clusters;
+    for (uint first = 0; first < N;)
+    {
+        uint last = first + 1;
+        while (last < N && (mortonCodes[last] >> clusterShift) == (mortonCodes[first] >> clusterShift)) last++;
+        BVHSubtree subtree;
+        subtree.nodes.resize(1);
+        subtree.nodes[0].leftFirst = first;
+        subtree.nodes[0].triCount = subtree.triCount = last - first;
+        subtree.mortonPrefix = mortonCodes[first] >> clusterShift;
+        clusters.push_back(subtrees.size());
+        subtrees.push_back(std::move(subtree));
+        first = last;
+    }
+    // the clusters are independent LBVH subtrees
+    const uint clusterCount = subtrees.size();
+    const uint subtreeJobs = N < BLAS_BVH_MIN_TASK_SIZE ? 1 : min(clusterCount, min(64u, JobManager::GetJobManager()->GetNumThreads() * 4));
+    const uint subtreeJobSize = (clusterCount + subtreeJobs - 1) / subtreeJobs;
+    for (uint i = 0; i < subtreeJobs; i++)
+    {
+        const uint first = min(i * subtreeJobSize, clusterCount);
+        blasLBVHJob[i].Init(this, 4, first, min(subtreeJobSize, clusterCount - first));
+    }
+    RunLBVHJobs(subtreeJobs, 4);
+    // top levels over the clusters, either on the Morton codes (which gives the same tree as a
+    // plain LBVH) or binned SAH over the cluster bounds
+    std::vector<BVHNode> topNodes(clusterCount * 2 - 1);
+    topSubtree.assign(topNodes.size(), -1);
+    uint topUsed = 1;
+    SubdivideClusters(topNodes, topUsed, 0, clusters.data(), clusterCount, 0, sahTop);
+    EmitBVHNodes(topNodes, subtrees, topSubtree, 0, rootNodeIdx, bvhNodes, nodesUsed);
+    subtrees.clear();
+    topSubtree.clear();
+    std::vector<uint64_t>().swap(mortonCodes);
+    std::vector<uint64_t>().swap(sortedCodes);
+    std::vector<uint>().swap(sortedIndices);
+}
+
+void BLASBVH::ComputeMortonCodes(uint first, uint count, const float3& cmin, const float3& scale)
+{
+    for (uint i = first; i < first + count; i++)
+    {
+        const float3 p = (triangles[triangleIndices[i]].centroid - cmin) * scale;
+        mortonCodes[i] = (ExpandMortonBits((uint64_t)p.x) << 2) | (ExpandMortonBits((uint64_t)p.y) << 1) | ExpandMortonBits((uint64_t)p.z);
+    }
+}
+
+void BLASBVH::CountRadixDigits(uint first, uint count, uint shift, uint* digitCount)
+{
+    memset(digitCount, 0, 256 * sizeof(uint));
+    for (uint i = first; i < first + count; i++) digitCount[(mortonCodes[i] >> shift) & 255]++;
+}
+
+void BLASBVH::ScatterRadixDigits(uint first, uint count, uint shift, uint* digitOffset)
+{
+    for (uint i = first; i < first + count; i++)
+    {
+        const uint slot = digitOffset[(mortonCodes[i] >> shift) & 255]++;
+        sortedCodes[slot] = mortonCodes[i];
+        sortedIndices[slot] = triangleIndices[i];
+    }
+}
+
+void BLASBVH::BuildLBVHSubtrees(uint first, uint count)
+{
+    for (uint i = first; i < first + count; i++)
+    {
+        BVHSubtree& subtree = subtrees[i];
+        subtree.nodes.resize(subtree.nodes[0].triCount * 2 - 1);
+        SubdivideLBVH(subtree.nodes.data(), subtree.used, 0, 0, subtree.deepest);
+    }
+}
+
+void BLASBVH::SubdivideLBVH(BVHNode* nodes, uint& used, uint nodeIdx, uint depth, uint& deepest)
+{
+    BVHNode& node = nodes[nodeIdx];
+    if (node.triCount <= BLAS_BVH_LBVH_LEAF_SIZE)
+    {
+        UpdateNodeBounds(node);
+        return;
+    }
+    const uint leftCount = SplitMortonRange(&mortonCodes[node.leftFirst], node.triCount);
+    // create child nodes
+    int leftChildIdx = used++;
+    int rightChildIdx = used++;
+    nodes[leftChildIdx].leftFirst = node.leftFirst;
+    nodes[leftChildIdx].triCount = leftCount;
+    nodes[rightChildIdx].leftFirst = node.leftFirst + leftCount;
+    nodes[rightChildIdx].triCount = node.triCount - leftCount;
+    node.leftFirst = leftChildIdx;
+    node.triCount = 0;
+    if (depth > deepest) deepest = depth;
+    // recurse, then fit the node around its children
+    SubdivideLBVH(nodes, used, leftChildIdx, depth + 1, deepest);
+    SubdivideLBVH(nodes, used, rightChildIdx, depth + 1, deepest);
+    node.aabbMin = fminf(nodes[leftChildIdx].aabbMin, nodes[rightChildIdx].aabbMin);
+    node.aabbMax = fmaxf(nodes[leftChildIdx].aabbMax, nodes[rightChildIdx].aabbMax);
+}
+
+void BLASBVH::SubdivideClusters(std::vector<BVHNode>& nodes, uint& used, uint nodeIdx, uint* clusters, uint count, uint depth, bool sahTop)
+{
+    if (count == 1)
+    {
+        // the cluster subtree takes the place of this node
+        const BVHSubtree& subtree = subtrees[clusters[0]];
+        nodes[nodeIdx] = subtree.nodes[0];
+        topSubtree[nodeIdx] = clusters[0];
+        if (depth + subtree.deepest > maxDepth) maxDepth = depth + subtree.deepest;
+        return;
+    }
+    uint leftCount = 0;
+    if (sahTop)
+    {
+        // binned SAH over the cluster centroids, weighted by their triangle counts
+        float3 cmin(1e30f), cmax(-1e30f);
+        for (uint i = 0; i < count; i++)
+        {
+            const BVHNode& root = subtrees[clusters[i]].nodes[0];
+            cmin = fminf(cmin, (root.aabbMin + root.aabbMax) * 0.5f);
+            cmax = fmaxf(cmax, (root.aabbMin + root.aabbMax) * 0.5f);
+        }
+        int axis = -1;
+        float splitPos = 0, bestCost = 1e30f;
+        for (int a = 0; a < 3; a++)
+        {
+            if (cmin[a] == cmax[a]) continue;
+            Bin bin[BVH_BINS];
+            const float scale = BVH_BINS / (cmax[a] - cmin[a]);
+            for (uint i = 0; i < count; i++)
+            {
+                const BVHSubtree& subtree = subtrees[clusters[i]];
+                float3 centroid = (subtree.nodes[0].aabbMin + subtree.nodes[0].aabbMax) * 0.5f;
+                int binIdx = min(BVH_BINS - 1, (int)((centroid[a] - cmin[a]) * scale));
+                bin[binIdx].triCount += subtree.triCount;
+                bin[binIdx].bounds.Grow(subtree.nodes[0].aabbMin);
+                bin[binIdx].bounds.Grow(subtree.nodes[0].aabbMax);
+            }
+            bestCost = EvaluateBins(bin, a, cmin[a], cmax[a], bestCost, axis, splitPos);
+        }
+        if (axis != -1) leftCount = std::partition(clusters, clusters + count, [&](uint c)
+            {
+                float3 centroid = (subtrees[c].nodes[0].aabbMin + subtrees[c].nodes[0].aabbMax) * 0.5f;
+                return centroid[axis] < splitPos;
+            }) - clusters;
+    }
+    else
+    {
+        // the clusters are in Morton order and their prefixes are unique, split like SplitMortonRange
+        const uint64_t bit = HighestMortonBit(subtrees[clusters[0]].mortonPrefix ^ subtrees[clusters[count - 1]].mortonPrefix);
+        uint lo = 0, hi = count - 1;
+        while (lo < hi)
+        {
+            const uint mid = (lo + hi) / 2;
+            if (subtrees[clusters[mid]].mortonPrefix & bit) hi = mid; else lo = mid + 1;
+        }
+        leftCount = lo;
+    }
+    if (leftCount == 0 || leftCount == count) leftCount = count / 2;
+    // create child nodes
+    int leftChildIdx = used++;
+    int rightChildIdx = used++;
+    nodes[nodeIdx].leftFirst = leftChildIdx;
+    nodes[nodeIdx].triCount = 0;
+    SubdivideClusters(nodes, used, leftChildIdx, clusters, leftCount, depth + 1, sahTop);
+    SubdivideClusters(nodes, used, rightChildIdx, clusters + leftCount, count - leftCount, depth + 1, sahTop);
+    nodes[nodeIdx].aabbMin = fminf(nodes[leftChildIdx].aabbMin, nodes[rightChildIdx].aabbMin);
+    nodes[nodeIdx].aabbMax = fmaxf(nodes[leftChildIdx].aabbMax, nodes[rightChildIdx].aabbMax);
+}
+
+#define BLAS_BVH_NO_PARENT 0xffffffff // parent of the root in the optimizer
+
+void BLASBVH::Optimize(uint iterations, float budget)
+{
+    // Each pass takes the worst nodes by the inefficiency measure of Bittner et al., removes the
+    // smaller child of each and reinserts it next to the node where it adds the least surface area.
+    // The node slots are reused, so the tree keeps its size and the sibling pair layout.
+    auto startTime = std::chrono::high_resolution_clock::now();
+    if (nodesUsed < 5) return;
+    std::vector<uint> parent(nodesUsed, BLAS_BVH_NO_PARENT);
+    for (uint i = 0; i < nodesUsed; i++) if (!bvhNodes[i].isLeaf())
+        parent[bvhNodes[i].leftFirst] = parent[bvhNodes[i].leftFirst + 1] = i;
+    std::vector<std::pair<float, uint>> candidates;
+    std::vector<BVHNode> previousNodes;
+    const uint batch = max(1u, (uint)(nodesUsed * BLAS_BVH_OPTIMIZE_BATCH));
+    float elapsed = 0;
+    for (uint pass = 0; iterations == 0 || pass < iterations; pass++)
+    {
+        // a pass that makes the tree worse or too deep is undone
+        previousNodes.assign(bvhNodes.begin(), bvhNodes.begin() + nodesUsed);
+        const float previousCost = sahCost;
+        const uint previousDepth = maxDepth;
+        // inefficiency of an interior node: area * area / (sum of the child areas) * area / (smallest child area)
+        candidates.clear();
+        for (uint i = 0; i < nodesUsed; i++)
+        {
+            const BVHNode& node = bvhNodes[i];
+            if (i == rootNodeIdx || node.isLeaf()) continue;
+            const float area = aabb(node.aabbMin, node.aabbMax).Area();
+            const BVHNode& left = bvhNodes[node.leftFirst], & right = bvhNodes[node.leftFirst + 1];
+            const float leftArea = aabb(left.aabbMin, left.aabbMax).Area(), rightArea = aabb(right.aabbMin, right.aabbMax).Area();
+            candidates.push_back({ area * area * area / max(1e-20f, (leftArea + rightArea) * min(leftArea, rightArea)), i });
+        }
+        const uint count = min(batch, (uint)candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+            [](const std::pair<float, uint>& a, const std::pair<float, uint>& b) { return a.first > b.first; });
+        for (uint i = 0; i < count; i++)
+        {
+            // earlier reinsertions move nodes, so the slot may hold another node by now
+            const BVHNode& node = bvhNodes[candidates[i].second];
+            if (candidates[i].second == rootNodeIdx || node.isLeaf()) continue;
+            const BVHNode& left = bvhNodes[node.leftFirst], & right = bvhNodes[node.leftFirst + 1];
+            const bool leftSmaller = aabb(left.aabbMin, left.aabbMax).Area() < aabb(right.aabbMin, right.aabbMax).Area();
+            ReinsertNode(parent, leftSmaller ? node.leftFirst : node.leftFirst + 1);
+        }
+        sahCost = CalculateSAHCost();
+        maxDepth = CalculateMaxDepth();
+        elapsed = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        // a single pass can deepen the tree by many levels, past the fixed size traversal stacks
+        if (sahCost >= previousCost || maxDepth > BLAS_BVH_OPTIMIZE_MAX_DEPTH)
+        {
+            std::copy(previousNodes.begin(), previousNodes.end(), bvhNodes.begin());
+            sahCost = previousCost, maxDepth = previousDepth;
+            break;
+        }
+        // converged, out of time, or deep enough to risk the next pass
+        if (sahCost > previousCost * 0.999f) break;
+        if (budget > 0 && elapsed >= budget) break;
+        if (maxDepth >= BLAS_BVH_OPTIMIZE_MAX_DEPTH) break;
+    }
+    optimizeTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - startTime);
+}
+
+void BLASBVH::ReinsertNode(std::vector<uint>& parent, uint nodeIdx)
+{
+    const uint parentIdx = parent[nodeIdx];
+    if (parentIdx == BLAS_BVH_NO_PARENT) return;
+    const uint pair = bvhNodes[parentIdx].leftFirst;
+    const uint siblingIdx = nodeIdx == pair ? pair + 1 : pair;
+    const BVHNode node = bvhNodes[nodeIdx];
+    // remove: the sibling takes the place of the parent, which frees the pair
+    bvhNodes[parentIdx] = bvhNodes[siblingIdx];
+    if (!bvhNodes[parentIdx].isLeaf())
+        parent[bvhNodes[parentIdx].leftFirst] = parent[bvhNodes[parentIdx].leftFirst + 1] = parentIdx;
+    RefitAncestors(parent, parent[parentIdx]);
+    // insert: the best sibling moves into the pair, next to the node, under a new interior node in its slot
+    float cost;
+    const uint targetIdx = FindBestSibling(aabb(node.aabbMin, node.aabbMax), cost);
+    bvhNodes[pair] = bvhNodes[targetIdx];
+    bvhNodes[pair + 1] = node;
+    for (uint i = pair; i < pair + 2; i++) if (!bvhNodes[i].isLeaf())
+        parent[bvhNodes[i].leftFirst] = parent[bvhNodes[i].leftFirst + 1] = i;
+    BVHNode& joined = bvhNodes[targetIdx];
+    joined.leftFirst = pair;
+    joined.triCount = 0;
+    joined.aabbMin = fminf(bvhNodes[pair].aabbMin, node.aabbMin);
+    joined.aabbMax = fmaxf(bvhNodes[pair].aabbMax, node.aabbMax);
+    parent[pair] = parent[pair + 1] = targetIdx;
+    RefitAncestors(parent, parent[targetIdx]);
+}
+
+uint BLASBVH::FindBestSibling(const aabb& bounds, float& cost)
+{
+    // branch and bound: the cost of a sibling is the area of the new node plus the area its
+    // ancestors grow by; the growth of the ancestors (induced cost) only increases with depth
+    struct Candidate { float induced; uint nodeIdx; };
+    auto cheaper = [](const Candidate& a, const Candidate& b) { return a.induced > b.induced; };
+    std::vector<Candidate> heap;
+    const float area = bounds.Area();
+    uint best = rootNodeIdx;
+    cost = 1e30f;
+    heap.push_back({ 0, rootNodeIdx });
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), cheaper);
+        const Candidate candidate = heap.back();
+        heap.pop_back();
+        if (candidate.induced + area >= cost) break;
+        const BVHNode& node = bvhNodes[candidate.nodeIdx];
+        aabb joined(node.aabbMin, node.aabbMax);
+        const float nodeArea = joined.Area();
+        joined.Grow(bounds);
+        const float direct = joined.Area();
+        if (candidate.induced + direct < cost) cost = candidate.induced + direct, best = candidate.nodeIdx;
+        if (node.isLeaf()) continue;
+        const float induced = candidate.induced + direct - nodeArea;
+        if (induced + area >= cost) continue;
+        heap.push_back({ induced, node.leftFirst });
+        std::push_heap(heap.begin(), heap.end(), cheaper);
+        heap.push_back({ induced, node.leftFirst + 1 });
+        std::push_heap(heap.begin(), heap.end(), cheaper);
+    }
+    return best;
+}
+
+void BLASBVH::RefitAncestors(const std::vector<uint>& parent, uint nodeIdx)
+{
+    for (; nodeIdx != BLAS_BVH_NO_PARENT; nodeIdx = parent[nodeIdx])
+    {
+        BVHNode& node = bvhNodes[nodeIdx];
+        const BVHNode& left = bvhNodes[node.leftFirst], & right = bvhNodes[node.leftFirst + 1];
+        node.aabbMin = fminf(left.aabbMin, right.aabbMin);
+        node.aabbMax = fmaxf(left.aabbMax, right.aabbMax);
+    }
+}
+
+uint BLASBVH::CalculateMaxDepth()
+{
+    // depth of the deepest split, like the builders report it; the stack grows, as an optimizer pass
+    // may have made the tree deeper than the traversal allows
+    std::vector<std::pair<uint, uint>> stack;
+    uint deepest = 0;
+    stack.push_back({ rootNodeIdx, 0 });
+    while (!stack.empty())
+    {
+        const BVHNode& node = bvhNodes[stack.back().first];
+        const uint depth = stack.back().second;
+        stack.pop_back();
+        if (node.isLeaf()) continue;
+        if (depth > deepest) deepest = depth;
+        stack.push_back({ node.leftFirst, depth + 1 });
+        stack.push_back({ node.leftFirst + 1, depth + 1 });
+    }
+    return deepest;
+}
+
 #ifdef BLAS_BVH_FASTER_RAY
 float BLASBVH::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
 {
@@ -278,27 +1141,39 @@ bool BLASBVH::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 #endif
-void BLASBVH::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+void BLASBVH::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
     }
 }
 
+void BLASBVH::IntersectTriPacks(Ray& ray, const uint first, const uint count)
+{
+    const uint last = first + count;
+    for (uint p = first / TRI_PACK_WIDTH; p * TRI_PACK_WIDTH < last; p++)
+    {
+        // lanes of this pack that belong to the leaf
+        const uint base = p * TRI_PACK_WIDTH;
+        const uint lo = max(first, base) - base, hi = min(last, base + TRI_PACK_WIDTH) - base;
+        const int laneMask = ((1 << hi) - 1) & ~((1 << lo) - 1);
+        if (IntersectTriPack(triPacks[p], ray, laneMask)) ray.objIdx = objIdx;
+    }
+    ray.tested += count;
+}
+
 void BLASBVH::IntersectBVH(Ray& ray, const uint nodeIdx)
 {
 #ifdef BLAS_BVH_FASTER_RAY
@@ -309,11 +1184,16 @@ void BLASBVH::IntersectBVH(Ray& ray, const uint nodeIdx)
         ray.traversed++;
         if (node->isLeaf())
         {
-            for (uint i = 0; i < node->triCount; i++)
+            if (!triPacks.empty()) IntersectTriPacks(ray, node->leftFirst, node->triCount);
+            else for (uint i = 0; i < node->triCount; i++)
             {
+#ifdef BLAS_BVH_REORDER
+                uint triIdx = node->leftFirst + i;
+#else
                 uint triIdx = triangleIndices[node->leftFirst + i];
+#endif
                 ray.tested++;
-                IntersectTri(ray, triangles[triIdx], triIdx);
+                IntersectTri(ray, triAccel[triIdx], triIdx);
             }
             if (stackPtr == 0) break; else node = stack[--stackPtr];
 
@@ -340,11 +1220,16 @@ void BLASBVH::IntersectBVH(Ray& ray, const uint nodeIdx)
     if (!IntersectAABB(ray, node.aabbMin, node.aabbMax)) return;
     if (node.isLeaf())
     {
-        for (uint i = 0; i < node.triCount; i++)
+        if (!triPacks.empty()) IntersectTriPacks(ray, node.leftFirst, node.triCount);
+        else for (uint i = 0; i < node.triCount; i++)
         {
+#ifdef BLAS_BVH_REORDER
+            uint triIdx = node.leftFirst + i;
+#else
             uint triIdx = triangleIndices[node.leftFirst + i];
+#endif
             ray.tested++;
-            IntersectTri(ray, triangles[triIdx], triIdx);
+            IntersectTri(ray, triAccel[triIdx], triIdx);
         }
     }
     else
@@ -355,37 +1240,144 @@ void BLASBVH::IntersectBVH(Ray& ray, const uint nodeIdx)
 #endif
 }
 
+// any hit below ray.t will do, so the first triangle that is hit ends the search
+bool BLASBVH::OccludedLeaf(Ray& ray, const uint first, const uint count)
+{
+    if (!triPacks.empty())
+    {
+        const uint last = first + count;
+        for (uint p = first / TRI_PACK_WIDTH; p * TRI_PACK_WIDTH < last; p++)
+        {
+            const uint base = p * TRI_PACK_WIDTH;
+            const uint lo = max(first, base) - base, hi = min(last, base + TRI_PACK_WIDTH) - base;
+            const int laneMask = ((1 << hi) - 1) & ~((1 << lo) - 1);
+            if (IntersectTriPack(triPacks[p], ray, laneMask)) return true;
+        }
+        return false;
+    }
+    const float tmax = ray.t;
+    for (uint i = 0; i < count; i++)
+    {
+#ifdef BLAS_BVH_REORDER
+        uint triIdx = first + i;
+#else
+        uint triIdx = triangleIndices[first + i];
+#endif
+        IntersectTri(ray, triAccel[triIdx], triIdx);
+        if (ray.t < tmax) return true;
+    }
+    return false;
+}
+
+// the same walk as IntersectBVH, without ordering the children by distance
+bool BLASBVH::OccludedBVH(Ray& ray)
+{
+    BVHNode* node = &bvhNodes[rootNodeIdx], * stack[64];
+    uint stackPtr = 0;
+    while (1)
+    {
+        if (node->isLeaf())
+        {
+            if (OccludedLeaf(ray, node->leftFirst, node->triCount)) return true;
+            if (stackPtr == 0) return false; else node = stack[--stackPtr];
+            continue;
+        }
+        BVHNode* child1 = &bvhNodes[node->leftFirst];
+        BVHNode* child2 = &bvhNodes[node->leftFirst + 1];
+#ifdef BLAS_BVH_FASTER_RAY
+        const bool hit1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax) != 1e30f;
+        const bool hit2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax) != 1e30f;
+#else
+        const bool hit1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+        const bool hit2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+#endif
+        if (hit1)
+        {
+            node = child1;
+            if (hit2) stack[stackPtr++] = child2;
+        }
+        else if (hit2) node = child2;
+        else if (stackPtr == 0) return false;
+        else node = stack[--stackPtr];
+    }
+}
+
+// Ranged packet traversal: a node is visited with the first ray of the packet that hits it, the
+// leaves test every ray from there on and the children are ordered by the distance of that ray.
+void BLASBVH::IntersectBVHPacket(RayPacket& packet, uint first)
+{
+    RayPacketStackEntry stack[64];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
+    {
+        packet.traversed++;
+        const BVHNode& node = bvhNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            for (uint i = 0; i < node.triCount; i++)
+            {
+#ifdef BLAS_BVH_REORDER
+                uint triIdx = node.leftFirst + i;
+#else
+                uint triIdx = triangleIndices[node.leftFirst + i];
+#endif
+                IntersectPacketTri(packet, triAccel[triIdx], first, objIdx, triIdx);
+            }
+            packet.tested += node.triCount;
+            if (stackPtr == 0) break;
+            stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+            continue;
+        }
+        uint child1 = node.leftFirst, child2 = node.leftFirst + 1;
+        float dist1 = 1e30f, dist2 = 1e30f;
+        uint first1 = IntersectPacketAABB(packet, first, bvhNodes[child1].aabbMin, bvhNodes[child1].aabbMax, dist1);
+        uint first2 = IntersectPacketAABB(packet, first, bvhNodes[child2].aabbMin, bvhNodes[child2].aabbMax, dist2);
+        if (first1 == RAY_PACKET_SIZE && first2 == RAY_PACKET_SIZE)
+        {
+            if (stackPtr == 0) break;
+            stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+            continue;
+        }
+        if (first1 == RAY_PACKET_SIZE || (first2 != RAY_PACKET_SIZE && dist2 < dist1))
+        {
+            swap(child1, child2), swap(first1, first2);
+        }
+        if (first2 != RAY_PACKET_SIZE) stack[stackPtr].node = child2, stack[stackPtr++].first = first2;
+        nodeIdx = child1, first = first1;
+    }
+}
+
 int BLASBVH::GetTriangleCount() const
 {
-    return triangles.size();
+    return triangles.size() - duplicatedTriangles;
+}
+
+size_t BLASBVH::GetMemoryUsage() const
+{
+    return sizeof(BLASBVH) + bvhNodes.capacity() * sizeof(BVHNode) + (triangles.capacity() + restTriangles.capacity()) * sizeof(Tri) +
+        triAccel.capacity() * sizeof(TriAccel) + triPacks.capacity() * sizeof(TriPack) + (triangleIndices.capacity() + sourceTriangle.capacity()) * sizeof(uint);
 }
 
-void BLASBVH::SetTransform(mat4 transform)
+aabb BLASBVH::GetBounds() const
 {
-    T = transform;
-    invT = transform.FastInvertedTransformNoScale();
-    // update bvh bound
-    // calculate world-space bounds using the new matrix
-    float3 bmin = bvhNodes[0].aabbMin, bmax = bvhNodes[0].aabbMax;
-    worldBounds = aabb();
-    for (int i = 0; i < 8; i++)
-        worldBounds.Grow(TransformPosition(float3(i & 1 ? bmax.x : bmin.x,
-            i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z), transform));
+    return aabb(bvhNodes[rootNodeIdx].aabbMin, bvhNodes[rootNodeIdx].aabbMax);
 }
 
+// the ray is in object space, see BLASInstance
 void BLASBVH::Intersect(Ray& ray)
 {
-    Ray tRay = Ray(ray);
-    tRay.O = TransformPosition_SSE(ray.O4, invT);
-    tRay.D = TransformVector_SSE(ray.D4, invT);
-    tRay.rD = float3(1 / tRay.D.x, 1 / tRay.D.y, 1 / tRay.D.z);
+    IntersectBVH(ray, rootNodeIdx);
+}
 
-    IntersectBVH(tRay, rootNodeIdx);
+bool BLASBVH::IsOccluded(const Ray& ray)
+{
+    Ray shadowRay = Ray(ray);
+    return OccludedBVH(shadowRay);
+}
 
-    tRay.O = ray.O;
-    tRay.D = ray.D;
-    tRay.rD = ray.rD;
-    ray = tRay;
+void BLASBVH::IntersectPacket(RayPacket& packet, const uint first)
+{
+    IntersectBVHPacket(packet, first);
 }
 
 float3 BLASBVH::GetNormal(const uint triIdx, const float2 barycentric) const
@@ -394,7 +1386,7 @@ float3 BLASBVH::GetNormal(const uint triIdx, const float2 barycentric) const
     float3 n1 = triangles[triIdx].normal1;
     float3 n2 = triangles[triIdx].normal2;
     float3 N = (1 - barycentric.x - barycentric.y) * n0 + barycentric.x * n1 + barycentric.y * n2;
-    return normalize(TransformVector(N, T));
+    return normalize(N);
 }
 
 float2 BLASBVH::GetUV(const uint triIdx, const float2 barycentric) const
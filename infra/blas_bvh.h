@@ -1,10 +1,31 @@
 #pragma once
 
-#define BLAS_BVH_SAH
+#include <functional>
+#include "tri_pack.h"
+#include "ray_packet.h"
+
 #define BLAS_BVH_FASTER_RAY
-#define BLAS_BVH_BINS 8
+#define BLAS_BVH_PARALLEL_BUILD
+//#define BLAS_BVH_BUILD_COMPARE // also runs the serial builder to report the speedup
+#define BLAS_BVH_MIN_TASK_SIZE 8192 // smaller BLASes are deformed, refitted and clustered by a single job
+#define BLAS_BVH_REORDER // stores the triangles in leaf order and drops triangleIndices after the build
+//#define BLAS_BVH_SBVH // spatial splits with reference duplication, replaces the builder above
+#define BLAS_BVH_SBVH_ALPHA 1e-5f // try spatial splits when the child overlap exceeds this fraction of the root area
+#define BLAS_BVH_SBVH_BUDGET 1.5f // maximum number of references, relative to the triangle count
+#define BLAS_BVH_SBVH_BINS 16
+#define BLAS_BVH_MORTON_BITS 30 // 30 or 63 bit Morton codes for the linear builders
+#define BLAS_BVH_LBVH_LEAF_SIZE 4
+#define BLAS_BVH_HLBVH_BITS 5 // Morton bits per axis of the clusters below the SAH top levels
+#define BLAS_BVH_OPTIMIZE_BATCH 0.01f // fraction of the nodes reinserted per optimizer pass
+#define BLAS_BVH_OPTIMIZE_MAX_DEPTH 56 // deepest tree the optimizer keeps, below the 64-entry traversal stacks
+#define BLAS_BVH_REBUILD_RATIO 1.5f // a deforming BLAS is rebuilt once refitting made its SAH cost this much worse than the last build
+#define BLAS_BVH_BACKGROUND_REBUILD // such rebuilds run on a thread of their own while the refitted tree stays in use
 
 // reference: https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
+// SBVH: Stich et al., Spatial Splits in Bounding Volume Hierarchies, 2009
+// LBVH: Lauterbach et al., Fast BVH Construction on GPUs, 2009
+// HLBVH: Pantaleoni and Luebke, HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing of Dynamic Geometry, 2010
+// optimizer: Bittner et al., Fast Insertion-Based Optimization of Bounding Volume Hierarchies, 2013
 
 namespace Tmpl8
 {
@@ -16,44 +37,137 @@ namespace Tmpl8
 		uint leftFirst, triCount;   // 8 bytes; total: 32 bytes
 		// If it is 0, leftFirst contains the index of the left child node.
 		// Otherwise, it contains the index of the first triangle index.
-		bool isLeaf() { return triCount > 0; }
+		bool isLeaf() const { return triCount > 0; }
+	};
+
+	// triangle reference of the split BVH builder, bounds may be clipped
+	struct SBVHRef { aabb bounds; uint triIdx; };
+
+	// builder of a BLAS; the linear builders sort the triangles along a Morton curve, which is
+	// much faster than binning, at the cost of tree quality
+	enum BVHBuilder { BVH_BUILDER_SAH, BVH_BUILDER_LBVH, BVH_BUILDER_HLBVH };
+
+	// build options of one BLAS; the optimizer runs after the builder when it has a budget,
+	// and stops at the first budget that runs out
+	struct BVHBuildSettings
+	{
+		BVHBuilder builder = BVH_BUILDER_SAH;
+		uint optimizeIterations = 0; // reinsertion passes
+		float optimizeBudget = 0; // milliseconds
+	};
+
+	// per-vertex animation of a BLAS: writes the deformed version of a triangle, given its rest pose
+	typedef std::function<void(const Tri& rest, Tri& tri)> TriDeformer;
+
+	struct BVHRebuild; // rebuild of a deforming BLAS in the background, see BLASBVH::Deform
+
+	// subtree below the top levels of a parallel build, built by a single worker
+	struct BVHSubtree
+	{
+		uint depth = 0, used = 1, deepest = 0;
+		std::vector<BVHNode> nodes;
+		// clusters of the linear builders
+		uint triCount = 0;
+		uint64_t mortonPrefix = 0;
 	};
 
 	class BLASBVH
 	{
-	private:
+	protected:
 		void UpdateNodeBounds(uint nodeIdx);
-		void Subdivide(uint nodeIdx, uint depth);
+		void UpdateNodeBounds(BVHNode& node);
 #ifdef BLAS_BVH_FASTER_RAY
 		float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
 #else
 		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
 #endif
-		void IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
+		void IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
+		void IntersectTriPacks(Ray& ray, const uint first, const uint count);
 		void IntersectBVH(Ray& ray, const uint nodeIdx);
-		float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos);
-		float CalculateNodeCost(BVHNode& node);
+		bool OccludedLeaf(Ray& ray, const uint first, const uint count);
+		bool OccludedBVH(Ray& ray);
+		void IntersectBVHPacket(RayPacket& packet, uint first);
+		void BuildSBVH();
+		void SubdivideSBVH(uint nodeIdx, std::vector<SBVHRef>& refs, uint depth);
+		float FindObjectSplit(const std::vector<SBVHRef>& refs, int& axis, float& splitPos, aabb& leftBounds, aabb& rightBounds);
+		float FindSpatialSplit(const std::vector<SBVHRef>& refs, const aabb& bounds, int& axis, float& splitPos);
+		void PartitionSpatial(const std::vector<SBVHRef>& refs, int axis, float splitPos, std::vector<SBVHRef>& leftRefs, std::vector<SBVHRef>& rightRefs);
+		void SplitReference(const SBVHRef& ref, int axis, float splitPos, SBVHRef& left, SBVHRef& right);
+		void BuildSAH();
+		void BuildLBVH(bool sahTop);
+		void SubdivideLBVH(BVHNode* nodes, uint& used, uint nodeIdx, uint depth, uint& deepest);
+		void SubdivideClusters(std::vector<BVHNode>& nodes, uint& used, uint nodeIdx, uint* clusters, uint count, uint depth, bool sahTop);
+		void ReinsertNode(std::vector<uint>& parent, uint nodeIdx);
+		uint FindBestSibling(const aabb& bounds, float& cost);
+		void RefitAncestors(const std::vector<uint>& parent, uint nodeIdx);
+		uint CalculateMaxDepth();
+		void ReorderTriangles();
+		void RestoreSourceTriangles();
+		void BuildTriPacks();
+		void RefitNodes();
+		void Rebuild();
+		void FinishRebuild();
 	public:
+		void ComputeMortonCodes(uint first, uint count, const float3& cmin, const float3& scale);
+		void CountRadixDigits(uint first, uint count, uint shift, uint* digitCount);
+		void ScatterRadixDigits(uint first, uint count, uint shift, uint* digitOffset);
+		void BuildLBVHSubtrees(uint first, uint count);
+		void DeformTriangles(uint first, uint count, const TriDeformer& deform);
+		void RefitNode(uint nodeIdx, uint depth, uint cutDepth);
 		BLASBVH() = default;
-		BLASBVH(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat);
+		BLASBVH(const int idx, const std::string& modelPath, const BVHBuildSettings& settings = BVHBuildSettings());
+		~BLASBVH();
 		void Build();
+		void Optimize(uint iterations, float budget);
 		void Refit();
+		void Deform(const TriDeformer& deform);
 		void Intersect(Ray& ray);
-		void SetTransform(mat4 transform);
+		bool IsOccluded(const Ray& ray);
+		void IntersectPacket(RayPacket& packet, const uint first = 0);
+		float CalculateSAHCost();
+		aabb GetBounds() const;
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
+		size_t GetMemoryUsage() const;
 	private:
 	public:
 		int objIdx = -1;
-		int matIdx = -1;
 		std::vector<BVHNode> bvhNodes;
 		std::vector<Tri> triangles;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
+		std::vector<TriPack> triPacks; // the same in leaf order, 8 per pack; empty without AVX2
 		std::vector<uint> triangleIndices;
 		uint rootNodeIdx = 0, nodesUsed = 1;
-		aabb worldBounds;
-		mat4 T, invT;
 		std::chrono::microseconds buildTime;
+		std::chrono::microseconds serialBuildTime{ 0 };
 		uint maxDepth = 0;
+		float sahCost = 0;
+		float duplication = 1; // triangle references per triangle, above 1 with spatial splits
+		BVHBuilder builder = BVH_BUILDER_SAH;
+		uint optimizeIterations = 0;
+		float optimizeBudget = 0;
+		float sahCostBeforeOptimize = 0; // sahCost of the builder, before the optimizer
+		std::chrono::microseconds optimizeTime{ 0 };
+		// deformation: the triangles are rewritten from their rest pose and the tree refitted every
+		// frame, until the refits have made it BLAS_BVH_REBUILD_RATIO times as expensive as the last build
+		std::vector<Tri> restTriangles; // in the order of triangles; empty until the first Deform
+		float builtSahCost = 0; // sahCost after the last build
+		std::chrono::microseconds refitTime{ 0 }; // last Deform, including the deformation itself
+		std::chrono::microseconds rebuildTime{ 0 }; // last rebuild, on the thread that ran it
+		uint refitCount = 0, rebuildCount = 0;
+	private:
+		// clusters of the linear builders and the top node each of them replaces
+		std::vector<BVHSubtree> subtrees;
+		std::vector<int> topSubtree;
+		// state of the split BVH builder
+		float sbvhRootArea = 0;
+		uint sbvhRefCount = 0;
+		uint duplicatedTriangles = 0;
+		std::vector<uint> sourceTriangle; // the loaded triangle each of triangles is a copy of; empty without duplicates
+		// state of the linear builders: Morton codes in the order of triangleIndices, radix sort buffers
+		std::vector<uint64_t> mortonCodes, sortedCodes;
+		std::vector<uint> sortedIndices;
+		BVHRebuild* rebuild = 0; // running background rebuild
 	};
 }
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "precomp.h"
+#include "blas_bvh4.h"
+
+uint Tmpl8::CollapseBVH4(const BVHNode* bvhNodes, const uint nodeIdx, std::vector<BVH4Node>& bvh4Nodes)
+{
+    // gather up to four children by repeatedly opening the interior child with the largest surface area
+    uint children[4], childCount = 0;
+    const BVHNode& node = bvhNodes[nodeIdx];
+    if (node.triCount > 0) children[childCount++] = nodeIdx; // the root is a leaf
+    else children[childCount++] = node.leftFirst, children[childCount++] = node.leftFirst + 1;
+    while (childCount < 4)
+    {
+        int best = -1;
+        float bestArea = -1;
+        for (uint i = 0; i < childCount; i++)
+        {
+            const BVHNode& child = bvhNodes[children[i]];
+            if (child.triCount > 0) continue;
+            const float3 e = child.aabbMax - child.aabbMin;
+            const float area = e.x * e.y + e.y * e.z + e.z * e.x;
+            if (area > bestArea) bestArea = area, best = i;
+        }
+        if (best == -1) break;
+        const uint left = bvhNodes[children[best]].leftFirst;
+        children[best] = left;
+        children[childCount++] = left + 1;
+    }
+
+    const uint idx = bvh4Nodes.size();
+    bvh4Nodes.push_back(BVH4Node());
+    BVH4Node wide;
+    for (uint i = 0; i < 4; i++)
+    {
+        if (i >= childCount)
+        {
+            wide.bminx[i] = wide.bminy[i] = wide.bminz[i] = 1e30f;
+            wide.bmaxx[i] = wide.bmaxy[i] = wide.bmaxz[i] = -1e30f;
+            wide.child[i] = BVH4_EMPTY, wide.triCount[i] = 0;
+            continue;
+        }
+        const BVHNode& child = bvhNodes[children[i]];
+        wide.bminx[i] = child.aabbMin.x, wide.bminy[i] = child.aabbMin.y, wide.bminz[i] = child.aabbMin.z;
+        wide.bmaxx[i] = child.aabbMax.x, wide.bmaxy[i] = child.aabbMax.y, wide.bmaxz[i] = child.aabbMax.z;
+        if (child.triCount > 0)
+            wide.child[i] = child.leftFirst, wide.triCount[i] = child.triCount;
+        else
+            wide.child[i] = CollapseBVH4(bvhNodes, children[i], bvh4Nodes), wide.triCount[i] = 0;
+    }
+    bvh4Nodes[idx] = wide;
+    return idx;
+}
+
+bool Tmpl8::QuantizeBVH4(const std::vector<BVH4Node>& bvh4Nodes, std::vector<QBVH4Node>& qbvh4Nodes)
+{
+    // the quantized nodes keep 16-bit triangle counts
+    for (const BVH4Node& node : bvh4Nodes) for (uint i = 0; i < 4; i++) if (node.triCount[i] > 65535)
+    {
+        qbvh4Nodes.clear();
+        return false;
+    }
+    qbvh4Nodes.resize(bvh4Nodes.size());
+    for (uint n = 0; n < bvh4Nodes.size(); n++)
+    {
+        const BVH4Node& node = bvh4Nodes[n];
+        QBVH4Node& qnode = qbvh4Nodes[n];
+        // children are packed at the front of the node
+        uint childCount = 0;
+        while (childCount < 4 && node.child[childCount] != BVH4_EMPTY) childCount++;
+        const float* bmin[3] = { node.bminx, node.bminy, node.bminz };
+        const float* bmax[3] = { node.bmaxx, node.bmaxy, node.bmaxz };
+        uchar* qmin[3] = { qnode.qminx, qnode.qminy, qnode.qminz };
+        uchar* qmax[3] = { qnode.qmaxx, qnode.qmaxy, qnode.qmaxz };
+        for (int a = 0; a < 3; a++)
+        {
+            float lo = 1e30f, hi = -1e30f;
+            for (uint i = 0; i < childCount; i++) lo = min(lo, bmin[a][i]), hi = max(hi, bmax[a][i]);
+            // smallest power of two for which 255 steps cover the node
+            int e = clamp((int)ceilf(log2f(max(hi - lo, 1e-30f) / 255)), -126, 127);
+            while (e < 127 && lo + 255 * ldexpf(1, e) < hi) e++;
+            const float scale = ldexpf(1, e);
+            qnode.origin[a] = lo, qnode.exponent[a] = (char)e;
+            for (uint i = 0; i < 4; i++)
+            {
+                if (i >= childCount) { qmin[a][i] = 255, qmax[a][i] = 0; continue; }
+                // round outwards, so the decoded box always contains the child
+                int q0 = clamp((int)floorf((bmin[a][i] - lo) / scale), 0, 255);
+                int q1 = clamp((int)ceilf((bmax[a][i] - lo) / scale), 0, 255);
+                while (q0 > 0 && lo + q0 * scale > bmin[a][i]) q0--;
+                while (q1 < 255 && lo + q1 * scale < bmax[a][i]) q1++;
+                qmin[a][i] = (uchar)q0, qmax[a][i] = (uchar)q1;
+            }
+        }
+        qnode.childCount = (uchar)childCount;
+        for (uint i = 0; i < 4; i++) qnode.child[i] = node.child[i], qnode.triCount[i] = (ushort)node.triCount[i];
+    }
+    return true;
+}
+
+BLASBVH4::BLASBVH4(const int idx, const std::string& modelPath, const BVHBuildSettings& settings)
+    : BLASBVH(idx, modelPath, settings)
+{
+    Collapse();
+}
+
+void BLASBVH4::Build()
+{
+    BLASBVH::Build();
+    Collapse();
+}
+
+void BLASBVH4::Refit()
+{
+    BLASBVH::Refit();
+    Collapse();
+}
+
+void BLASBVH4::Deform(const TriDeformer& deform)
+{
+    // the wide nodes are collapsed again from the refitted or rebuilt binary tree; Collapse adds its
+    // time to the build time, which belongs to the refit here
+    const std::chrono::microseconds loadBuildTime = buildTime;
+    BLASBVH::Deform(deform);
+    Collapse();
+    refitTime += buildTime - loadBuildTime;
+    buildTime = loadBuildTime;
+}
+
+void BLASBVH4::Collapse()
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    bvh4Nodes.clear();
+    bvh4Nodes.reserve(nodesUsed / 2 + 1);
+    CollapseBVH4(bvhNodes.data(), rootNodeIdx, bvh4Nodes);
+#ifdef BLAS_BVH4_QUANTIZED
+    // a leaf too large for the quantized nodes keeps the tree in full precision
+    if (QuantizeBVH4(bvh4Nodes, qbvh4Nodes)) std::vector<BVH4Node>().swap(bvh4Nodes);
+#endif
+    auto endTime = std::chrono::high_resolution_clock::now();
+    buildTime += std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+size_t BLASBVH4::GetMemoryUsage() const
+{
+    return BLASBVH::GetMemoryUsage() - sizeof(BLASBVH) + sizeof(BLASBVH4) +
+        bvh4Nodes.capacity() * sizeof(BVH4Node) + qbvh4Nodes.capacity() * sizeof(QBVH4Node);
+}
+
+void BLASBVH4::IntersectBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    const BVH4Node* node = &bvh4Nodes[0];
+    while (node)
+    {
+        ray.traversed++;
+        __m128 dist4;
+        const int mask = IntersectBVH4Children(*node, ray4, ray.t, dist4);
+        PushBVH4Children(*node, mask, dist4, stack, stackPtr);
+        node = 0;
+        while (stackPtr > 0)
+        {
+            const BVH4StackEntry entry = stack[--stackPtr];
+            // a closer hit may have been found since this child was pushed
+            if (entry.dist >= ray.t) continue;
+            if (entry.triCount == 0)
+            {
+                node = &bvh4Nodes[entry.child];
+                break;
+            }
+            ray.traversed++;
+            if (!triPacks.empty()) IntersectTriPacks(ray, entry.child, entry.triCount);
+            else for (uint i = 0; i < entry.triCount; i++)
+            {
+#ifdef BLAS_BVH_REORDER
+                uint triIdx = entry.child + i;
+#else
+                uint triIdx = triangleIndices[entry.child + i];
+#endif
+                ray.tested++;
+                IntersectTri(ray, triAccel[triIdx], triIdx);
+            }
+        }
+    }
+}
+
+void BLASBVH4::IntersectQBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    const QBVH4Node* node = &qbvh4Nodes[0];
+    while (node)
+    {
+        ray.traversed++;
+        __m128 dist4;
+        const int mask = IntersectQBVH4Children(*node, ray4, ray.t, dist4);
+        PushBVH4Children(*node, mask, dist4, stack, stackPtr);
+        node = 0;
+        while (stackPtr > 0)
+        {
+            const BVH4StackEntry entry = stack[--stackPtr];
+            // a closer hit may have been found since this child was pushed
+            if (entry.dist >= ray.t) continue;
+            if (entry.triCount == 0)
+            {
+                node = &qbvh4Nodes[entry.child];
+                break;
+            }
+            ray.traversed++;
+            if (!triPacks.empty()) IntersectTriPacks(ray, entry.child, entry.triCount);
+            else for (uint i = 0; i < entry.triCount; i++)
+            {
+#ifdef BLAS_BVH_REORDER
+                uint triIdx = entry.child + i;
+#else
+                uint triIdx = triangleIndices[entry.child + i];
+#endif
+                ray.tested++;
+                IntersectTri(ray, triAccel[triIdx], triIdx);
+            }
+        }
+    }
+}
+
+bool BLASBVH4::OccludedBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    stack[stackPtr++] = { 0, 0, 0 };
+    while (stackPtr > 0)
+    {
+        const BVH4StackEntry entry = stack[--stackPtr];
+        if (entry.triCount > 0)
+        {
+            if (OccludedLeaf(ray, entry.child, entry.triCount)) return true;
+            continue;
+        }
+        __m128 dist4;
+        const int mask = IntersectBVH4Children(bvh4Nodes[entry.child], ray4, ray.t, dist4);
+        PushBVH4ChildrenUnordered(bvh4Nodes[entry.child], mask, stack, stackPtr);
+    }
+    return false;
+}
+
+bool BLASBVH4::OccludedQBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    stack[stackPtr++] = { 0, 0, 0 };
+    while (stackPtr > 0)
+    {
+        const BVH4StackEntry entry = stack[--stackPtr];
+        if (entry.triCount > 0)
+        {
+            if (OccludedLeaf(ray, entry.child, entry.triCount)) return true;
+            continue;
+        }
+        __m128 dist4;
+        const int mask = IntersectQBVH4Children(qbvh4Nodes[entry.child], ray4, ray.t, dist4);
+        PushBVH4ChildrenUnordered(qbvh4Nodes[entry.child], mask, stack, stackPtr);
+    }
+    return false;
+}
+
+void BLASBVH4::Intersect(Ray& ray)
+{
+#ifdef BLAS_BVH4_QUANTIZED
+    if (!qbvh4Nodes.empty())
+    {
+        IntersectQBVH4(ray);
+        return;
+    }
+#endif
+    IntersectBVH4(ray);
+}
+
+bool BLASBVH4::IsOccluded(const Ray& ray)
+{
+    Ray shadowRay = Ray(ray);
+#ifdef BLAS_BVH4_QUANTIZED
+    if (!qbvh4Nodes.empty()) return OccludedQBVH4(shadowRay);
+#endif
+    return OccludedBVH4(shadowRay);
+}
\ No newline at end of file
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "blas_bvh.h"
+
+#define BVH4_EMPTY 0xffffffff // unused child slot
+#define BVH4_STACK_SIZE 192
+//#define BLAS_BVH4_QUANTIZED // 64-byte nodes with 8-bit child bounds relative to the parent
+
+// The binary BVH is collapsed into 4-wide nodes. Child bounds are stored per axis (SoA),
+// so a single SSE slab test covers all four children of a node.
+
+namespace Tmpl8
+{
+	struct ALIGN(64) BVH4Node
+	{
+		union { __m128 bminx4; float bminx[4]; }; union { __m128 bmaxx4; float bmaxx[4]; }; // 32 bytes
+		union { __m128 bminy4; float bminy[4]; }; union { __m128 bmaxy4; float bmaxy[4]; }; // 32 bytes
+		union { __m128 bminz4; float bminz[4]; }; union { __m128 bmaxz4; float bmaxz[4]; }; // 32 bytes
+		uint child[4];              // 16 bytes
+		uint triCount[4];           // 16 bytes; total: 128 bytes
+		// If triCount is 0, child contains the index of a BVH4Node.
+		// Otherwise, it contains the index of the first triangle index.
+		// Empty slots have child BVH4_EMPTY and bounds that are never hit.
+		bool isLeaf(const int i) const { return triCount[i] > 0; }
+	};
+
+	// compressed BVH4Node: child bounds are origin + q * 2^exponent per axis, rounded outwards
+	struct ALIGN(64) QBVH4Node
+	{
+		float3 origin;              // 12 bytes; minimum corner of the node bounds
+		char exponent[3];           // 3 bytes
+		uchar childCount;           // 1 byte
+		uchar qminx[4], qmaxx[4];   // 8 bytes
+		uchar qminy[4], qmaxy[4];   // 8 bytes
+		uchar qminz[4], qmaxz[4];   // 8 bytes
+		uint child[4];              // 16 bytes
+		ushort triCount[4];         // 8 bytes; total: 64 bytes
+		bool isLeaf(const int i) const { return triCount[i] > 0; }
+	};
+
+	struct BVH4StackEntry { uint child, triCount; float dist; };
+
+	// ray data broadcast to all four lanes
+	struct BVH4Ray
+	{
+		BVH4Ray(const Ray& ray)
+		{
+			ox = _mm_set1_ps(ray.O.x), oy = _mm_set1_ps(ray.O.y), oz = _mm_set1_ps(ray.O.z);
+			rdx = _mm_set1_ps(ray.rD.x), rdy = _mm_set1_ps(ray.rD.y), rdz = _mm_set1_ps(ray.rD.z);
+		}
+		__m128 ox, oy, oz, rdx, rdy, rdz;
+	};
+
+	// slab test against the four children; returns a bit mask of hit children, entry distances in dist4
+	inline int IntersectBVH4Children(const BVH4Node& node, const BVH4Ray& r, const float t, __m128& dist4)
+	{
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(node.bminx4, r.ox), r.rdx);
+		const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(node.bmaxx4, r.ox), r.rdx);
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(node.bminy4, r.oy), r.rdy);
+		const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(node.bmaxy4, r.oy), r.rdy);
+		const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(node.bminz4, r.oz), r.rdz);
+		const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(node.bmaxz4, r.oz), r.rdz);
+		__m128 tmin = _mm_max_ps(_mm_min_ps(tx1, tx2), _mm_max_ps(_mm_min_ps(ty1, ty2), _mm_min_ps(tz1, tz2)));
+		__m128 tmax = _mm_min_ps(_mm_max_ps(tx1, tx2), _mm_min_ps(_mm_max_ps(ty1, ty2), _mm_max_ps(tz1, tz2)));
+		const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(t))),
+			_mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+		dist4 = tmin;
+		return _mm_movemask_ps(hit);
+	}
+
+	// the same test on decoded quantized bounds
+	inline int IntersectQBVH4Children(const QBVH4Node& node, const BVH4Ray& r, const float t, __m128& dist4)
+	{
+		// 2^exponent, built from the float exponent bits
+		const __m128i e4 = _mm_setr_epi32(node.exponent[0], node.exponent[1], node.exponent[2], 0);
+		union { __m128 scale4; float scale[4]; };
+		scale4 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(e4, _mm_set1_epi32(127)), 23));
+		const __m128 sx = _mm_set1_ps(scale[0]), sy = _mm_set1_ps(scale[1]), sz = _mm_set1_ps(scale[2]);
+		const __m128 bx = _mm_sub_ps(_mm_set1_ps(node.origin.x), r.ox);
+		const __m128 by = _mm_sub_ps(_mm_set1_ps(node.origin.y), r.oy);
+		const __m128 bz = _mm_sub_ps(_mm_set1_ps(node.origin.z), r.oz);
+#define QBVH4_DECODE(q) _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int*)(q))))
+		const __m128 tx1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qminx), sx), bx), r.rdx);
+		const __m128 tx2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qmaxx), sx), bx), r.rdx);
+		const __m128 ty1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qminy), sy), by), r.rdy);
+		const __m128 ty2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qmaxy), sy), by), r.rdy);
+		const __m128 tz1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qminz), sz), bz), r.rdz);
+		const __m128 tz2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(QBVH4_DECODE(node.qmaxz), sz), bz), r.rdz);
+#undef QBVH4_DECODE
+		__m128 tmin = _mm_max_ps(_mm_min_ps(tx1, tx2), _mm_max_ps(_mm_min_ps(ty1, ty2), _mm_min_ps(tz1, tz2)));
+		__m128 tmax = _mm_min_ps(_mm_max_ps(tx1, tx2), _mm_min_ps(_mm_max_ps(ty1, ty2), _mm_max_ps(tz1, tz2)));
+		const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(t))),
+			_mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+		dist4 = tmin;
+		return _mm_movemask_ps(hit) & ((1 << node.childCount) - 1);
+	}
+
+	// pushes the hit children on the stack, farthest first, so the nearest one is popped next
+	template <class Node>
+	inline void PushBVH4Children(const Node& node, const int mask, const __m128 dist4, BVH4StackEntry* stack, uint& stackPtr)
+	{
+		union { __m128 d4; float d[4]; };
+		d4 = dist4;
+		BVH4StackEntry hits[4];
+		int hitCount = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (!(mask & (1 << i)) || node.child[i] == BVH4_EMPTY) continue;
+			BVH4StackEntry entry = { node.child[i], node.triCount[i], d[i] };
+			// insertion sort, descending distance
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].dist < entry.dist) hits[j] = hits[j - 1], j--;
+			hits[j] = entry;
+		}
+		for (int i = 0; i < hitCount; i++) stack[stackPtr++] = hits[i];
+	}
+
+	// pushes the hit children in storage order, for rays that stop at any hit
+	template <class Node>
+	inline void PushBVH4ChildrenUnordered(const Node& node, const int mask, BVH4StackEntry* stack, uint& stackPtr)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			if (!(mask & (1 << i)) || node.child[i] == BVH4_EMPTY) continue;
+			BVH4StackEntry entry = { node.child[i], node.triCount[i], 0 };
+			stack[stackPtr++] = entry;
+		}
+	}
+
+	// collapses the binary BVH below nodeIdx into 4-wide nodes; returns the index of the new node
+	uint CollapseBVH4(const BVHNode* bvhNodes, const uint nodeIdx, std::vector<BVH4Node>& bvh4Nodes);
+	// quantizes 4-wide nodes, keeping the node indices; fails, leaving qbvh4Nodes empty, when a leaf
+	// holds more triangles than the 16-bit counts of the quantized nodes can
+	bool QuantizeBVH4(const std::vector<BVH4Node>& bvh4Nodes, std::vector<QBVH4Node>& qbvh4Nodes);
+
+	class BLASBVH4 : public BLASBVH
+	{
+	private:
+		void Collapse();
+		void IntersectBVH4(Ray& ray);
+		void IntersectQBVH4(Ray& ray);
+		bool OccludedBVH4(Ray& ray);
+		bool OccludedQBVH4(Ray& ray);
+	public:
+		BLASBVH4() = default;
+		BLASBVH4(const int idx, const std::string& modelPath, const BVHBuildSettings& settings = BVHBuildSettings());
+		void Build();
+		void Refit();
+		void Deform(const TriDeformer& deform);
+		void Intersect(Ray& ray);
+		bool IsOccluded(const Ray& ray);
+		size_t GetMemoryUsage() const;
+	public:
+		std::vector<BVH4Node> bvh4Nodes;
+		std::vector<QBVH4Node> qbvh4Nodes;
+	};
+}
\ No newline at end of file
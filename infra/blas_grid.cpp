@@ -1,7 +1,8 @@
 #include "precomp.h"
 #include "grid.h"
+#include "grid_builder.h"
 
-BLASGrid::BLASGrid(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat)
+BLASGrid::BLASGrid(const int idx, const std::string& modelPath)
 {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -61,9 +62,9 @@ BLASGrid::BLASGrid(const int idx, const std::string& modelPath, const mat4 trans
     for (int i = 0; i < indices.size(); i += 3)
     {
         Tri tri(
-            TransformPosition(vertices[indices[i]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 1]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 2]].position, scaleMat),
+            vertices[indices[i]].position,
+            vertices[indices[i + 1]].position,
+            vertices[indices[i + 2]].position,
             vertices[indices[i]].normal,
             vertices[indices[i + 1]].normal,
             vertices[indices[i + 2]].normal,
@@ -76,7 +77,6 @@ BLASGrid::BLASGrid(const int idx, const std::string& modelPath, const mat4 trans
     }
 
     Build();
-    SetTransform(transform);
 }
 
 void BLASGrid::Build()
@@ -92,45 +92,45 @@ void BLASGrid::Build()
     float3 gridSize = localBounds.bmax3 - localBounds.bmin3;
 
     // dynamically calculate resolution
-    float cubeRoot = powf(5 * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#ifdef GRID_TWO_LEVEL
+    float cubeRoot = powf(GRID_TOP_DENSITY * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#else
+    float cubeRoot = powf(GRID_CELL_DENSITY * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#endif
     for (int i = 0; i < 3; i++)
     {
         resolution[i] = static_cast<int>(floor(gridSize[i] * cubeRoot));
         resolution[i] = max(1, min(resolution[i], 128));
     }
 
-    gridCells.resize(resolution.x * resolution.y * resolution.z);
-
     cellSize = float3(gridSize.x / resolution.x, gridSize.y / resolution.y, gridSize.z / resolution.z);
+#ifdef GRID_TWO_LEVEL
+    BuildTwoLevelGrid(triangles, localBounds, resolution, cellSize, topCells, cellStart, triIndices);
+#else
+    BuildGridCells(triangles, localBounds, resolution, cellSize, cellStart, triIndices);
+#endif
+    BuildTriAccel(triangles, triAccel);
+    BuildTriPacks();
+    auto endTime = std::chrono::high_resolution_clock::now();
+    buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
 
-    // Put triangles into grids
-    for (size_t triIdx = 0; triIdx < triangles.size(); triIdx++)
+void BLASGrid::BuildTriPacks()
+{
+    triPacks.clear(), cellPacks.clear();
+    if (!UseTriPacks()) return;
+    // the packs keep the triangle indices, so triIndices is dropped
+    const uint cellCount = (uint)cellStart.size() - 1;
+    cellPacks.resize(cellCount);
+    for (uint cell = 0; cell < cellCount; cell++)
     {
-        aabb bounds = triangles[triIdx].GetBounds();
-
-        // Determine grid cell range for the object
-        int minX = clamp(static_cast<int>((bounds.bmin3.x - localBounds.bmin3.x) / cellSize.x), 0, resolution.x - 1);
-        int minY = clamp(static_cast<int>((bounds.bmin3.y - localBounds.bmin3.y) / cellSize.y), 0, resolution.y - 1);
-        int minZ = clamp(static_cast<int>((bounds.bmin3.z - localBounds.bmin3.z) / cellSize.z), 0, resolution.z - 1);
-        int maxX = clamp(static_cast<int>((bounds.bmax3.x - localBounds.bmin3.x) / cellSize.x), 0, resolution.x - 1);
-        int maxY = clamp(static_cast<int>((bounds.bmax3.y - localBounds.bmin3.y) / cellSize.y), 0, resolution.y - 1);
-        int maxZ = clamp(static_cast<int>((bounds.bmax3.z - localBounds.bmin3.z) / cellSize.z), 0, resolution.z - 1);
-
-        // Assign the object to the corresponding grid cells
-        for (int iz = minZ; iz <= maxZ; ++iz) {
-            for (int iy = minY; iy <= maxY; ++iy) {
-                for (int ix = minX; ix <= maxX; ++ix) {
-                    int cellIndex = ix + iy * resolution.x + iz * resolution.x * resolution.y;
-                    gridCells[cellIndex].triIndices.push_back(triIdx);
-                }
-            }
-        }
+        cellPacks[cell] = (uint)triPacks.size();
+        AppendTriPacks(triAccel, triIndices.data() + cellStart[cell], cellStart[cell + 1] - cellStart[cell], triPacks);
     }
-    auto endTime = std::chrono::high_resolution_clock::now();
-    buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    std::vector<uint>().swap(triIndices);
 }
 
-bool BLASGrid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
+bool BLASGrid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut)
 {
     float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
     float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
@@ -138,24 +138,23 @@ bool BLASGrid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bma
     tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
     float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
     tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+    tminOut = tmin;
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 
-bool BLASGrid::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+bool BLASGrid::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return false; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return false;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return false;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
@@ -169,10 +168,73 @@ int BLASGrid::GetTriangleCount() const
     return triangles.size();
 }
 
+size_t BLASGrid::GetMemoryUsage() const
+{
+    return sizeof(BLASGrid) + triangles.capacity() * sizeof(Tri) + triAccel.capacity() * sizeof(TriAccel) +
+        triPacks.capacity() * sizeof(TriPack) + mailbox.capacity() * sizeof(long) +
+        (cellStart.capacity() + triIndices.capacity() + cellPacks.capacity()) * sizeof(uint) + topCells.capacity() * sizeof(GridTopCell);
+}
+
+#ifdef GRID_TWO_LEVEL
+void BLASGrid::IntersectGrid(Ray& ray, long uid)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return;
+    WalkTwoLevelGrid(ray, max(tmin, 0.0f), ray.t, localBounds.bmin3, resolution, cellSize, topCells.data(), [&](const uint index)
+    {
+        ray.traversed++;
+        const uint first = cellStart[index], triCount = cellStart[index + 1] - first;
+        // packed cells test all their triangles at once, without mailboxing
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[cellPacks[index] + p], ray, 0xff)) ray.objIdx = objIdx;
+            ray.tested += triCount;
+        }
+        else for (uint i = first; i < first + triCount; i++)
+        {
+            const uint triIdx = triIndices[i];
+#ifdef GRID_MAILBOXING
+            if (uid == mailbox[triIdx]) continue;
+            mailbox[triIdx] = uid;
+#endif
+            ray.tested++;
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+        }
+        return false;
+    });
+}
+
+bool BLASGrid::OccludedGrid(Ray& ray)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return false;
+    const float tmax = ray.t;
+    bool occluded = false;
+    WalkTwoLevelGrid(ray, max(tmin, 0.0f), tmax, localBounds.bmin3, resolution, cellSize, topCells.data(), [&](const uint index)
+    {
+        const uint first = cellStart[index], triCount = cellStart[index + 1] - first;
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount && !occluded; p++)
+                occluded = IntersectTriPack(triPacks[cellPacks[index] + p], ray, 0xff);
+        }
+        else for (uint i = first; i < first + triCount && !occluded; i++)
+        {
+            const uint triIdx = triIndices[i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+            occluded = ray.t < tmax;
+        }
+        return occluded;
+    });
+    return occluded;
+}
+#else
 void BLASGrid::IntersectGrid(Ray& ray, long uid)
 {
     // Calculate tmin and tmax
-    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3)) return;
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return;
 
     // Determine the cell indices that the ray traverses
     int3 exit, step, cell;
@@ -201,18 +263,27 @@ void BLASGrid::IntersectGrid(Ray& ray, long uid)
     {
         ray.traversed++;
         uint index = cell.x + cell.y * resolution.x + cell.z * resolution.x * resolution.y;
-        for (int triIdx : gridCells[index].triIndices)
+        const uint first = cellStart[index], triCount = cellStart[index + 1] - first;
+        // packed cells test all their triangles at once, without mailboxing
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[cellPacks[index] + p], ray, 0xff)) ray.objIdx = objIdx;
+            ray.tested += triCount;
+        }
+        else for (uint i = first; i < first + triCount; i++)
         {
+            const uint triIdx = triIndices[i];
 #ifdef GRID_MAILBOXING
             if (uid != mailbox[triIdx])
             {
                 mailbox[triIdx] = uid;
                 ray.tested++;
-                IntersectTri(ray, triangles[triIdx], triIdx);
+                IntersectTri(ray, triAccel[triIdx], triIdx);
             }
 #else
             ray.tested++;
-            IntersectTri(ray, triangles[triIdx], triIdx);
+            IntersectTri(ray, triAccel[triIdx], triIdx);
 #endif
         }
 
@@ -230,21 +301,79 @@ void BLASGrid::IntersectGrid(Ray& ray, long uid)
     }
 }
 
+// Any hit below ray.t occludes, wherever it lies along the ray, so the walk stops at the first
+// cell with one and needs no mailboxes.
+bool BLASGrid::OccludedGrid(Ray& ray)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return false;
+
+    int3 exit, step, cell;
+    float3 deltaT, nextCrossingT;
+    for (int i = 0; i < 3; ++i)
+    {
+        float rayOrigCell = ray.O[i] - localBounds.bmin3[i];
+        cell[i] = clamp(static_cast<int>(std::floor(rayOrigCell / cellSize[i])), 0, resolution[i] - 1);
+        if (ray.D[i] < 0)
+        {
+            deltaT[i] = -cellSize[i] * ray.rD[i];
+            nextCrossingT[i] = (cell[i] * cellSize[i] - rayOrigCell) * ray.rD[i];
+            exit[i] = -1;
+            step[i] = -1;
+        }
+        else
+        {
+            deltaT[i] = cellSize[i] * ray.rD[i];
+            nextCrossingT[i] = ((cell[i] + 1) * cellSize[i] - rayOrigCell) * ray.rD[i];
+            exit[i] = resolution[i];
+            step[i] = 1;
+        }
+    }
+
+    const float tmax = ray.t;
+    while (true)
+    {
+        uint index = cell.x + cell.y * resolution.x + cell.z * resolution.x * resolution.y;
+        const uint first = cellStart[index], triCount = cellStart[index + 1] - first;
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[cellPacks[index] + p], ray, 0xff)) return true;
+        }
+        else for (uint i = first; i < first + triCount; i++)
+        {
+            const uint triIdx = triIndices[i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+            if (ray.t < tmax) return true;
+        }
+
+        uint k =
+            ((nextCrossingT.x < nextCrossingT.y) << 2) +
+            ((nextCrossingT.x < nextCrossingT.z) << 1) +
+            ((nextCrossingT.y < nextCrossingT.z));
+        static const uint8_t map[8] = { 2, 1, 2, 1, 2, 2, 0, 0 };
+        uint8_t axis = map[k];
+
+        if (tmax < nextCrossingT[axis]) return false;
+        cell[axis] += step[axis];
+        if (cell[axis] == exit[axis]) return false;
+        nextCrossingT[axis] += deltaT[axis];
+    }
+}
+#endif
+
+// the ray is in object space, see BLASInstance
 void BLASGrid::Intersect(Ray& ray)
 {
-    Ray tRay = Ray(ray);
     incremental++;
     if (incremental >= 2147483647) incremental = 0;
-    tRay.O = TransformPosition_SSE(ray.O4, invT);
-    tRay.D = TransformVector_SSE(ray.D4, invT);
-    tRay.rD = float3(1 / tRay.D.x, 1 / tRay.D.y, 1 / tRay.D.z);
-
-    IntersectGrid(tRay, incremental);
+    IntersectGrid(ray, incremental);
+}
 
-    tRay.O = ray.O;
-    tRay.D = ray.D;
-    tRay.rD = ray.rD;
-    ray = tRay;
+bool BLASGrid::IsOccluded(const Ray& ray)
+{
+    Ray shadowRay = Ray(ray);
+    return OccludedGrid(shadowRay);
 }
 
 float3 BLASGrid::GetNormal(const uint triIdx, const float2 barycentric) const
@@ -253,7 +382,7 @@ float3 BLASGrid::GetNormal(const uint triIdx, const float2 barycentric) const
     float3 n1 = triangles[triIdx].normal1;
     float3 n2 = triangles[triIdx].normal2;
     float3 N = (1 - barycentric.x - barycentric.y) * n0 + barycentric.x * n1 + barycentric.y * n2;
-    return normalize(TransformVector(N, T));
+    return normalize(N);
 }
 
 float2 BLASGrid::GetUV(const uint triIdx, const float2 barycentric) const
@@ -264,15 +393,7 @@ float2 BLASGrid::GetUV(const uint triIdx, const float2 barycentric) const
     return (1 - barycentric.x - barycentric.y) * uv0 + barycentric.x * uv1 + barycentric.y * uv2;
 }
 
-void BLASGrid::SetTransform(mat4 transform)
+aabb BLASGrid::GetBounds() const
 {
-    T = transform;
-    invT = transform.FastInvertedTransformNoScale();
-    // update bvh bound
-    // calculate world-space bounds using the new matrix
-    float3 bmin = localBounds.bmin3, bmax = localBounds.bmax3;
-    worldBounds = aabb();
-    for (int i = 0; i < 8; i++)
-        worldBounds.Grow(TransformPosition(float3(i & 1 ? bmax.x : bmin.x,
-            i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z), transform));
+    return localBounds;
 }
\ No newline at end of file
@@ -1,43 +1,127 @@
 #pragma once
 
+#include "tri_pack.h"
+
 // reference: https://www.scratchapixel.com/lessons/3d-basic-rendering/introduction-acceleration-structure/grid.html
 // reference: https://cs184.eecs.berkeley.edu/sp19/lecture/9-44/raytracing
 //#define GRID_MAILBOXING // not working very well
+#define GRID_TWO_LEVEL // a sub-grid per top cell, for both BLASGrid and Grid
 namespace Tmpl8
 {
-	struct GridCell
+	// A cell of the top level of a two-level grid, with the resolution of its sub-grid; a resolution
+	// of 0 means the cell is empty. Its cells are numbered from firstCell, x first.
+	struct GridTopCell
 	{
-		std::vector<int> triIndices = {};
+		uint firstCell;
+		uchar resolution[3];
+		uchar pad;
 	};
 
+	// Sets up a DDA through the grid of res cells of size at origin, starting at the point of the ray
+	// at distance t. The crossings are measured from the ray origin, so those of a sub-grid line up
+	// with the ones of the grid around it.
+	inline void SetupGridDDA(Ray& ray, const float t, float3 origin, int3 res, float3 size, int3& cell, int3& step, int3& exit, float3& deltaT, float3& nextT)
+	{
+		float3 P = ray.O + ray.D * t;
+		for (int i = 0; i < 3; i++)
+		{
+			cell[i] = clamp(static_cast<int>(std::floor((P[i] - origin[i]) / size[i])), 0, res[i] - 1);
+			if (ray.D[i] < 0)
+			{
+				deltaT[i] = -size[i] * ray.rD[i];
+				nextT[i] = (origin[i] + cell[i] * size[i] - ray.O[i]) * ray.rD[i];
+				exit[i] = -1, step[i] = -1;
+			}
+			else
+			{
+				deltaT[i] = size[i] * ray.rD[i];
+				nextT[i] = (origin[i] + (cell[i] + 1) * size[i] - ray.O[i]) * ray.rD[i];
+				exit[i] = res[i], step[i] = 1;
+			}
+		}
+	}
+
+	// the axis of the nearest crossing
+	inline uint NextGridAxis(float3& nextT)
+	{
+		static const uint8_t map[8] = { 2, 1, 2, 1, 2, 2, 0, 0 };
+		return map[((nextT.x < nextT.y) << 2) + ((nextT.x < nextT.z) << 1) + (nextT.y < nextT.z)];
+	}
+
+	// Walks the cells of a two-level grid that the ray passes from tEnter on, front to back: a DDA over
+	// the top cells, and in each that is not empty a second one over its sub-grid, from the point where
+	// the ray enters it. visit gets the index of every cell and returns true to stop the walk; the walk
+	// also stops at the first crossing past tLimit, which a visit may lower.
+	template <class Visit>
+	inline void WalkTwoLevelGrid(Ray& ray, const float tEnter, const float& tLimit, float3 origin, int3 resolution, float3 cellSize, const GridTopCell* topCells, Visit visit)
+	{
+		int3 cell, step, exit;
+		float3 deltaT, nextT;
+		SetupGridDDA(ray, tEnter, origin, resolution, cellSize, cell, step, exit, deltaT, nextT);
+		float tCell = tEnter;
+		while (true)
+		{
+			const uint axis = NextGridAxis(nextT);
+			const float tLeave = nextT[axis];
+			const GridTopCell& top = topCells[cell.x + cell.y * resolution.x + cell.z * resolution.x * resolution.y];
+			if (top.resolution[0] != 0)
+			{
+				int3 subRes = make_int3(top.resolution[0], top.resolution[1], top.resolution[2]), sub, subStep, subExit;
+				float3 subDeltaT, subNextT;
+				SetupGridDDA(ray, tCell, origin + make_float3(cell) * cellSize, subRes, cellSize / make_float3(subRes), sub, subStep, subExit, subDeltaT, subNextT);
+				while (true)
+				{
+					if (visit(top.firstCell + sub.x + sub.y * subRes.x + sub.z * subRes.x * subRes.y)) return;
+					const uint subAxis = NextGridAxis(subNextT);
+					const float tNext = subNextT[subAxis];
+					if (tLimit < tNext || tNext >= tLeave) break;
+					sub[subAxis] += subStep[subAxis];
+					if (sub[subAxis] == subExit[subAxis]) break;
+					subNextT[subAxis] += subDeltaT[subAxis];
+				}
+			}
+			if (tLimit < tLeave) return;
+			cell[axis] += step[axis];
+			if (cell[axis] == exit[axis]) return;
+			tCell = tLeave;
+			nextT[axis] += deltaT[axis];
+		}
+	}
+
 	class BLASGrid
 	{
 	private:
-		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
-		bool IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
+		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut);
+		bool IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
 		void IntersectGrid(Ray& ray, long uid);
+		bool OccludedGrid(Ray& ray);
+		void BuildTriPacks();
 	public:
 		BLASGrid() = default;
-		BLASGrid(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat);
+		BLASGrid(const int idx, const std::string& modelPath);
 		void Build();
 		void Intersect(Ray& ray);
-		void SetTransform(mat4 transform);
+		bool IsOccluded(const Ray& ray);
+		aabb GetBounds() const;
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
+		size_t GetMemoryUsage() const;
 	private:
 		int3 resolution = 0;
 		float3 cellSize = 0;
 		std::vector<Tri> triangles;
-		std::vector<GridCell> gridCells;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
+		std::vector<TriPack> triPacks; // cell triangles, 8 per pack; empty without AVX2
+		std::vector<uint> cellStart; // cell c holds triIndices[cellStart[c]] up to triIndices[cellStart[c + 1]]
+		std::vector<uint> triIndices; // the triangles of all cells, cell after cell; empty when packed
+		std::vector<uint> cellPacks; // the first TriPack of each cell, when packed
+		std::vector<GridTopCell> topCells; // the top level of a two-level grid, see GRID_TWO_LEVEL
 		std::vector<long> mailbox;
 		long incremental = 0;
 	public:
 		int objIdx = -1;
-		int matIdx = -1;
-		mat4 T, invT;
 		aabb localBounds;
-		aabb worldBounds;
 		std::chrono::microseconds buildTime;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <unordered_set>
+#include "ray_packet.h"
+
+// An instance places a BLAS in the scene. The BLAS holds the geometry in object space and can be
+// shared by any number of instances; each instance has its own transform, which may scale, and its
+// own object index and material. A ray is moved into object space, where t is the same ray
+// parameter as in world space, so the hits of different instances compare directly.
+
+namespace Tmpl8
+{
+	// A nested TLAS numbers the objects below it from 0. An instance of it covers that many object
+	// indices from its own, and a hit inside it is reported at an offset from the instance's index.
+	template <class BLAS>
+	struct InstanceTraits { static const bool nested = false; };
+
+	template <class BLAS>
+	class BLASInstance
+	{
+	public:
+		BLASInstance() = default;
+		BLASInstance(BLAS* mesh, const int idx, const int material, const mat4& transform)
+			: blas(mesh), objIdx(idx), matIdx(material)
+		{
+			SetTransform(transform);
+		}
+		// an instance of a derived BLAS, seen as an instance of its base
+		template <class Derived>
+		BLASInstance(const BLASInstance<Derived>& instance)
+			: blas(instance.blas), objIdx(instance.objIdx), matIdx(instance.matIdx),
+			T(instance.T), invT(instance.invT), normalT(instance.normalT), worldBounds(instance.worldBounds)
+		{
+		}
+		void SetTransform(const mat4& transform)
+		{
+			T = transform;
+			invT = transform.Inverted();
+			normalT = invT.Transposed();
+			// world-space bounds of the transformed corners of the BLAS bounds
+			const aabb bounds = blas->GetBounds();
+			const float3 bmin = bounds.bmin3, bmax = bounds.bmax3;
+			worldBounds = aabb();
+			for (int i = 0; i < 8; i++)
+				worldBounds.Grow(TransformPosition(float3(i & 1 ? bmax.x : bmin.x,
+					i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z), transform));
+		}
+		void Intersect(Ray& ray) const
+		{
+			Ray tRay = Ray(ray);
+			tRay.O = TransformPosition_SSE(ray.O4, invT);
+			tRay.D = TransformVector_SSE(ray.D4, invT);
+			tRay.rD = float3(1 / tRay.D.x, 1 / tRay.D.y, 1 / tRay.D.z);
+			tRay.tested = ray.tested;
+			tRay.objIdx = -1; // a hit of another instance of the same BLAS would look like one of this instance
+			blas->Intersect(tRay);
+			ray.traversed = tRay.traversed, ray.tested = tRay.tested;
+			// the BLAS only shortens t when it finds a closer triangle
+			if (tRay.t < ray.t)
+			{
+				ray.t = tRay.t, ray.triIdx = tRay.triIdx, ray.barycentric = tRay.barycentric;
+				ray.objIdx = InstanceTraits<BLAS>::nested ? objIdx + tRay.objIdx : objIdx;
+			}
+		}
+		bool IsOccluded(const Ray& ray) const
+		{
+			Ray tRay = Ray(ray);
+			tRay.O = TransformPosition_SSE(ray.O4, invT);
+			tRay.D = TransformVector_SSE(ray.D4, invT);
+			tRay.rD = float3(1 / tRay.D.x, 1 / tRay.D.y, 1 / tRay.D.z);
+			return blas->IsOccluded(tRay);
+		}
+		void IntersectPacket(RayPacket& packet, const uint first) const
+		{
+			RayPacket local;
+			local.Transform(packet, invT);
+			blas->IntersectPacket(local, first);
+			packet.CopyHits(local, objIdx, InstanceTraits<BLAS>::nested);
+		}
+		// the rays of a packet from `first` on one by one, for a BLAS without a packet traversal
+		void IntersectRays(RayPacket& packet, const uint first) const
+		{
+			for (uint i = first; i < RAY_PACKET_SIZE; i++)
+			{
+				Ray ray(float3(packet.ox[i], packet.oy[i], packet.oz[i]), float3(packet.dx[i], packet.dy[i], packet.dz[i]), packet.t[i]);
+				Intersect(ray);
+				packet.traversed += ray.traversed, packet.tested += ray.tested;
+				if (ray.t < packet.t[i])
+				{
+					packet.t[i] = ray.t, packet.u[i] = ray.barycentric.x, packet.v[i] = ray.barycentric.y;
+					packet.objIdx[i] = ray.objIdx, packet.triIdx[i] = ray.triIdx;
+				}
+			}
+		}
+		float3 GetNormal(const uint triIdx, const float2 barycentric) const
+		{
+			// normals transform with the inverse transpose, which keeps them perpendicular under scaling
+			return normalize(TransformVector(blas->GetNormal(triIdx, barycentric), normalT));
+		}
+		float2 GetUV(const uint triIdx, const float2 barycentric) const
+		{
+			return blas->GetUV(triIdx, barycentric);
+		}
+	public:
+		BLAS* blas = 0;
+		int objIdx = -1;
+		int matIdx = -1;
+		mat4 T, invT, normalT;
+		aabb worldBounds;
+	};
+
+	// the BLASes the instances refer to, each once, in the order of their first instance
+	template <class BLAS>
+	std::vector<BLAS*> DistinctBLAS(const std::vector<BLASInstance<BLAS>>& instances)
+	{
+		std::vector<BLAS*> distinct;
+		std::unordered_set<BLAS*> seen;
+		for (const BLASInstance<BLAS>& instance : instances)
+			if (seen.insert(instance.blas).second) distinct.push_back(instance.blas);
+		return distinct;
+	}
+}
\ No newline at end of file
@@ -1,7 +1,7 @@
 #include "precomp.h"
-#include "blas_kdtree.h"
+#include "kd_builder.h"
 
-BLASKDTree::BLASKDTree(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat)
+BLASKDTree::BLASKDTree(const int idx, const std::string& modelPath)
 {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -61,9 +61,9 @@ BLASKDTree::BLASKDTree(const int idx, const std::string& modelPath, const mat4 t
     for (int i = 0; i < indices.size(); i += 3)
     {
         Tri tri(
-            TransformPosition(vertices[indices[i]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 1]].position, scaleMat),
-            TransformPosition(vertices[indices[i + 2]].position, scaleMat),
+            vertices[indices[i]].position,
+            vertices[indices[i + 1]].position,
+            vertices[indices[i + 2]].position,
             vertices[indices[i]].normal,
             vertices[indices[i + 1]].normal,
             vertices[indices[i + 2]].normal,
@@ -76,33 +76,56 @@ BLASKDTree::BLASKDTree(const int idx, const std::string& modelPath, const mat4 t
     }
 
     Build();
-    SetTransform(transform);
 }
 
 void BLASKDTree::Build()
 {
     auto startTime = std::chrono::high_resolution_clock::now();
     triangleBounds.resize(triangles.size());
+    UpdateBounds();
+#ifdef KD_SAH
+    BuildKDTreeSAH(triangles, localBounds, kdNodes, triIndices, maxDepth);
+#else
     // populate triangle index array
-    std::vector<uint> triIndices;
-    triIndices.resize(triangles.size());
+    std::vector<uint> triIdx;
+    triIdx.resize(triangles.size());
     for (int i = 0; i < triangles.size(); i++)
     {
         // setup indices
-        triIndices[i] = i;
+        triIdx[i] = i;
     }
-    UpdateBounds();
-    // assign all triangles to root node
-    rootNode = new KDTreeNode();
-    rootNode->aabbMin = localBounds.bmin3;
-    rootNode->aabbMax = localBounds.bmax3;
-    rootNode->triIndices = triIndices;
-    // subdivide recursively
-    Subdivide(rootNode, 0);
+    // assign all triangles to the root node, the children are appended as it is subdivided
+    kdNodes.clear();
+    triIndices.clear();
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(rootNodeIdx, triIdx, localBounds, 0);
+#endif
+    kdNodes.shrink_to_fit();
+    triIndices.shrink_to_fit();
+    nodesUsed = (uint)kdNodes.size();
+    BuildTriAccel(triangles, triAccel);
+    triPacks.clear();
+    if (UseTriPacks()) BuildTriPacks();
+#ifdef KD_ROPES
+    BuildKDRopes(kdNodes, localBounds, ropeLeaves);
+#endif
     auto endTime = std::chrono::high_resolution_clock::now();
     buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 }
 
+// the packs keep the triangle indices, so a leaf points at its first pack and triIndices is dropped
+void BLASKDTree::BuildTriPacks()
+{
+    for (KDTreeNode& node : kdNodes)
+    {
+        if (!node.isLeaf()) continue;
+        const uint firstPack = (uint)triPacks.size();
+        AppendTriPacks(triAccel, triIndices.data() + node.first, node.triCount(), triPacks);
+        node.first = firstPack;
+    }
+    std::vector<uint>().swap(triIndices);
+}
+
 void BLASKDTree::UpdateBounds()
 {
     aabb b;
@@ -119,142 +142,37 @@ void BLASKDTree::UpdateBounds()
     localBounds = b;
 }
 
-float BLASKDTree::EvaluateSAH(KDTreeNode* node, int axis, float pos)
+void BLASKDTree::MakeLeaf(const uint nodeIdx, const std::vector<uint>& triIdx)
 {
-    // determine triangle counts and bounds for this split candidate
-    aabb leftBox, rightBox;
-    int leftCount = 0, rightCount = 0;
-    int triCount = node->triIndices.size();
-    for (uint i = 0; i < triCount; i++)
-    {
-        Tri& triangle = triangles[node->triIndices[i]];
-        aabb bounds = triangleBounds[node->triIndices[i]];
-        if (bounds.bmax[axis] < pos + 0.001)
-        {
-            leftCount++;
-            leftBox.Grow(triangle.vertex0);
-            leftBox.Grow(triangle.vertex1);
-            leftBox.Grow(triangle.vertex2);
-        }
-        else if (bounds.bmin[axis] > pos - 0.001)
-        {
-            rightCount++;
-            rightBox.Grow(triangle.vertex0);
-            rightBox.Grow(triangle.vertex1);
-            rightBox.Grow(triangle.vertex2);
-        }
-        else
-        {
-            leftCount++;
-            leftBox.Grow(triangle.vertex0);
-            leftBox.Grow(triangle.vertex1);
-            leftBox.Grow(triangle.vertex2);
-            rightCount++;
-            rightBox.Grow(triangle.vertex0);
-            rightBox.Grow(triangle.vertex1);
-            rightBox.Grow(triangle.vertex2);
-        }
-    }
-    float cost = leftCount * leftBox.Area() + rightCount * rightBox.Area();
-
-    return cost > 0 ? cost : 1e30f;
-}
-
-float BLASKDTree::CalculateNodeCost(KDTreeNode* node)
-{
-    float3 e = node->aabbMax - node->aabbMin; // extent of the node
-    float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-    return node->triIndices.size() * surfaceArea;
+    kdNodes[nodeIdx].first = (uint)triIndices.size();
+    kdNodes[nodeIdx].data = (uint)triIdx.size() << 2 | 3;
+    triIndices.insert(triIndices.end(), triIdx.begin(), triIdx.end());
 }
 
-float BLASKDTree::FindBestSplitPlane(KDTreeNode* node, int& axis, float& splitPos)
+// triIdx holds the triangles of the node and is released once they are split over the children
+void BLASKDTree::Subdivide(const uint nodeIdx, std::vector<uint>& triIdx, const aabb& bounds, int depth)
 {
-    float bestCost = 1e30f;
-    int triCount = node->triIndices.size();
-    for (int a = 0; a < 3; a++)
+    // terminate recursion
+    uint triCount = triIdx.size();
+    if (depth >= m_maxBuildDepth || triCount <= 2)
     {
-        float boundsMin = 1e30f, boundsMax = -1e30f;
-        for (int i = 0; i < triCount; i++)
-        {
-            Tri& triangle = triangles[node->triIndices[i]];
-            boundsMin = min(boundsMin, triangle.centroid[a]);
-            boundsMax = max(boundsMax, triangle.centroid[a]);
-        }
-        if (boundsMin == boundsMax) continue;
-        // populate the bins
-        Bin bin[KD_BINS];
-        float scale = KD_BINS / (boundsMax - boundsMin);
-        for (uint i = 0; i < triCount; i++)
-        {
-            Tri& triangle = triangles[node->triIndices[i]];
-            int binIdx = min(KD_BINS - 1,
-                (int)((triangle.centroid[a] - boundsMin) * scale));
-            bin[binIdx].triCount++;
-            bin[binIdx].bounds.Grow(triangle.vertex0);
-            bin[binIdx].bounds.Grow(triangle.vertex1);
-            bin[binIdx].bounds.Grow(triangle.vertex2);
-        }
-        // gather data for the 7 planes between the 8 bins
-        float leftArea[KD_BINS - 1], rightArea[KD_BINS - 1];
-        int leftCount[KD_BINS - 1], rightCount[KD_BINS - 1];
-        aabb leftBox, rightBox;
-        int leftSum = 0, rightSum = 0;
-        for (int i = 0; i < KD_BINS - 1; i++)
-        {
-            leftSum += bin[i].triCount;
-            leftCount[i] = leftSum;
-            leftBox.Grow(bin[i].bounds);
-            leftArea[i] = leftBox.Area();
-            rightSum += bin[KD_BINS - 1 - i].triCount;
-            rightCount[KD_BINS - 2 - i] = rightSum;
-            rightBox.Grow(bin[KD_BINS - 1 - i].bounds);
-            rightArea[KD_BINS - 2 - i] = rightBox.Area();
-        }
-        // calculate SAH cost for the 7 planes
-        scale = (boundsMax - boundsMin) / KD_BINS;
-        for (int i = 0; i < KD_BINS - 1; i++)
-        {
-            float planeCost =
-                leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
-            if (planeCost < bestCost)
-                axis = a, splitPos = boundsMin + scale * (i + 1),
-                bestCost = planeCost;
-        }
+        MakeLeaf(nodeIdx, triIdx);
+        return;
     }
-    return bestCost;
-}
-
-void BLASKDTree::Subdivide(KDTreeNode* node, int depth)
-{
-    // terminate recursion
-    if (depth >= m_maxBuildDepth) return;
-    uint triCount = node->triIndices.size();
-    if (triCount <= 2) return;
-
-#ifdef KD_SAH
-    // determine split axis using SAH
-    int axis;
-    float splitPos;
-    float splitCost = FindBestSplitPlane(node, axis, splitPos);
+    if (depth > maxDepth) maxDepth = depth;
 
-    float nosplitCost = CalculateNodeCost(node);
-    if (splitCost >= nosplitCost) return;
-    float distance = splitPos - node->aabbMin[axis];
-#else
     // split plane axis and position
-    float3 extent = node->aabbMax - node->aabbMin;
+    float3 extent = bounds.bmax3 - bounds.bmin3;
     int axis = 0;
     if (extent.y > extent.x) axis = 1;
     if (extent.z > extent[axis]) axis = 2;
-    float distance = extent[axis] * 0.5f;
-    float splitPos = node->aabbMin[axis] + distance;
-#endif
+    float splitPos = bounds.bmin[axis] + extent[axis] * 0.5f;
     std::vector<uint> leftTriIdxs;
     std::vector<uint> rightTriIdxs;
 
     for (int i = 0; i < triCount; i++)
     {
-        uint idx = node->triIndices[i];
+        uint idx = triIdx[i];
         if (triangleBounds[idx].bmax[axis] < splitPos)
         {
             leftTriIdxs.push_back(idx);
@@ -269,35 +187,21 @@ void BLASKDTree::Subdivide(KDTreeNode* node, int depth)
             rightTriIdxs.push_back(idx);
         }
     }
-
-    //if (leftTriIdxs.size() == triCount || rightTriIdxs.size() == triCount) return;
-
-    KDTreeNode* leftChild = new KDTreeNode();
-    KDTreeNode* rightChild = new KDTreeNode();
-    leftChild->triIndices = leftTriIdxs;
-    rightChild->triIndices = rightTriIdxs;
-    node->left = leftChild;
-    node->right = rightChild;
-    nodesUsed++; nodesUsed++;
-
-    node->splitAxis = axis;
-    node->splitDistance = distance;
+    std::vector<uint>().swap(triIdx);
 
     // update the bounds of nodes
-    leftChild->aabbMin = node->aabbMin;
-    leftChild->aabbMax = node->aabbMax;
-    leftChild->aabbMax[axis] = splitPos;
-
-    rightChild->aabbMin = node->aabbMin;
-    rightChild->aabbMax = node->aabbMax;
-    rightChild->aabbMin[axis] = splitPos;
-
-    node->triIndices.clear();
-    node->isLeaf = false;
-
-    // recurse
-    Subdivide(leftChild, depth + 1);
-    Subdivide(rightChild, depth + 1);
+    aabb leftBounds = bounds, rightBounds = bounds;
+    leftBounds.bmax[axis] = splitPos;
+    rightBounds.bmin[axis] = splitPos;
+
+    // recurse; the left child follows the node, the right one follows the subtree of the left one
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(nodeIdx + 1, leftTriIdxs, leftBounds, depth + 1);
+    const uint rightIdx = (uint)kdNodes.size();
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(rightIdx, rightTriIdxs, rightBounds, depth + 1);
+    kdNodes[nodeIdx].splitPos = splitPos;
+    kdNodes[nodeIdx].data = rightIdx << 2 | axis;
 }
 
 bool BLASKDTree::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut, float& tmaxOut)
@@ -313,124 +217,190 @@ bool BLASKDTree::IntersectAABB(const Ray& ray, const float3 bmin, const float3 b
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 
-void BLASKDTree::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+void BLASKDTree::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
     }
 }
 
-void BLASKDTree::IntersectKDTree(Ray& ray, KDTreeNode* node)
+int BLASKDTree::GetTriangleCount() const
+{
+    return triangles.size();
+}
+
+size_t BLASKDTree::GetMemoryUsage() const
+{
+    return sizeof(BLASKDTree) + triangles.capacity() * sizeof(Tri) + triAccel.capacity() * sizeof(TriAccel) +
+        triPacks.capacity() * sizeof(TriPack) + triangleBounds.capacity() * sizeof(aabb) +
+        kdNodes.capacity() * sizeof(KDTreeNode) + triIndices.capacity() * sizeof(uint) +
+        ropeLeaves.capacity() * sizeof(KDRopeLeaf);
+}
+
+aabb BLASKDTree::GetBounds() const
+{
+    return localBounds;
+}
+
+#ifdef KD_ROPES
+// The ray, in object space (see BLASInstance), walks from leaf to leaf without a stack: it leaves a
+// cell through the face it reaches first and descends from the node behind that face to the leaf
+// where it enters, see KDRopeLeaf.
+void BLASKDTree::Intersect(Ray& ray)
 {
     float tmin, tmax;
-    if (node == nullptr) return;
-    ray.traversed++;
-    if (!IntersectAABB(ray, node->aabbMin, node->aabbMax, tmin, tmax)) return;
-    if (node->isLeaf)
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return;
+    float3 entry = ray.O + ray.D * max(tmin, 0.0f);
+    uint nodeIdx = rootNodeIdx;
+    while (1)
     {
-        uint triCount = node->triIndices.size();
-        for (uint i = 0; i < triCount; i++)
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        ray.traversed++;
+        if (!node.isLeaf())
         {
-            uint triIdx = node->triIndices[i];
-            IntersectTri(ray, triangles[triIdx], triIdx);
-            ray.tested++;
+            nodeIdx = DescendKDRope(node, nodeIdx, entry, ray.D);
+            continue;
         }
-        return;
+        const KDRopeLeaf& leaf = ropeLeaves[node.first];
+        const uint triCount = node.triCount();
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[leaf.first + p], ray, 0xff)) ray.objIdx = objIdx;
+        }
+        else for (uint i = 0; i < triCount; i++)
+        {
+            uint triIdx = triIndices[leaf.first + i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+        }
+        ray.tested += triCount;
+        uint face;
+        const float tExit = ExitKDLeaf(leaf, ray, face, entry);
+        // a hit inside the cell is in front of all the cells after it
+        if (ray.t <= tExit || leaf.rope[face] == 0) return;
+        nodeIdx = leaf.rope[face];
     }
+}
 
-    int axis = node->splitAxis;
-    float splitPos = node->aabbMin[node->splitAxis] + node->splitDistance;
-    float t = (splitPos - ray.O[axis]) / ray.D[axis];
-
-    //IntersectKDTree(ray, node->left);
-    //IntersectKDTree(ray, node->right);
-
-    if(ray.D[axis] > 0)
+bool BLASKDTree::IsOccluded(const Ray& ray)
+{
+    Ray shadowRay = Ray(ray);
+    float tmin, tmax;
+    if (!IntersectAABB(shadowRay, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return false;
+    float3 entry = shadowRay.O + shadowRay.D * max(tmin, 0.0f);
+    uint nodeIdx = rootNodeIdx;
+    while (1)
     {
-        // t <= tmin, only the right node is intersected
-        if (t < tmin + 0.001)
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        if (!node.isLeaf())
         {
-            IntersectKDTree(ray, node->right);
+            nodeIdx = DescendKDRope(node, nodeIdx, entry, shadowRay.D);
+            continue;
         }
-        // t >= tmax, only the left node is intersected
-        else if (t > tmax - 0.001)
+        const KDRopeLeaf& leaf = ropeLeaves[node.first];
+        const uint triCount = node.triCount();
+        if (!triPacks.empty())
         {
-            IntersectKDTree(ray, node->left);
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[leaf.first + p], shadowRay, 0xff)) return true;
         }
-        else
+        else for (uint i = 0; i < triCount; i++)
         {
-            IntersectKDTree(ray, node->left);
-            if (ray.objIdx == objIdx && ray.t < t) return;
-            IntersectKDTree(ray, node->right);
+            uint triIdx = triIndices[leaf.first + i];
+            IntersectTri(shadowRay, triAccel[triIdx], triIdx);
+            if (shadowRay.t < ray.t) return true;
         }
+        uint face;
+        const float tExit = ExitKDLeaf(leaf, shadowRay, face, entry);
+        if (tExit >= ray.t || leaf.rope[face] == 0) return false;
+        nodeIdx = leaf.rope[face];
     }
-    else
+}
+#else
+// the ray is in object space, see BLASInstance
+void BLASKDTree::Intersect(Ray& ray)
+{
+    float tmin, tmax;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return;
+    tmin = max(tmin, 0.0f);
+    KDTraversalEntry stack[KD_STACK_SIZE];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
     {
-        // t <= tmin, only the left node is intersected
-        if (t < tmin + 0.001)
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        ray.traversed++;
+        if (!node.isLeaf())
         {
-            IntersectKDTree(ray, node->left);
+            DescendKDTree(node, nodeIdx, ray, tmin, tmax, stack, stackPtr);
+            continue;
         }
-        // t >= tmax, only the left node is intersected
-        else if (t > tmax - 0.001)
+        const uint triCount = node.triCount();
+        if (!triPacks.empty())
         {
-            IntersectKDTree(ray, node->right);
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[node.first + p], ray, 0xff)) ray.objIdx = objIdx;
         }
-        else
+        else for (uint i = 0; i < triCount; i++)
         {
-            IntersectKDTree(ray, node->right);
-            if (ray.objIdx == objIdx && ray.t < t) return;
-            IntersectKDTree(ray, node->left);
+            uint triIdx = triIndices[node.first + i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
         }
+        ray.tested += triCount;
+        if (stackPtr == 0) return;
+        // a hit in front of the next cell is in front of all the cells left on the stack
+        const KDTraversalEntry& entry = stack[--stackPtr];
+        if (ray.t < entry.tmin) return;
+        nodeIdx = entry.nodeIdx, tmin = entry.tmin, tmax = entry.tmax;
     }
 }
 
-int BLASKDTree::GetTriangleCount() const
-{
-    return triangles.size();
-}
-
-void BLASKDTree::SetTransform(mat4 transform)
-{
-    T = transform;
-    invT = transform.FastInvertedTransformNoScale();
-    // update bvh bound
-    // calculate world-space bounds using the new matrix
-    float3 bmin = rootNode->aabbMin, bmax = rootNode->aabbMax;
-    worldBounds = aabb();
-    for (int i = 0; i < 8; i++)
-        worldBounds.Grow(TransformPosition(float3(i & 1 ? bmax.x : bmin.x,
-            i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z), transform));
-}
-
-void BLASKDTree::Intersect(Ray& ray)
+// Any hit below ray.t occludes, so the first leaf with a hit ends the search.
+bool BLASKDTree::IsOccluded(const Ray& ray)
 {
-    Ray tRay = Ray(ray);
-    tRay.O = TransformPosition_SSE(ray.O4, invT);
-    tRay.D = TransformVector_SSE(ray.D4, invT);
-    tRay.rD = float3(1 / tRay.D.x, 1 / tRay.D.y, 1 / tRay.D.z);
-
-    IntersectKDTree(tRay, rootNode);
-
-    tRay.O = ray.O;
-    tRay.D = ray.D;
-    tRay.rD = ray.rD;
-    ray = tRay;
+    Ray shadowRay = Ray(ray);
+    float tmin, tmax;
+    if (!IntersectAABB(shadowRay, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return false;
+    tmin = max(tmin, 0.0f);
+    KDTraversalEntry stack[KD_STACK_SIZE];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
+    {
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        if (!node.isLeaf())
+        {
+            DescendKDTree(node, nodeIdx, shadowRay, tmin, tmax, stack, stackPtr);
+            continue;
+        }
+        const uint triCount = node.triCount();
+        if (!triPacks.empty())
+        {
+            for (uint p = 0; p * TRI_PACK_WIDTH < triCount; p++)
+                if (IntersectTriPack(triPacks[node.first + p], shadowRay, 0xff)) return true;
+        }
+        else for (uint i = 0; i < triCount; i++)
+        {
+            uint triIdx = triIndices[node.first + i];
+            IntersectTri(shadowRay, triAccel[triIdx], triIdx);
+            if (shadowRay.t < ray.t) return true;
+        }
+        if (stackPtr == 0) return false;
+        const KDTraversalEntry& entry = stack[--stackPtr];
+        nodeIdx = entry.nodeIdx, tmin = entry.tmin, tmax = entry.tmax;
+    }
 }
+#endif
 
 float3 BLASKDTree::GetNormal(const uint triIdx, const float2 barycentric) const
 {
@@ -438,7 +408,7 @@ float3 BLASKDTree::GetNormal(const uint triIdx, const float2 barycentric) const
     float3 n1 = triangles[triIdx].normal1;
     float3 n2 = triangles[triIdx].normal2;
     float3 N = (1 - barycentric.x - barycentric.y) * n0 + barycentric.x * n1 + barycentric.y * n2;
-    return normalize(TransformVector(N, T));
+    return normalize(N);
 }
 
 float2 BLASKDTree::GetUV(const uint triIdx, const float2 barycentric) const
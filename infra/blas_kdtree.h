@@ -1,8 +1,11 @@
 #pragma once
 
-//#define KD_SAH
+#include "tri_pack.h"
+
+#define KD_SAH // SAH split planes from a sweep over sorted events (kd_builder.h), otherwise the spatial median
 #define KD_FASTER_RAY
-#define KD_BINS 8
+#define KD_STACK_SIZE 64 // traversal stack, deeper than the builders go
+//#define KD_ROPES // stackless traversal from leaf to leaf over ropes (kd_builder.h), otherwise with a stack
 // reference: course slides
 // reference: https://www.youtube.com/watch?v=TrqK-atFfWY&ab_channel=JustinSolomon
 // reference: https://github.com/reddeupenn/kdtreePathTracerOptimization
@@ -12,49 +15,114 @@
 
 namespace Tmpl8
 {
+	// The nodes are stored depth first in one array, so the left child of an interior node is the next
+	// node and only the right one needs an index. A node has no bounds: traversal clips the ray against
+	// the bounds of the tree once and then only against the split planes.
 	struct KDTreeNode
 	{
-		float3 aabbMin = 0, aabbMax = 0;
-		KDTreeNode* left;
-		KDTreeNode* right;
-		int splitAxis = 0;
-		float splitDistance = 0;
-		std::vector<uint> triIndices;
-		bool isLeaf = true;
+		union { float splitPos; uint first; }; // 4 bytes
+		uint data; // 4 bytes; total: 8 bytes
+		// The low 2 bits of data hold the split axis, or 3 for a leaf, the others the index of the
+		// right child, or the triangle count of a leaf. first is the first entry of a leaf in
+		// triIndices, or in triPacks when the leaves are packed; with KD_ROPES, it is the index of
+		// the KDRopeLeaf of the leaf.
+		bool isLeaf() const { return (data & 3) == 3; }
+		uint axis() const { return data & 3; }
+		uint right() const { return data >> 2; }
+		uint triCount() const { return data >> 2; }
 	};
 
+	// a node that is still to be visited, and the interval of the ray inside it
+	struct KDTraversalEntry { uint nodeIdx; float tmin, tmax; };
+
+	// Steps from an interior node to the child the ray enters first, and pushes the other one when the
+	// ray also reaches it within [tmin, tmax]. The ray visits the cells front to back, so the entries
+	// on the stack get farther from the top down.
+	inline void DescendKDTree(const KDTreeNode& node, uint& nodeIdx, Ray& ray, float& tmin, float& tmax, KDTraversalEntry* stack, uint& stackPtr)
+	{
+		const uint axis = node.axis();
+		const float tSplit = (node.splitPos - ray.O[axis]) * ray.rD[axis];
+		const bool leftFirst = ray.O[axis] < node.splitPos || (ray.O[axis] == node.splitPos && ray.D[axis] <= 0);
+		const uint nearIdx = leftFirst ? nodeIdx + 1 : node.right(), farIdx = leftFirst ? node.right() : nodeIdx + 1;
+		// !(tSplit > 0) also holds for a ray in the plane, whose tSplit is NaN
+		if (tSplit > tmax || !(tSplit > 0)) nodeIdx = nearIdx;
+		else if (tSplit < tmin) nodeIdx = farIdx;
+		else stack[stackPtr++] = { farIdx, tSplit, tmax }, nodeIdx = nearIdx, tmax = tSplit;
+	}
+
+	// A leaf with ropes (Havran 2001, Popov et al. 2007): its cell and, for each face, the node on the
+	// other side of it. With ropes, a leaf node holds the index of its KDRopeLeaf instead of its first
+	// triangle entry, which moves here.
+	struct KDRopeLeaf
+	{
+		float bmin[3], bmax[3];
+		uint rope[6]; // -x, +x, -y, +y, -z, +z; 0 (the root) where the face is on the bounds of the tree
+		uint first; // the first entry of the leaf in triIndices, or in triPacks when the leaves are packed
+	};
+
+	// Steps from an interior node to the child that holds the point P where the ray enters it; a point
+	// in the plane goes to the child the ray moves into.
+	inline uint DescendKDRope(const KDTreeNode& node, const uint nodeIdx, float3 P, float3 D)
+	{
+		const uint axis = node.axis();
+		const bool left = P[axis] < node.splitPos || (P[axis] == node.splitPos && D[axis] <= 0);
+		return left ? nodeIdx + 1 : node.right();
+	}
+
+	// The distance at which the ray leaves the cell of the leaf, the face it leaves through and the point
+	// where it does. The point is kept on the face, whatever the rounding, so the descent behind the
+	// rope cannot skip a thin cell next to it.
+	inline float ExitKDLeaf(const KDRopeLeaf& leaf, Ray& ray, uint& face, float3& P)
+	{
+		float tExit = 1e34f;
+		face = 0;
+		for (uint axis = 0; axis < 3; axis++)
+		{
+			if (ray.D[axis] == 0) continue;
+			const bool up = ray.D[axis] > 0;
+			const float t = ((up ? leaf.bmax[axis] : leaf.bmin[axis]) - ray.O[axis]) * ray.rD[axis];
+			if (t < tExit) tExit = t, face = axis * 2 + up;
+		}
+		P = ray.O + ray.D * tExit;
+		for (uint axis = 0; axis < 3; axis++) P[axis] = clamp(P[axis], leaf.bmin[axis], leaf.bmax[axis]);
+		P[face >> 1] = (face & 1) ? leaf.bmax[face >> 1] : leaf.bmin[face >> 1];
+		return tExit;
+	}
+
 	class BLASKDTree
 	{
 	private:
 		void UpdateBounds();
-		float CalculateNodeCost(KDTreeNode* node);
-		float FindBestSplitPlane(KDTreeNode* node, int& axis, float& splitPos);
-		void Subdivide(KDTreeNode* node, int depth);
-		float EvaluateSAH(KDTreeNode* node, int axis, float pos);
+		void Subdivide(const uint nodeIdx, std::vector<uint>& triIdx, const aabb& bounds, int depth);
+		void MakeLeaf(const uint nodeIdx, const std::vector<uint>& triIdx);
 		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tmin, float& tmax);
-		void IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
-		void IntersectKDTree(Ray& ray, KDTreeNode* node);
+		void IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
+		void BuildTriPacks();
 	public:
 		BLASKDTree() = default;
-		BLASKDTree(const int idx, const std::string& modelPath, const mat4 transform, const mat4 scaleMat);
+		BLASKDTree(const int idx, const std::string& modelPath);
 		void Build();
 		void Intersect(Ray& ray);
-		void SetTransform(mat4 transform);
+		bool IsOccluded(const Ray& ray);
+		aabb GetBounds() const;
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
+		size_t GetMemoryUsage() const;
 	private:
 		int m_maxBuildDepth = 20;
 	public:
 		int objIdx = -1;
-		int matIdx = -1;
-		KDTreeNode* rootNode;
+		uint maxDepth = 0;
+		std::vector<KDTreeNode> kdNodes;
+		std::vector<uint> triIndices; // the triangles of the leaves, one range per leaf; empty when packed
 		std::vector<Tri> triangles;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
+		std::vector<TriPack> triPacks; // leaf triangles, 8 per pack; empty without AVX2
+		std::vector<KDRopeLeaf> ropeLeaves; // empty without KD_ROPES
 		std::vector<aabb> triangleBounds;
 		uint rootNodeIdx = 0, nodesUsed = 1;
 		aabb localBounds;
-		aabb worldBounds;
-		mat4 T, invT;
 		std::chrono::microseconds buildTime;
 	};
 }
\ No newline at end of file
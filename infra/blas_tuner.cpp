@@ -0,0 +1,123 @@
+#include "precomp.h"
+#include "blas_tuner.h"
+#include <filesystem>
+
+const char* Tmpl8::blasCandidateNames[BLAS_CANDIDATE_COUNT] = { "bvh", "lbvh", "bvh4", "grid", "kdtree" };
+
+BLASType Tmpl8::GetCandidateType(const BLASCandidate candidate)
+{
+    switch (candidate)
+    {
+    case BLAS_CANDIDATE_BVH4: return BLAS_TYPE_BVH4;
+    case BLAS_CANDIDATE_GRID: return BLAS_TYPE_GRID;
+    case BLAS_CANDIDATE_KDTREE: return BLAS_TYPE_KDTREE;
+    default: return BLAS_TYPE_BVH;
+    }
+}
+
+// one line per measured model: the size of the file, its last write time, the best candidate, the cost
+// of each candidate and the location of the model; a later line for a model replaces an earlier one
+static bool ReadCachedTuning(BLASTuning& tuning, const uintmax_t fileSize, const long long fileTime)
+{
+    std::ifstream file(BLAS_TUNER_CACHE);
+    uintmax_t size;
+    long long time;
+    int best;
+    float nsPerRay[BLAS_CANDIDATE_COUNT];
+    std::string location;
+    while (file >> size >> time >> best)
+    {
+        for (int c = 0; c < BLAS_CANDIDATE_COUNT; c++) file >> nsPerRay[c];
+        std::getline(file >> std::ws, location);
+        if (!file || location != tuning.modelLocation || size != fileSize || time != fileTime || best < 0 || best >= BLAS_CANDIDATE_COUNT) continue;
+        tuning.best = (BLASCandidate)best;
+        for (int c = 0; c < BLAS_CANDIDATE_COUNT; c++) tuning.nsPerRay[c] = nsPerRay[c];
+        tuning.cached = true;
+    }
+    return tuning.cached;
+}
+
+static void WriteCachedTuning(const BLASTuning& tuning, const uintmax_t fileSize, const long long fileTime)
+{
+    std::ofstream file(BLAS_TUNER_CACHE, std::ios::app);
+    file << fileSize << " " << fileTime << " " << tuning.best;
+    for (int c = 0; c < BLAS_CANDIDATE_COUNT; c++) file << " " << tuning.nsPerRay[c];
+    file << " " << tuning.modelLocation << "\n";
+}
+
+template <class BLAS>
+static float MeasureNsPerRay(BLAS* blas, const std::vector<Ray>& rays)
+{
+    float best = 1e30f;
+    volatile float sink = 0; // keeps the traversal from being optimized away
+    for (int run = 0; run < BLAS_TUNER_RUNS; run++)
+    {
+        float nearest = 1e34f;
+        auto startTime = std::chrono::high_resolution_clock::now();
+        for (const Ray& sample : rays)
+        {
+            Ray ray(sample);
+            blas->Intersect(ray);
+            nearest = min(nearest, ray.t);
+        }
+        auto endTime = std::chrono::high_resolution_clock::now();
+        sink = nearest;
+        best = min(best, std::chrono::duration<float, std::nano>(endTime - startTime).count() / rays.size());
+    }
+    return best;
+}
+
+BLASTuning Tmpl8::TuneBLAS(const std::string& modelLocation, const BVHBuildSettings& settings)
+{
+    BLASTuning tuning;
+    tuning.modelLocation = modelLocation;
+    std::error_code error;
+    // an edit that keeps the size of the model still changes its write time
+    const uintmax_t fileSize = std::filesystem::file_size(modelLocation, error);
+    const long long fileTime = std::filesystem::last_write_time(modelLocation, error).time_since_epoch().count();
+    if (ReadCachedTuning(tuning, fileSize, fileTime)) return tuning;
+
+    BVHBuildSettings sah = settings, lbvh = settings;
+    sah.builder = BVH_BUILDER_SAH, lbvh.builder = BVH_BUILDER_LBVH;
+    BLASBVH* bvh = new BLASBVH(0, modelLocation, sah);
+    BLASBVH* bvhLBVH = new BLASBVH(0, modelLocation, lbvh);
+    BLASBVH4* bvh4 = new BLASBVH4(0, modelLocation, sah);
+    BLASGrid* grid = new BLASGrid(0, modelLocation);
+    BLASKDTree* kdtree = new BLASKDTree(0, modelLocation);
+
+    // the same sample for every candidate, from a sphere around the bounds to points inside them
+    const aabb bounds = bvh->GetBounds();
+    const float3 center = (bounds.bmin3 + bounds.bmax3) * 0.5f, extent = bounds.bmax3 - bounds.bmin3;
+    const float radius = max(length(extent), 1e-3f);
+    std::vector<Ray> rays(BLAS_TUNER_RAYS);
+    uint seed = 0x12345678;
+    for (Ray& ray : rays)
+    {
+        float3 d;
+        do d = float3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed)) * 2 - 1; while (dot(d, d) > 1 || dot(d, d) < 1e-4f);
+        const float3 O = center + normalize(d) * radius;
+        const float3 target = bounds.bmin3 + float3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed)) * extent;
+        ray = Ray(O, normalize(target - O));
+    }
+
+    tuning.nsPerRay[BLAS_CANDIDATE_BVH_SAH] = MeasureNsPerRay(bvh, rays);
+    tuning.nsPerRay[BLAS_CANDIDATE_BVH_LBVH] = MeasureNsPerRay(bvhLBVH, rays);
+    tuning.nsPerRay[BLAS_CANDIDATE_BVH4] = MeasureNsPerRay(bvh4, rays);
+    tuning.nsPerRay[BLAS_CANDIDATE_GRID] = MeasureNsPerRay(grid, rays);
+    tuning.nsPerRay[BLAS_CANDIDATE_KDTREE] = MeasureNsPerRay(kdtree, rays);
+    for (int c = 1; c < BLAS_CANDIDATE_COUNT; c++)
+        if (tuning.nsPerRay[c] < tuning.nsPerRay[tuning.best]) tuning.best = (BLASCandidate)c;
+
+    // keep the winner, so the scene need not build it again
+    switch (tuning.best)
+    {
+    case BLAS_CANDIDATE_BVH_SAH: tuning.bvh = bvh, bvh = 0; break;
+    case BLAS_CANDIDATE_BVH_LBVH: tuning.bvh = bvhLBVH, bvhLBVH = 0; break;
+    case BLAS_CANDIDATE_BVH4: tuning.bvh4 = bvh4, bvh4 = 0; break;
+    case BLAS_CANDIDATE_GRID: tuning.grid = grid, grid = 0; break;
+    default: tuning.kdtree = kdtree, kdtree = 0; break;
+    }
+    delete bvh, delete bvhLBVH, delete bvh4, delete grid, delete kdtree;
+    WriteCachedTuning(tuning, fileSize, fileTime);
+    return tuning;
+}
\ No newline at end of file
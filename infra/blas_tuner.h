@@ -0,0 +1,36 @@
+#pragma once
+
+#include "tlas_bvh.h"
+
+#define BLAS_TUNER_RAYS 4096 // sample rays traced through each candidate structure
+#define BLAS_TUNER_RUNS 3 // the sample is traced this often per candidate, the fastest run counts
+#define BLAS_TUNER_CACHE "blas_tuner_cache.txt" // the decisions per model, in the working directory
+
+// The tuner picks the structure of a mesh by what it costs to trace: it builds every candidate, traces
+// the same sample rays through each and keeps the fastest. The rays start on a sphere around the bounds
+// of the mesh and aim at points inside them, as rays from the rest of the scene would reach it. Since
+// this takes a build of every candidate, the decision is stored in BLAS_TUNER_CACHE together with the
+// size of the model file, and read from there as long as the file keeps that size.
+
+namespace Tmpl8
+{
+	enum BLASCandidate { BLAS_CANDIDATE_BVH_SAH, BLAS_CANDIDATE_BVH_LBVH, BLAS_CANDIDATE_BVH4, BLAS_CANDIDATE_GRID, BLAS_CANDIDATE_KDTREE, BLAS_CANDIDATE_COUNT };
+
+	struct BLASTuning
+	{
+		std::string modelLocation;
+		BLASCandidate best = BLAS_CANDIDATE_BVH_SAH;
+		float nsPerRay[BLAS_CANDIDATE_COUNT] = {}; // the measured cost of each candidate
+		bool cached = false; // read from BLAS_TUNER_CACHE instead of measured
+		// the winner, when it was measured rather than read from the cache; the others are deleted
+		BLASBVH* bvh = 0;
+		BLASBVH4* bvh4 = 0;
+		BLASGrid* grid = 0;
+		BLASKDTree* kdtree = 0;
+	};
+
+	extern const char* blasCandidateNames[BLAS_CANDIDATE_COUNT];
+	BLASType GetCandidateType(const BLASCandidate candidate);
+	// builds the candidates with settings, except for the BVH builder, which is part of the candidate
+	BLASTuning TuneBLAS(const std::string& modelLocation, const BVHBuildSettings& settings);
+}
\ No newline at end of file
@@ -1,30 +1,52 @@
 #include "precomp.h"
 #include "bvh.h"
+#include "bvh_builder.h"
 
 void BVH::Build()
 {
+#ifdef BVH_BUILD_COMPARE
+    auto serialStartTime = std::chrono::high_resolution_clock::now();
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, false);
+    auto serialEndTime = std::chrono::high_resolution_clock::now();
+    serialBuildTime = std::chrono::duration_cast<std::chrono::microseconds>(serialEndTime - serialStartTime);
+    std::vector<BVHNode> serialNodes(bvhNodes.begin(), bvhNodes.begin() + nodesUsed);
+    std::vector<uint> serialIndices = triangleIndices;
+#endif
     auto startTime = std::chrono::high_resolution_clock::now();
-    triangleIndices.resize(triangles.size());
-    // populate triangle index array
-    for (int i = 0; i < triangles.size(); i++)
-    {
-        // setup indices
-        triangleIndices[i] = i;
-    }
-    // assign all triangles to root node
-    bvhNodes.resize(triangles.size() * 2 - 1);
-    BVHNode& root = bvhNodes[rootNodeIdx];
-    root.leftFirst = 0;
-    root.triCount = triangles.size();
-    UpdateNodeBounds(rootNodeIdx);
-    // subdivide recursively
-    Subdivide(rootNodeIdx, 0);
+#ifdef BVH_PARALLEL_BUILD
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, true);
+#else
+    BuildBVHNodes(triangles, bvhNodes, triangleIndices, nodesUsed, maxDepth, false);
+#endif
     auto endTime = std::chrono::high_resolution_clock::now();
     buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+#ifdef BVH_BUILD_COMPARE
+    // the parallel builder must produce exactly the same tree
+    assert(serialNodes.size() == nodesUsed);
+    assert(memcmp(serialNodes.data(), bvhNodes.data(), nodesUsed * sizeof(BVHNode)) == 0);
+    assert(serialIndices == triangleIndices);
+#endif
+    // the builder reserves 2N-1 nodes, keep only the ones in use
+    bvhNodes.resize(nodesUsed);
+    bvhNodes.shrink_to_fit();
+#ifdef BVH_REORDER
+    ReorderTriangles();
+#endif
+    BuildTriAccel(triangles, triAccel);
+}
+
+void BVH::ReorderTriangles()
+{
+    // store the triangles in leaf order, so the leaves index them directly
+    std::vector<Tri> ordered(triangleIndices.size());
+    for (uint i = 0; i < triangleIndices.size(); i++) ordered[i] = triangles[triangleIndices[i]];
+    triangles.swap(ordered);
+    std::vector<uint>().swap(triangleIndices);
 }
 
 void BVH::Refit()
 {
+    BuildTriAccel(triangles, triAccel);
     for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
     {
         BVHNode& node = bvhNodes[i];
@@ -44,137 +66,12 @@ void BVH::Refit()
 
 void BVH::UpdateNodeBounds(uint nodeIdx)
 {
-    BVHNode& node = bvhNodes[nodeIdx];
-    node.aabbMin = float3(1e30f);
-    node.aabbMax = float3(-1e30f);
-    for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
-    {
-        uint leafTriIdx = triangleIndices[first + i];
-        Tri& leafTri = triangles[leafTriIdx];
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex0);
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex1);
-        node.aabbMin = fminf(node.aabbMin, leafTri.vertex2);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex0);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex1);
-        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex2);
-    }
-}
-
-void BVH::Subdivide(uint nodeIdx, uint depth)
-{
-    // terminate recursion
-    BVHNode& node = bvhNodes[nodeIdx];
-    if (node.triCount <= 2) return;
-
-#ifdef BVH_SAH
-    // determine split axis using SAH
-    int axis;
-    float splitPos;
-    float splitCost = FindBestSplitPlane(node, axis, splitPos);
-
-    float nosplitCost = CalculateNodeCost(node);
-    if (splitCost >= nosplitCost) return;
-#else
-    // split plane axis and position
-    float3 extent = node.aabbMax - node.aabbMin;
-    int axis = 0;
-    if (extent.y > extent.x) axis = 1;
-    if (extent.z > extent[axis]) axis = 2;
-    float splitPos = node.aabbMin[axis] + extent[axis] * 0.5f;
-#endif
-    // split the group in two halves
-    int i = node.leftFirst;
-    int j = i + node.triCount - 1;
-    while (i <= j)
-    {
-        if (triangles[triangleIndices[i]].centroid[axis] < splitPos)
-            i++;
-        else
-            swap(triangleIndices[i], triangleIndices[j--]);
-    }
-
-    // creating child nodes for each half
-    int leftCount = i - node.leftFirst;
-    if (leftCount == 0 || leftCount == node.triCount) return;
-    // create child nodes
-    int leftChildIdx = nodesUsed++;
-    int rightChildIdx = nodesUsed++;
-
-    bvhNodes[leftChildIdx].leftFirst = node.leftFirst;
-    bvhNodes[leftChildIdx].triCount = leftCount;
-    bvhNodes[rightChildIdx].leftFirst = i;
-    bvhNodes[rightChildIdx].triCount = node.triCount - leftCount;
-    node.leftFirst = leftChildIdx;
-    node.triCount = 0;
-    UpdateNodeBounds(leftChildIdx);
-    UpdateNodeBounds(rightChildIdx);
-    if (depth > maxDepth) maxDepth = depth;
-    // recurse
-    Subdivide(leftChildIdx, depth + 1);
-    Subdivide(rightChildIdx, depth + 1);
-}
-
-float BVH::CalculateNodeCost(BVHNode& node)
-{
-    float3 e = node.aabbMax - node.aabbMin; // extent of the node
-    float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-    return node.triCount * surfaceArea;
+    UpdateNodeBounds(bvhNodes[nodeIdx]);
 }
 
-float BVH::FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
+void BVH::UpdateNodeBounds(BVHNode& node)
 {
-    float bestCost = 1e30f;
-    for (int a = 0; a < 3; a++)
-    {
-        float boundsMin = 1e30f, boundsMax = -1e30f;
-        for (int i = 0; i < node.triCount; i++)
-        {
-            Tri& triangle = triangles[triangleIndices[node.leftFirst + i]];
-            boundsMin = min(boundsMin, triangle.centroid[a]);
-            boundsMax = max(boundsMax, triangle.centroid[a]);
-        }
-        if (boundsMin == boundsMax) continue;
-        // populate the bins
-        Bin bin[BVH_BINS];
-        float scale = BVH_BINS / (boundsMax - boundsMin);
-        for (uint i = 0; i < node.triCount; i++)
-        {
-            Tri& triangle = triangles[triangleIndices[node.leftFirst + i]];
-            int binIdx = min(BVH_BINS - 1,
-                (int)((triangle.centroid[a] - boundsMin) * scale));
-            bin[binIdx].triCount++;
-            bin[binIdx].bounds.Grow(triangle.vertex0);
-            bin[binIdx].bounds.Grow(triangle.vertex1);
-            bin[binIdx].bounds.Grow(triangle.vertex2);
-        }
-        // gather data for the 7 planes between the 8 bins
-        float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
-        int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
-        aabb leftBox, rightBox;
-        int leftSum = 0, rightSum = 0;
-        for (int i = 0; i < BVH_BINS - 1; i++)
-        {
-            leftSum += bin[i].triCount;
-            leftCount[i] = leftSum;
-            leftBox.Grow(bin[i].bounds);
-            leftArea[i] = leftBox.Area();
-            rightSum += bin[BVH_BINS - 1 - i].triCount;
-            rightCount[BVH_BINS - 2 - i] = rightSum;
-            rightBox.Grow(bin[BVH_BINS - 1 - i].bounds);
-            rightArea[BVH_BINS - 2 - i] = rightBox.Area();
-        }
-        // calculate SAH cost for the 7 planes
-        scale = (boundsMax - boundsMin) / BVH_BINS;
-        for (int i = 0; i < BVH_BINS - 1; i++)
-        {
-            float planeCost =
-                leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
-            if (planeCost < bestCost)
-                axis = a, splitPos = boundsMin + scale * (i + 1),
-                bestCost = planeCost;
-        }
-    }
-    return bestCost;
+    FitBVHNode(node, triangles, triangleIndices.empty() ? 0 : triangleIndices.data());
 }
 
 #ifdef BVH_FASTER_RAY
@@ -200,21 +97,19 @@ bool BVH::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 #endif
-void BVH::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+void BVH::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = tri.objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
@@ -233,9 +128,13 @@ void BVH::IntersectBVH(Ray& ray, const uint nodeIdx)
         {
             for (uint i = 0; i < node->triCount; i++)
             {
+#ifdef BVH_REORDER
+                uint triIdx = node->leftFirst + i;
+#else
                 uint triIdx = triangleIndices[node->leftFirst + i];
+#endif
                 ray.tested++;
-                IntersectTri(ray, triangles[triIdx], triIdx);
+                IntersectTri(ray, triAccel[triIdx], triIdx);
             }
             if (stackPtr == 0) break; else node = stack[--stackPtr];
 
@@ -264,9 +163,13 @@ void BVH::IntersectBVH(Ray& ray, const uint nodeIdx)
     {
         for (uint i = 0; i < node.triCount; i++)
         {
+#ifdef BVH_REORDER
+            uint triIdx = node.leftFirst + i;
+#else
             uint triIdx = triangleIndices[node.leftFirst + i];
+#endif
             ray.tested++;
-            IntersectTri(ray, triangles[triIdx], triIdx);
+            IntersectTri(ray, triAccel[triIdx], triIdx);
         }
     }
     else
@@ -277,6 +180,101 @@ void BVH::IntersectBVH(Ray& ray, const uint nodeIdx)
 #endif
 }
 
+// any hit below ray.t will do, so the first triangle that is hit ends the search
+bool BVH::OccludedLeaf(Ray& ray, const uint first, const uint count)
+{
+    const float tmax = ray.t;
+    for (uint i = 0; i < count; i++)
+    {
+#ifdef BVH_REORDER
+        uint triIdx = first + i;
+#else
+        uint triIdx = triangleIndices[first + i];
+#endif
+        IntersectTri(ray, triAccel[triIdx], triIdx);
+        if (ray.t < tmax) return true;
+    }
+    return false;
+}
+
+// the same walk as IntersectBVH, without ordering the children by distance
+bool BVH::OccludedBVH(Ray& ray)
+{
+    BVHNode* node = &bvhNodes[rootNodeIdx], * stack[64];
+    uint stackPtr = 0;
+    while (1)
+    {
+        if (node->isLeaf())
+        {
+            if (OccludedLeaf(ray, node->leftFirst, node->triCount)) return true;
+            if (stackPtr == 0) return false; else node = stack[--stackPtr];
+            continue;
+        }
+        BVHNode* child1 = &bvhNodes[node->leftFirst];
+        BVHNode* child2 = &bvhNodes[node->leftFirst + 1];
+#ifdef BVH_FASTER_RAY
+        const bool hit1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax) != 1e30f;
+        const bool hit2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax) != 1e30f;
+#else
+        const bool hit1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+        const bool hit2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+#endif
+        if (hit1)
+        {
+            node = child1;
+            if (hit2) stack[stackPtr++] = child2;
+        }
+        else if (hit2) node = child2;
+        else if (stackPtr == 0) return false;
+        else node = stack[--stackPtr];
+    }
+}
+
+// Ranged packet traversal: a node is visited with the first ray of the packet that hits it, the
+// leaves test every ray from there on and the children are ordered by the distance of that ray.
+void BVH::IntersectBVHPacket(RayPacket& packet, uint first)
+{
+    RayPacketStackEntry stack[64];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
+    {
+        packet.traversed++;
+        const BVHNode& node = bvhNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            for (uint i = 0; i < node.triCount; i++)
+            {
+#ifdef BVH_REORDER
+                uint triIdx = node.leftFirst + i;
+#else
+                uint triIdx = triangleIndices[node.leftFirst + i];
+#endif
+                IntersectPacketTri(packet, triAccel[triIdx], first, triAccel[triIdx].objIdx, triIdx);
+            }
+            packet.tested += node.triCount;
+            if (stackPtr == 0) break;
+            stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+            continue;
+        }
+        uint child1 = node.leftFirst, child2 = node.leftFirst + 1;
+        float dist1 = 1e30f, dist2 = 1e30f;
+        uint first1 = IntersectPacketAABB(packet, first, bvhNodes[child1].aabbMin, bvhNodes[child1].aabbMax, dist1);
+        uint first2 = IntersectPacketAABB(packet, first, bvhNodes[child2].aabbMin, bvhNodes[child2].aabbMax, dist2);
+        if (first1 == RAY_PACKET_SIZE && first2 == RAY_PACKET_SIZE)
+        {
+            if (stackPtr == 0) break;
+            stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+            continue;
+        }
+        if (first1 == RAY_PACKET_SIZE || (first2 != RAY_PACKET_SIZE && dist2 < dist1))
+        {
+            swap(child1, child2), swap(first1, first2);
+        }
+        if (first2 != RAY_PACKET_SIZE) stack[stackPtr].node = child2, stack[stackPtr++].first = first2;
+        nodeIdx = child1, first = first1;
+    }
+}
+
 int BVH::GetTriangleCount() const
 {
     return triangles.size();
@@ -287,6 +285,17 @@ void BVH::Intersect(Ray& ray)
     IntersectBVH(ray, rootNodeIdx);
 }
 
+bool BVH::IsOccluded(const Ray& ray)
+{
+    Ray shadow = Ray(ray);
+    return OccludedBVH(shadow);
+}
+
+void BVH::IntersectPacket(RayPacket& packet)
+{
+    IntersectBVHPacket(packet, 0);
+}
+
 float3 BVH::GetNormal(const uint triIdx, const float2 barycentric) const
 {
     float3 n0 = triangles[triIdx].normal0;
@@ -2,9 +2,10 @@
 
 #include "blas_bvh.h"
 
-#define BVH_SAH
 #define BVH_FASTER_RAY
-#define BVH_BINS 8
+#define BVH_PARALLEL_BUILD
+//#define BVH_BUILD_COMPARE // also runs the serial builder to report the speedup
+#define BVH_REORDER // stores the triangles in leaf order and drops triangleIndices after the build
 
 // reference: https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
 
@@ -12,23 +13,27 @@ namespace Tmpl8
 {
 	class BVH
 	{
-	private:
+	protected:
 		void UpdateNodeBounds(uint nodeIdx);
-		void Subdivide(uint nodeIdx, uint depth);
+		void UpdateNodeBounds(BVHNode& node);
 #ifdef BVH_FASTER_RAY
 		float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
 #else
 		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
 #endif
-		void IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
+		void IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
 		void IntersectBVH(Ray& ray, const uint nodeIdx);
-		float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos);
-		float CalculateNodeCost(BVHNode& node);
+		bool OccludedLeaf(Ray& ray, const uint first, const uint count);
+		bool OccludedBVH(Ray& ray);
+		void IntersectBVHPacket(RayPacket& packet, uint first);
+		void ReorderTriangles();
 	public:
 		BVH() = default;
 		void Build();
 		void Refit();
 		void Intersect(Ray& ray);
+		bool IsOccluded(const Ray& ray);
+		void IntersectPacket(RayPacket& packet);
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
@@ -37,9 +42,11 @@ namespace Tmpl8
 		int objIdx = -1;
 		std::vector<BVHNode> bvhNodes;
 		std::vector<Tri> triangles;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
 		std::vector<uint> triangleIndices;
 		uint rootNodeIdx = 0, nodesUsed = 1;
 		std::chrono::microseconds buildTime;
+		std::chrono::microseconds serialBuildTime{ 0 };
 		uint maxDepth = 0;
 	};
 }
\ No newline at end of file
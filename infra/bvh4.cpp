@@ -0,0 +1,145 @@
+#include "precomp.h"
+#include "bvh4.h"
+
+void BVH4::Build()
+{
+    BVH::Build();
+    Collapse();
+}
+
+void BVH4::Refit()
+{
+    BVH::Refit();
+    Collapse();
+}
+
+void BVH4::Collapse()
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    bvh4Nodes.clear();
+    bvh4Nodes.reserve(nodesUsed / 2 + 1);
+    CollapseBVH4(bvhNodes.data(), rootNodeIdx, bvh4Nodes);
+    auto endTime = std::chrono::high_resolution_clock::now();
+    buildTime += std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+void BVH4::IntersectBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    const BVH4Node* node = &bvh4Nodes[0];
+    while (node)
+    {
+        ray.traversed++;
+        __m128 dist4;
+        const int mask = IntersectBVH4Children(*node, ray4, ray.t, dist4);
+        PushBVH4Children(*node, mask, dist4, stack, stackPtr);
+        node = 0;
+        while (stackPtr > 0)
+        {
+            const BVH4StackEntry entry = stack[--stackPtr];
+            // a closer hit may have been found since this child was pushed
+            if (entry.dist >= ray.t) continue;
+            if (entry.triCount == 0)
+            {
+                node = &bvh4Nodes[entry.child];
+                break;
+            }
+            ray.traversed++;
+            for (uint i = 0; i < entry.triCount; i++)
+            {
+#ifdef BVH_REORDER
+                uint triIdx = entry.child + i;
+#else
+                uint triIdx = triangleIndices[entry.child + i];
+#endif
+                ray.tested++;
+                IntersectTri(ray, triAccel[triIdx], triIdx);
+            }
+        }
+    }
+}
+
+bool BVH4::OccludedBVH4(Ray& ray)
+{
+    const BVH4Ray ray4(ray);
+    BVH4StackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    stack[stackPtr++] = { 0, 0, 0 };
+    while (stackPtr > 0)
+    {
+        const BVH4StackEntry entry = stack[--stackPtr];
+        if (entry.triCount > 0)
+        {
+            if (OccludedLeaf(ray, entry.child, entry.triCount)) return true;
+            continue;
+        }
+        __m128 dist4;
+        const int mask = IntersectBVH4Children(bvh4Nodes[entry.child], ray4, ray.t, dist4);
+        PushBVH4ChildrenUnordered(bvh4Nodes[entry.child], mask, stack, stackPtr);
+    }
+    return false;
+}
+
+// Ranged packet traversal, as BVH::IntersectBVHPacket does it for the binary nodes: every child is
+// tested from the first ray that hit its parent on, entered with the first ray that hits it, and the
+// hit children are visited nearest first by the distance of that ray.
+void BVH4::IntersectBVH4Packet(RayPacket& packet)
+{
+    BVH4PacketStackEntry stack[BVH4_STACK_SIZE];
+    uint stackPtr = 0;
+    stack[stackPtr++] = { 0, 0, 0 };
+    while (stackPtr > 0)
+    {
+        const BVH4PacketStackEntry entry = stack[--stackPtr];
+        packet.traversed++;
+        if (entry.triCount > 0)
+        {
+            for (uint i = 0; i < entry.triCount; i++)
+            {
+#ifdef BVH_REORDER
+                uint triIdx = entry.child + i;
+#else
+                uint triIdx = triangleIndices[entry.child + i];
+#endif
+                IntersectPacketTri(packet, triAccel[triIdx], entry.first, triAccel[triIdx].objIdx, triIdx);
+            }
+            packet.tested += entry.triCount;
+            continue;
+        }
+        const BVH4Node& node = bvh4Nodes[entry.child];
+        BVH4PacketStackEntry hits[4];
+        float hitDist[4];
+        int hitCount = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (node.child[i] == BVH4_EMPTY) continue;
+            float dist = 1e30f;
+            const uint first = IntersectPacketAABB(packet, entry.first, float3(node.bminx[i], node.bminy[i], node.bminz[i]),
+                float3(node.bmaxx[i], node.bmaxy[i], node.bmaxz[i]), dist);
+            if (first == RAY_PACKET_SIZE) continue;
+            // insertion sort, descending distance, so the nearest child is popped next
+            int j = hitCount++;
+            while (j > 0 && hitDist[j - 1] < dist) hits[j] = hits[j - 1], hitDist[j] = hitDist[j - 1], j--;
+            hits[j] = { node.child[i], node.triCount[i], first }, hitDist[j] = dist;
+        }
+        for (int i = 0; i < hitCount; i++) stack[stackPtr++] = hits[i];
+    }
+}
+
+void BVH4::Intersect(Ray& ray)
+{
+    IntersectBVH4(ray);
+}
+
+bool BVH4::IsOccluded(const Ray& ray)
+{
+    Ray shadow = Ray(ray);
+    return OccludedBVH4(shadow);
+}
+
+void BVH4::IntersectPacket(RayPacket& packet)
+{
+    IntersectBVH4Packet(packet);
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "bvh.h"
+#include "blas_bvh4.h"
+
+namespace Tmpl8
+{
+	struct BVH4PacketStackEntry { uint child, triCount, first; };
+
+	class BVH4 : public BVH
+	{
+	private:
+		void Collapse();
+		void IntersectBVH4(Ray& ray);
+		bool OccludedBVH4(Ray& ray);
+		void IntersectBVH4Packet(RayPacket& packet);
+	public:
+		BVH4() = default;
+		void Build();
+		void Refit();
+		void Intersect(Ray& ray);
+		bool IsOccluded(const Ray& ray);
+		void IntersectPacket(RayPacket& packet);
+	public:
+		std::vector<BVH4Node> bvh4Nodes;
+	};
+}
\ No newline at end of file
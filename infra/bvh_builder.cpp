@@ -0,0 +1,363 @@
+#include "precomp.h"
+#include "bvh_builder.h"
+
+struct BVHBuildContext
+{
+    const std::vector<Tri>* triangles;
+    uint* triIndices;
+    // frontier of the top levels of a parallel build, handed to workers as subtree jobs
+    std::vector<BVHSubtree> subtrees;
+    std::vector<int> topSubtree;
+    uint maxDepth = 0;
+};
+
+static void BinTriangles(const BVHBuildContext& context, const uint first, const uint count, const int a, const float boundsMin, const float scale, Bin* bin)
+{
+    for (uint i = 0; i < count; i++)
+    {
+        const Tri& triangle = (*context.triangles)[context.triIndices[first + i]];
+        float3 centroid = triangle.centroid;
+        int binIdx = min(BVH_BINS - 1,
+            (int)((centroid[a] - boundsMin) * scale));
+        bin[binIdx].triCount++;
+        bin[binIdx].bounds.Grow(triangle.vertex0);
+        bin[binIdx].bounds.Grow(triangle.vertex1);
+        bin[binIdx].bounds.Grow(triangle.vertex2);
+    }
+}
+
+// jobs for the binning of the top levels, see FindBestSplitPlaneParallel
+static struct BVHBinJob : public Job
+{
+    void Main()
+    {
+        if (pass == 0) GrowCentroidBounds(*context->triangles, context->triIndices, first, count, cmin, cmax);
+        else for (int a = 0; a < 3; a++) if (scale[a] > 0) BinTriangles(*context, first, count, a, boundsMin[a], scale[a], bin[a]);
+    }
+    Job* Init(const BVHBuildContext* c, int p, uint f, uint cnt)
+    {
+        context = c, pass = p, first = f, count = cnt;
+        cmin = float3(1e30f), cmax = float3(-1e30f);
+        for (int a = 0; a < 3; a++) for (int i = 0; i < BVH_BINS; i++) bin[a][i] = Bin();
+        return this;
+    }
+    const BVHBuildContext* context;
+    int pass;
+    uint first, count;
+    float3 cmin, cmax, boundsMin, scale;
+    Bin bin[3][BVH_BINS];
+} bvhBinJob[64];
+
+static void Subdivide(BVHBuildContext& context, BVHNode* nodes, uint& used, uint nodeIdx, uint depth, uint& deepest);
+
+struct BVHSubtreeJob : public Job
+{
+    void Main()
+    {
+        subtree->nodes.resize(subtree->nodes[0].triCount * 2 - 1);
+        Subdivide(*context, subtree->nodes.data(), subtree->used, 0, subtree->depth, subtree->deepest);
+    }
+    BVHBuildContext* context;
+    BVHSubtree* subtree;
+};
+
+void Tmpl8::FitBVHNode(BVHNode& node, const std::vector<Tri>& triangles, const uint* triIndices)
+{
+    node.aabbMin = float3(1e30f);
+    node.aabbMax = float3(-1e30f);
+    for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+    {
+        // after reordering, the triangles are stored in leaf order
+        uint leafTriIdx = triIndices ? triIndices[first + i] : first + i;
+        const Tri& leafTri = triangles[leafTriIdx];
+        node.aabbMin = fminf(node.aabbMin, leafTri.vertex0);
+        node.aabbMin = fminf(node.aabbMin, leafTri.vertex1);
+        node.aabbMin = fminf(node.aabbMin, leafTri.vertex2);
+        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex0);
+        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex1);
+        node.aabbMax = fmaxf(node.aabbMax, leafTri.vertex2);
+    }
+}
+
+void Tmpl8::GrowCentroidBounds(const std::vector<Tri>& triangles, const uint* triIndices, const uint first, const uint count, float3& cmin, float3& cmax)
+{
+    for (uint i = 0; i < count; i++)
+    {
+        const float3& centroid = triangles[triIndices[first + i]].centroid;
+        cmin = fminf(cmin, centroid);
+        cmax = fmaxf(cmax, centroid);
+    }
+}
+
+float Tmpl8::EvaluateBins(const Bin* bin, const int a, const float boundsMin, const float boundsMax, float bestCost, int& axis, float& splitPos)
+{
+    // gather data for the 7 planes between the 8 bins
+    float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+    int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+    aabb leftBox, rightBox;
+    int leftSum = 0, rightSum = 0;
+    for (int i = 0; i < BVH_BINS - 1; i++)
+    {
+        leftSum += bin[i].triCount;
+        leftCount[i] = leftSum;
+        leftBox.Grow(bin[i].bounds);
+        leftArea[i] = leftBox.Area();
+        rightSum += bin[BVH_BINS - 1 - i].triCount;
+        rightCount[BVH_BINS - 2 - i] = rightSum;
+        rightBox.Grow(bin[BVH_BINS - 1 - i].bounds);
+        rightArea[BVH_BINS - 2 - i] = rightBox.Area();
+    }
+    // calculate SAH cost for the 7 planes
+    float scale = (boundsMax - boundsMin) / BVH_BINS;
+    for (int i = 0; i < BVH_BINS - 1; i++)
+    {
+        float planeCost =
+            leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+        if (planeCost < bestCost)
+            axis = a, splitPos = boundsMin + scale * (i + 1),
+            bestCost = planeCost;
+    }
+    return bestCost;
+}
+
+static float FindBestSplitPlane(const BVHBuildContext& context, const BVHNode& node, int& axis, float& splitPos)
+{
+    float bestCost = 1e30f;
+    float3 centroidMin(1e30f), centroidMax(-1e30f);
+    GrowCentroidBounds(*context.triangles, context.triIndices, node.leftFirst, node.triCount, centroidMin, centroidMax);
+    for (int a = 0; a < 3; a++)
+    {
+        float boundsMin = centroidMin[a], boundsMax = centroidMax[a];
+        if (boundsMin == boundsMax) continue;
+        // populate the bins
+        Bin bin[BVH_BINS];
+        BinTriangles(context, node.leftFirst, node.triCount, a, boundsMin, BVH_BINS / (boundsMax - boundsMin), bin);
+        bestCost = EvaluateBins(bin, a, boundsMin, boundsMax, bestCost, axis, splitPos);
+    }
+    return bestCost;
+}
+
+static float FindBestSplitPlaneParallel(const BVHBuildContext& context, const BVHNode& node, int& axis, float& splitPos)
+{
+    JobManager* jm = JobManager::GetJobManager();
+    uint jobCount = min(64u, jm->GetNumThreads() * 2);
+    uint chunk = (node.triCount + jobCount - 1) / jobCount;
+    jobCount = (node.triCount + chunk - 1) / chunk;
+    // first pass: centroid bounds
+    for (uint i = 0; i < jobCount; i++)
+        jm->AddJob2(bvhBinJob[i].Init(&context, 0, node.leftFirst + i * chunk, min(chunk, node.triCount - i * chunk)));
+    jm->RunJobs();
+    float3 centroidMin(1e30f), centroidMax(-1e30f);
+    for (uint i = 0; i < jobCount; i++)
+    {
+        centroidMin = fminf(centroidMin, bvhBinJob[i].cmin);
+        centroidMax = fmaxf(centroidMax, bvhBinJob[i].cmax);
+    }
+    // second pass: populate per-job bins for all three axes
+    float3 scale(0);
+    for (int a = 0; a < 3; a++)
+        if (centroidMin[a] != centroidMax[a]) scale[a] = BVH_BINS / (centroidMax[a] - centroidMin[a]);
+    for (uint i = 0; i < jobCount; i++)
+    {
+        bvhBinJob[i].Init(&context, 1, node.leftFirst + i * chunk, min(chunk, node.triCount - i * chunk));
+        bvhBinJob[i].boundsMin = centroidMin, bvhBinJob[i].scale = scale;
+        jm->AddJob2(&bvhBinJob[i]);
+    }
+    jm->RunJobs();
+    // merge the bins; counts and bounds are exact, so the result equals the serial binning
+    float bestCost = 1e30f;
+    for (int a = 0; a < 3; a++)
+    {
+        if (scale[a] == 0) continue;
+        Bin bin[BVH_BINS];
+        for (uint i = 0; i < jobCount; i++) for (int b = 0; b < BVH_BINS; b++)
+        {
+            bin[b].triCount += bvhBinJob[i].bin[a][b].triCount;
+            bin[b].bounds.Grow(bvhBinJob[i].bin[a][b].bounds);
+        }
+        bestCost = EvaluateBins(bin, a, centroidMin[a], centroidMax[a], bestCost, axis, splitPos);
+    }
+    return bestCost;
+}
+
+static float CalculateNodeCost(const BVHNode& node)
+{
+    float3 e = node.aabbMax - node.aabbMin; // extent of the node
+    float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
+    return node.triCount * surfaceArea;
+}
+
+static bool PartitionNode(const BVHBuildContext& context, BVHNode& node, uint& leftCount, bool parallel)
+{
+    // terminate recursion
+    if (node.triCount <= 2) return false;
+
+#ifdef BVH_SAH
+    // determine split axis using SAH
+    int axis;
+    float splitPos;
+    float splitCost = parallel ? FindBestSplitPlaneParallel(context, node, axis, splitPos) : FindBestSplitPlane(context, node, axis, splitPos);
+
+    float nosplitCost = CalculateNodeCost(node);
+    if (splitCost >= nosplitCost) return false;
+#else
+    // split plane axis and position
+    float3 extent = node.aabbMax - node.aabbMin;
+    int axis = 0;
+    if (extent.y > extent.x) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    float splitPos = node.aabbMin[axis] + extent[axis] * 0.5f;
+#endif
+    // split the group in two halves
+    const std::vector<Tri>& triangles = *context.triangles;
+    uint* triIndices = context.triIndices;
+    int i = node.leftFirst;
+    int j = i + node.triCount - 1;
+    while (i <= j)
+    {
+        float3 centroid = triangles[triIndices[i]].centroid;
+        if (centroid[axis] < splitPos)
+            i++;
+        else
+            swap(triIndices[i], triIndices[j--]);
+    }
+    leftCount = i - node.leftFirst;
+    return leftCount > 0 && leftCount < node.triCount;
+}
+
+static void Subdivide(BVHBuildContext& context, BVHNode* nodes, uint& used, uint nodeIdx, uint depth, uint& deepest)
+{
+    BVHNode& node = nodes[nodeIdx];
+    uint leftCount;
+    if (!PartitionNode(context, node, leftCount, false)) return;
+    // create child nodes
+    int leftChildIdx = used++;
+    int rightChildIdx = used++;
+
+    nodes[leftChildIdx].leftFirst = node.leftFirst;
+    nodes[leftChildIdx].triCount = leftCount;
+    nodes[rightChildIdx].leftFirst = node.leftFirst + leftCount;
+    nodes[rightChildIdx].triCount = node.triCount - leftCount;
+    node.leftFirst = leftChildIdx;
+    node.triCount = 0;
+    FitBVHNode(nodes[leftChildIdx], *context.triangles, context.triIndices);
+    FitBVHNode(nodes[rightChildIdx], *context.triangles, context.triIndices);
+    if (depth > deepest) deepest = depth;
+    // recurse
+    Subdivide(context, nodes, used, leftChildIdx, depth + 1, deepest);
+    Subdivide(context, nodes, used, rightChildIdx, depth + 1, deepest);
+}
+
+static void SubdivideTop(BVHBuildContext& context, std::vector<BVHNode>& nodes, uint& used, uint nodeIdx, uint depth, uint taskSize)
+{
+    if (nodes[nodeIdx].triCount <= taskSize)
+    {
+        BVHSubtree subtree;
+        subtree.depth = depth;
+        subtree.nodes.push_back(nodes[nodeIdx]);
+        context.topSubtree[nodeIdx] = context.subtrees.size();
+        context.subtrees.push_back(std::move(subtree));
+        return;
+    }
+    uint leftCount;
+    if (!PartitionNode(context, nodes[nodeIdx], leftCount, true)) return;
+    if (used + 2 > nodes.size())
+    {
+        nodes.resize(nodes.size() * 2);
+        context.topSubtree.resize(nodes.size(), -1);
+    }
+    // create child nodes
+    BVHNode& node = nodes[nodeIdx];
+    int leftChildIdx = used++;
+    int rightChildIdx = used++;
+    nodes[leftChildIdx].leftFirst = node.leftFirst;
+    nodes[leftChildIdx].triCount = leftCount;
+    nodes[rightChildIdx].leftFirst = node.leftFirst + leftCount;
+    nodes[rightChildIdx].triCount = node.triCount - leftCount;
+    node.leftFirst = leftChildIdx;
+    node.triCount = 0;
+    FitBVHNode(nodes[leftChildIdx], *context.triangles, context.triIndices);
+    FitBVHNode(nodes[rightChildIdx], *context.triangles, context.triIndices);
+    if (depth > context.maxDepth) context.maxDepth = depth;
+    // recurse
+    SubdivideTop(context, nodes, used, leftChildIdx, depth + 1, taskSize);
+    SubdivideTop(context, nodes, used, rightChildIdx, depth + 1, taskSize);
+}
+
+// topSubtree is null below the top levels
+static void EmitNodes(const std::vector<BVHNode>& src, const std::vector<BVHSubtree>& subtrees, const int* topSubtree, uint srcIdx, uint dstIdx, std::vector<BVHNode>& nodes, uint& nodesUsed)
+{
+    if (topSubtree && topSubtree[srcIdx] >= 0)
+    {
+        EmitNodes(subtrees[topSubtree[srcIdx]].nodes, subtrees, 0, 0, dstIdx, nodes, nodesUsed);
+        return;
+    }
+    const BVHNode& node = src[srcIdx];
+    nodes[dstIdx] = node;
+    if (node.triCount > 0) return;
+    // children are numbered before recursing, like Subdivide does
+    int leftChildIdx = nodesUsed++;
+    int rightChildIdx = nodesUsed++;
+    nodes[dstIdx].leftFirst = leftChildIdx;
+    EmitNodes(src, subtrees, topSubtree, node.leftFirst, leftChildIdx, nodes, nodesUsed);
+    EmitNodes(src, subtrees, topSubtree, node.leftFirst + 1, rightChildIdx, nodes, nodesUsed);
+}
+
+void Tmpl8::EmitBVHNodes(const std::vector<BVHNode>& top, const std::vector<BVHSubtree>& subtrees, const std::vector<int>& topSubtree, const uint srcIdx, const uint dstIdx, std::vector<BVHNode>& nodes, uint& nodesUsed)
+{
+    EmitNodes(top, subtrees, topSubtree.data(), srcIdx, dstIdx, nodes, nodesUsed);
+}
+
+void Tmpl8::BuildBVHNodes(const std::vector<Tri>& triangles, std::vector<BVHNode>& nodes, std::vector<uint>& triIndices, uint& nodesUsed, uint& maxDepth, const bool parallel)
+{
+    const uint N = triangles.size();
+    triIndices.resize(N);
+    // populate triangle index array
+    for (uint i = 0; i < N; i++) triIndices[i] = i;
+    // assign all triangles to root node
+    nodes.resize(N * 2 - 1);
+    nodesUsed = 1, maxDepth = 0;
+    BVHNode& root = nodes[0];
+    root.leftFirst = 0;
+    root.triCount = N;
+    FitBVHNode(root, triangles, triIndices.data());
+
+    BVHBuildContext context;
+    context.triangles = &triangles;
+    context.triIndices = triIndices.data();
+    // the serial build stays off the job system, so it can run on a thread of its own
+    uint taskSize = N;
+    JobManager* jm = 0;
+    if (parallel)
+    {
+        jm = JobManager::GetJobManager();
+        taskSize = max((uint)BVH_MIN_TASK_SIZE, N / (jm->GetNumThreads() * 8));
+    }
+    if (N <= taskSize)
+    {
+        // subdivide recursively
+        Subdivide(context, nodes.data(), nodesUsed, 0, 0, maxDepth);
+        return;
+    }
+    // split the top levels on this thread, with the binning spread over the workers
+    std::vector<BVHNode> topNodes(64);
+    context.topSubtree.assign(topNodes.size(), -1);
+    topNodes[0] = root;
+    uint topUsed = 1;
+    SubdivideTop(context, topNodes, topUsed, 0, 0, taskSize);
+    // hand the remaining subtrees to the workers
+    std::vector<BVHSubtreeJob> jobs(context.subtrees.size());
+    for (uint i = 0; i < context.subtrees.size(); i += 4096)
+    {
+        for (uint j = i; j < min((uint)context.subtrees.size(), i + 4096); j++)
+        {
+            jobs[j].context = &context, jobs[j].subtree = &context.subtrees[j];
+            jm->AddJob2(&jobs[j]);
+        }
+        jm->RunJobs();
+    }
+    // emit the nodes in the order of the serial builder, so both produce the same tree
+    EmitBVHNodes(topNodes, context.subtrees, context.topSubtree, 0, 0, nodes, nodesUsed);
+    maxDepth = context.maxDepth;
+    for (BVHSubtree& subtree : context.subtrees) if (subtree.deepest > maxDepth) maxDepth = subtree.deepest;
+}
\ No newline at end of file
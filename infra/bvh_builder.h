@@ -0,0 +1,29 @@
+#pragma once
+
+#include "blas_bvh.h"
+
+#define BVH_SAH // binned SAH splits, otherwise the middle of the longest axis
+#define BVH_BINS 8
+#define BVH_MIN_TASK_SIZE 8192 // smaller subtrees are built by a single worker
+
+// BVH and BLASBVH share one binned SAH builder. The parallel build splits the top levels on the calling
+// thread, with the binning of every node spread over the workers, until a node holds at most a task's
+// worth of triangles; the workers then build the subtrees below those nodes with the serial builder.
+// The nodes are emitted in the order of the serial builder, so both produce exactly the same tree.
+
+namespace Tmpl8
+{
+    // Builds the nodes of a BVH over the triangles, serially or on the job system. nodes gets room for
+    // 2N-1 nodes, of which nodesUsed are in use, and triIndices the order of the triangles in the leaves.
+    void BuildBVHNodes(const std::vector<Tri>& triangles, std::vector<BVHNode>& nodes, std::vector<uint>& triIndices, uint& nodesUsed, uint& maxDepth, const bool parallel);
+    // Copies the top levels into nodes depth first, from srcIdx to dstIdx, with the nodes of its subtree
+    // in place of a top node whose topSubtree is set. Children are numbered before recursing, like the
+    // builder does, so a parallel build gives the same node order as a serial one.
+    void EmitBVHNodes(const std::vector<BVHNode>& top, const std::vector<BVHSubtree>& subtrees, const std::vector<int>& topSubtree, const uint srcIdx, const uint dstIdx, std::vector<BVHNode>& nodes, uint& nodesUsed);
+    // Fits the node around the triangles of its leaf; triIndices is null once they are in leaf order.
+    void FitBVHNode(BVHNode& node, const std::vector<Tri>& triangles, const uint* triIndices);
+    void GrowCentroidBounds(const std::vector<Tri>& triangles, const uint* triIndices, const uint first, const uint count, float3& cmin, float3& cmax);
+    // Takes the cheapest of the planes between the bins of axis a if it beats bestCost, and returns the
+    // cost of the best plane so far.
+    float EvaluateBins(const Bin* bin, const int a, const float boundsMin, const float boundsMax, float bestCost, int& axis, float& splitPos);
+}
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "precomp.h"
 #include "grid.h"
+#include "grid_builder.h"
 
 void Grid::Build()
 {
@@ -14,45 +15,29 @@ void Grid::Build()
     float3 gridSize = localBounds.bmax3 - localBounds.bmin3;
 
     // dynamically calculate resolution
-    float cubeRoot = powf(5 * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#ifdef GRID_TWO_LEVEL
+    float cubeRoot = powf(GRID_TOP_DENSITY * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#else
+    float cubeRoot = powf(GRID_CELL_DENSITY * GetTriangleCount() / (gridSize.x * gridSize.y * gridSize.z), 1 / 3.f);
+#endif
     for (int i = 0; i < 3; i++)
     {
         resolution[i] = static_cast<int>(floor(gridSize[i] * cubeRoot));
         resolution[i] = max(1, min(resolution[i], 128));
     }
 
-    gridCells.resize(resolution.x * resolution.y * resolution.z);
-
     cellSize = float3(gridSize.x / resolution.x, gridSize.y / resolution.y, gridSize.z / resolution.z);
-
-    // Put triangles into grids
-    for (size_t triIdx = 0; triIdx < triangles.size(); triIdx++)
-    {
-        aabb bounds = triangles[triIdx].GetBounds();
-
-        // Determine grid cell range for the object
-        int minX = clamp(static_cast<int>((bounds.bmin3.x - localBounds.bmin3.x) / cellSize.x), 0, resolution.x - 1);
-        int minY = clamp(static_cast<int>((bounds.bmin3.y - localBounds.bmin3.y) / cellSize.y), 0, resolution.y - 1);
-        int minZ = clamp(static_cast<int>((bounds.bmin3.z - localBounds.bmin3.z) / cellSize.z), 0, resolution.z - 1);
-        int maxX = clamp(static_cast<int>((bounds.bmax3.x - localBounds.bmin3.x) / cellSize.x), 0, resolution.x - 1);
-        int maxY = clamp(static_cast<int>((bounds.bmax3.y - localBounds.bmin3.y) / cellSize.y), 0, resolution.y - 1);
-        int maxZ = clamp(static_cast<int>((bounds.bmax3.z - localBounds.bmin3.z) / cellSize.z), 0, resolution.z - 1);
-
-        // Assign the object to the corresponding grid cells
-        for (int iz = minZ; iz <= maxZ; ++iz) {
-            for (int iy = minY; iy <= maxY; ++iy) {
-                for (int ix = minX; ix <= maxX; ++ix) {
-                    int cellIndex = ix + iy * resolution.x + iz * resolution.x * resolution.y;
-                    gridCells[cellIndex].triIndices.push_back(triIdx);
-                }
-            }
-        }
-    }
+#ifdef GRID_TWO_LEVEL
+    BuildTwoLevelGrid(triangles, localBounds, resolution, cellSize, topCells, cellStart, triIndices);
+#else
+    BuildGridCells(triangles, localBounds, resolution, cellSize, cellStart, triIndices);
+#endif
+    BuildTriAccel(triangles, triAccel);
     auto endTime = std::chrono::high_resolution_clock::now();
     buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 }
 
-bool Grid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
+bool Grid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut)
 {
     float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
     float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
@@ -60,24 +45,23 @@ bool Grid::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
     tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
     float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
     tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+    tminOut = tmin;
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 
-bool Grid::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+bool Grid::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return false; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return false;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return false;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = tri.objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
@@ -91,10 +75,52 @@ int Grid::GetTriangleCount() const
     return triangles.size();
 }
 
+#ifdef GRID_TWO_LEVEL
+void Grid::IntersectGrid(Ray& ray, long uid)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return;
+    WalkTwoLevelGrid(ray, max(tmin, 0.0f), ray.t, localBounds.bmin3, resolution, cellSize, topCells.data(), [&](const uint index)
+    {
+        ray.traversed++;
+        for (uint i = cellStart[index]; i < cellStart[index + 1]; i++)
+        {
+            const uint triIdx = triIndices[i];
+#ifdef GRID_MAILBOXING
+            if (uid == mailbox[triIdx]) continue;
+            mailbox[triIdx] = uid;
+#endif
+            ray.tested++;
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+        }
+        return false;
+    });
+}
+
+bool Grid::OccludedGrid(Ray& ray)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return false;
+    const float tmax = ray.t;
+    bool occluded = false;
+    WalkTwoLevelGrid(ray, max(tmin, 0.0f), tmax, localBounds.bmin3, resolution, cellSize, topCells.data(), [&](const uint index)
+    {
+        for (uint i = cellStart[index]; i < cellStart[index + 1] && !occluded; i++)
+        {
+            const uint triIdx = triIndices[i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+            occluded = ray.t < tmax;
+        }
+        return occluded;
+    });
+    return occluded;
+}
+#else
 void Grid::IntersectGrid(Ray& ray, long uid)
 {
     // Calculate tmin and tmax
-    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3)) return;
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return;
 
     // Determine the cell indices that the ray traverses
     int3 exit, step, cell;
@@ -123,18 +149,19 @@ void Grid::IntersectGrid(Ray& ray, long uid)
     {
         ray.traversed++;
         uint index = cell.x + cell.y * resolution.x + cell.z * resolution.x * resolution.y;
-        for (int triIdx : gridCells[index].triIndices)
+        for (uint i = cellStart[index]; i < cellStart[index + 1]; i++)
         {
+            const uint triIdx = triIndices[i];
 #ifdef GRID_MAILBOXING
             if (uid != mailbox[triIdx])
             {
                 mailbox[triIdx] = uid;
                 ray.tested++;
-                IntersectTri(ray, triangles[triIdx], triIdx);
+                IntersectTri(ray, triAccel[triIdx], triIdx);
             }
 #else
             ray.tested++;
-            IntersectTri(ray, triangles[triIdx], triIdx);
+            IntersectTri(ray, triAccel[triIdx], triIdx);
 #endif
         }
 
@@ -152,6 +179,61 @@ void Grid::IntersectGrid(Ray& ray, long uid)
     }
 }
 
+// Any hit below ray.t occludes, wherever it lies along the ray, so the walk stops at the first
+// cell with one and needs no mailboxes.
+bool Grid::OccludedGrid(Ray& ray)
+{
+    float tmin;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin)) return false;
+
+    int3 exit, step, cell;
+    float3 deltaT, nextCrossingT;
+    for (int i = 0; i < 3; ++i)
+    {
+        float rayOrigCell = ray.O[i] - localBounds.bmin3[i];
+        cell[i] = clamp(static_cast<int>(std::floor(rayOrigCell / cellSize[i])), 0, resolution[i] - 1);
+        if (ray.D[i] < 0)
+        {
+            deltaT[i] = -cellSize[i] * ray.rD[i];
+            nextCrossingT[i] = (cell[i] * cellSize[i] - rayOrigCell) * ray.rD[i];
+            exit[i] = -1;
+            step[i] = -1;
+        }
+        else
+        {
+            deltaT[i] = cellSize[i] * ray.rD[i];
+            nextCrossingT[i] = ((cell[i] + 1) * cellSize[i] - rayOrigCell) * ray.rD[i];
+            exit[i] = resolution[i];
+            step[i] = 1;
+        }
+    }
+
+    const float tmax = ray.t;
+    while (true)
+    {
+        uint index = cell.x + cell.y * resolution.x + cell.z * resolution.x * resolution.y;
+        for (uint i = cellStart[index]; i < cellStart[index + 1]; i++)
+        {
+            const uint triIdx = triIndices[i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
+            if (ray.t < tmax) return true;
+        }
+
+        uint k =
+            ((nextCrossingT.x < nextCrossingT.y) << 2) +
+            ((nextCrossingT.x < nextCrossingT.z) << 1) +
+            ((nextCrossingT.y < nextCrossingT.z));
+        static const uint8_t map[8] = { 2, 1, 2, 1, 2, 2, 0, 0 };
+        uint8_t axis = map[k];
+
+        if (tmax < nextCrossingT[axis]) return false;
+        cell[axis] += step[axis];
+        if (cell[axis] == exit[axis]) return false;
+        nextCrossingT[axis] += deltaT[axis];
+    }
+}
+#endif
+
 void Grid::Intersect(Ray& ray)
 {
     incremental++;
@@ -160,6 +242,12 @@ void Grid::Intersect(Ray& ray)
     IntersectGrid(ray, incremental);
 }
 
+bool Grid::IsOccluded(const Ray& ray)
+{
+    Ray shadow = Ray(ray);
+    return OccludedGrid(shadow);
+}
+
 float3 Grid::GetNormal(const uint triIdx, const float2 barycentric) const
 {
     float3 n0 = triangles[triIdx].normal0;
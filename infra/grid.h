@@ -10,26 +10,31 @@ namespace Tmpl8
 	class Grid
 	{
 	private:
-		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
-		bool IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
+		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut);
+		bool IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
 		void IntersectGrid(Ray& ray, long uid);
+		bool OccludedGrid(Ray& ray);
 	public:
 		Grid() = default;
 		void Build();
 		void Intersect(Ray& ray);
+		bool IsOccluded(const Ray& ray);
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
 	private:
 		int3 resolution = 0;
 		float3 cellSize = 0;
-		std::vector<GridCell> gridCells;
+		std::vector<uint> cellStart; // cell c holds triIndices[cellStart[c]] up to triIndices[cellStart[c + 1]]
+		std::vector<uint> triIndices; // the triangles of all cells, cell after cell
+		std::vector<GridTopCell> topCells; // the top level of a two-level grid, see GRID_TWO_LEVEL
 		std::vector<long> mailbox;
 		long incremental = 0;
 	public:
 		int objIdx = -1;
 		aabb localBounds;
 		std::vector<Tri> triangles;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
 		std::chrono::microseconds buildTime;
 	};
 }
\ No newline at end of file
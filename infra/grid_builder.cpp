@@ -0,0 +1,211 @@
+#include "precomp.h"
+#include "grid_builder.h"
+#include <atomic>
+
+struct GridBuildContext
+{
+    const std::vector<Tri>* triangles;
+    aabb bounds;
+    int3 resolution;
+    float3 cellSize;
+    std::atomic<uint>* cursor; // the references per cell, then the next free entry of each cell
+    bool shared; // more than one job updates the cursors
+    uint* cellStart;
+    uint* triIndices;
+    // the second level of a two-level grid: the top cells, their cell ranges and their triangles
+    const GridTopCell* topCells;
+    const uint* topStart;
+    const uint* topIndices;
+};
+
+// Increments a cursor and returns its old value. Only jobs that share the cursors pay for the locked
+// add; a single job gets away with a plain load and store.
+static inline uint Advance(std::atomic<uint>& cursor, const bool shared)
+{
+    if (shared) return cursor.fetch_add(1, std::memory_order_relaxed);
+    const uint value = cursor.load(std::memory_order_relaxed);
+    cursor.store(value + 1, std::memory_order_relaxed);
+    return value;
+}
+
+// the cells that the bounds of the triangle overlap, clamped to the grid at origin
+static void GetCellRange(const Tri& tri, float3 origin, int3 resolution, float3 cellSize, int3& cellMin, int3& cellMax)
+{
+    const aabb bounds = tri.GetBounds();
+    for (int i = 0; i < 3; i++)
+    {
+        const int limit = resolution[i] - 1;
+        cellMin[i] = clamp(static_cast<int>((bounds.bmin[i] - origin[i]) / cellSize[i]), 0, limit);
+        cellMax[i] = clamp(static_cast<int>((bounds.bmax[i] - origin[i]) / cellSize[i]), 0, limit);
+    }
+}
+
+static void CountCellReferences(const GridBuildContext& context, const uint first, const uint count)
+{
+    const int3 res = context.resolution;
+    for (uint triIdx = first; triIdx < first + count; triIdx++)
+    {
+        int3 cellMin, cellMax;
+        GetCellRange((*context.triangles)[triIdx], context.bounds.bmin3, res, context.cellSize, cellMin, cellMax);
+        for (int iz = cellMin.z; iz <= cellMax.z; iz++) for (int iy = cellMin.y; iy <= cellMax.y; iy++)
+            for (int ix = cellMin.x; ix <= cellMax.x; ix++) Advance(context.cursor[ix + iy * res.x + iz * res.x * res.y], context.shared);
+    }
+}
+
+static void ScatterCellReferences(const GridBuildContext& context, const uint first, const uint count)
+{
+    const int3 res = context.resolution;
+    for (uint triIdx = first; triIdx < first + count; triIdx++)
+    {
+        int3 cellMin, cellMax;
+        GetCellRange((*context.triangles)[triIdx], context.bounds.bmin3, res, context.cellSize, cellMin, cellMax);
+        for (int iz = cellMin.z; iz <= cellMax.z; iz++) for (int iy = cellMin.y; iy <= cellMax.y; iy++)
+            for (int ix = cellMin.x; ix <= cellMax.x; ix++) context.triIndices[Advance(context.cursor[ix + iy * res.x + iz * res.x * res.y], context.shared)] = triIdx;
+    }
+}
+
+static void SortCellReferences(const GridBuildContext& context, const uint first, const uint count)
+{
+    for (uint cell = first; cell < first + count; cell++)
+        std::sort(context.triIndices + context.cellStart[cell], context.triIndices + context.cellStart[cell + 1]);
+}
+
+// Bins the triangles of a range of top cells into their sub-grids; with scatter set the triangle
+// indices are written, else the references of each cell are counted. Every top cell owns its cells,
+// so the cursors are not shared, and its triangles are sorted, so the entries of a cell are too.
+static void BinSubCellReferences(const GridBuildContext& context, const uint first, const uint count, const bool scatter)
+{
+    int3 res = context.resolution;
+    for (uint topIdx = first; topIdx < first + count; topIdx++)
+    {
+        const GridTopCell& top = context.topCells[topIdx];
+        if (top.resolution[0] == 0) continue;
+        const int3 subRes = make_int3(top.resolution[0], top.resolution[1], top.resolution[2]);
+        const int3 coord = make_int3(topIdx % res.x, (topIdx / res.x) % res.y, topIdx / (res.x * res.y));
+        const float3 origin = context.bounds.bmin3 + make_float3(coord) * context.cellSize;
+        const float3 subSize = context.cellSize / make_float3(subRes);
+        for (uint i = context.topStart[topIdx]; i < context.topStart[topIdx + 1]; i++)
+        {
+            const uint triIdx = context.topIndices[i];
+            int3 cellMin, cellMax;
+            GetCellRange((*context.triangles)[triIdx], origin, subRes, subSize, cellMin, cellMax);
+            for (int iz = cellMin.z; iz <= cellMax.z; iz++) for (int iy = cellMin.y; iy <= cellMax.y; iy++)
+                for (int ix = cellMin.x; ix <= cellMax.x; ix++)
+                {
+                    const uint slot = Advance(context.cursor[top.firstCell + ix + iy * subRes.x + iz * subRes.x * subRes.y], false);
+                    if (scatter) context.triIndices[slot] = triIdx;
+                }
+        }
+    }
+}
+
+// jobs for the passes of BuildGridCells and BuildTwoLevelGrid, over ranges of triangles or, for the
+// sort and the sub-grids, of cells
+static struct GridBuildJob : public Job
+{
+    void Main()
+    {
+        if (pass == 0) CountCellReferences(*context, first, count);
+        else if (pass == 1) ScatterCellReferences(*context, first, count);
+        else if (pass == 2) SortCellReferences(*context, first, count);
+        else BinSubCellReferences(*context, first, count, pass == 4);
+    }
+    const GridBuildContext* context;
+    int pass;
+    uint first, count;
+} gridBuildJob[64];
+
+// splits size items over jobCount jobs and runs them, on this thread if there is only one
+static void RunGridBuildJobs(const GridBuildContext& context, const uint jobCount, const int pass, const uint size)
+{
+    const uint jobSize = (size + jobCount - 1) / jobCount;
+    for (uint i = 0; i < jobCount; i++)
+    {
+        gridBuildJob[i].context = &context, gridBuildJob[i].pass = pass;
+        gridBuildJob[i].first = min(size, i * jobSize), gridBuildJob[i].count = min(jobSize, size - gridBuildJob[i].first);
+    }
+    if (jobCount == 1)
+    {
+        gridBuildJob[0].Main();
+        return;
+    }
+    JobManager* jm = JobManager::GetJobManager();
+    for (uint i = 0; i < jobCount; i++) jm->AddJob2(&gridBuildJob[i]);
+    jm->RunJobs();
+}
+
+static uint GetGridJobCount(const uint N)
+{
+    const uint threads = JobManager::GetJobManager()->GetNumThreads();
+    return N < 2 * GRID_MIN_JOB_SIZE || threads == 1 ? 1 : min(64u, min(N / GRID_MIN_JOB_SIZE, threads * 4));
+}
+
+// turns the reference counts into the first entry of each cell, and the cursors into the first free one
+static void PrefixSumCellReferences(std::vector<std::atomic<uint>>& cursor, std::vector<uint>& cellStart, std::vector<uint>& triIndices)
+{
+    const uint cellCount = (uint)cursor.size();
+    cellStart.resize(cellCount + 1);
+    uint total = 0;
+    for (uint cell = 0; cell < cellCount; cell++)
+    {
+        cellStart[cell] = total;
+        total += cursor[cell];
+        cursor[cell] = cellStart[cell];
+    }
+    cellStart[cellCount] = total;
+    triIndices.resize(total);
+}
+
+void Tmpl8::BuildGridCells(const std::vector<Tri>& triangles, const aabb& bounds, const int3 resolution, const float3 cellSize, std::vector<uint>& cellStart, std::vector<uint>& triIndices)
+{
+    const uint N = (uint)triangles.size(), cellCount = resolution.x * resolution.y * resolution.z;
+    const uint jobCount = GetGridJobCount(N);
+    std::vector<std::atomic<uint>> cursor(cellCount);
+    GridBuildContext context;
+    context.triangles = &triangles;
+    context.bounds = bounds, context.resolution = resolution, context.cellSize = cellSize;
+    context.cursor = cursor.data(), context.shared = jobCount > 1;
+
+    RunGridBuildJobs(context, jobCount, 0, N);
+    PrefixSumCellReferences(cursor, cellStart, triIndices);
+    context.cellStart = cellStart.data(), context.triIndices = triIndices.data();
+    RunGridBuildJobs(context, jobCount, 1, N);
+    if (jobCount > 1) RunGridBuildJobs(context, jobCount, 2, cellCount);
+}
+
+void Tmpl8::BuildTwoLevelGrid(const std::vector<Tri>& triangles, const aabb& bounds, const int3 resolution, const float3 cellSize, std::vector<GridTopCell>& topCells, std::vector<uint>& cellStart, std::vector<uint>& triIndices)
+{
+    std::vector<uint> topStart, topIndices;
+    BuildGridCells(triangles, bounds, resolution, cellSize, topStart, topIndices);
+
+    // every top cell gets the resolution of a flat grid over its own triangles
+    const uint topCount = resolution.x * resolution.y * resolution.z;
+    const float topVolume = cellSize.x * cellSize.y * cellSize.z;
+    float3 size = cellSize;
+    topCells.resize(topCount);
+    uint cellCount = 0;
+    for (uint topIdx = 0; topIdx < topCount; topIdx++)
+    {
+        GridTopCell& top = topCells[topIdx];
+        const uint references = topStart[topIdx + 1] - topStart[topIdx];
+        top.firstCell = cellCount;
+        for (int i = 0; i < 3; i++) top.resolution[i] = 0;
+        if (references == 0) continue;
+        const float cubeRoot = powf(GRID_CELL_DENSITY * references / topVolume, 1 / 3.f);
+        for (int i = 0; i < 3; i++) top.resolution[i] = (uchar)clamp(static_cast<int>(floor(size[i] * cubeRoot)), 1, GRID_MAX_SUB_RESOLUTION);
+        cellCount += top.resolution[0] * top.resolution[1] * top.resolution[2];
+    }
+
+    const uint jobCount = min(GetGridJobCount((uint)topIndices.size()), topCount);
+    std::vector<std::atomic<uint>> cursor(cellCount);
+    GridBuildContext context;
+    context.triangles = &triangles;
+    context.bounds = bounds, context.resolution = resolution, context.cellSize = cellSize;
+    context.cursor = cursor.data(), context.shared = false;
+    context.topCells = topCells.data(), context.topStart = topStart.data(), context.topIndices = topIndices.data();
+
+    RunGridBuildJobs(context, jobCount, 3, topCount);
+    PrefixSumCellReferences(cursor, cellStart, triIndices);
+    context.cellStart = cellStart.data(), context.triIndices = triIndices.data();
+    RunGridBuildJobs(context, jobCount, 4, topCount);
+}
\ No newline at end of file
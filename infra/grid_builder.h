@@ -0,0 +1,28 @@
+#pragma once
+
+#include "blas_grid.h"
+
+#define GRID_MIN_JOB_SIZE 4096 // fewer triangles per job are binned by the calling thread
+#define GRID_CELL_DENSITY 5.0f // cells per triangle of a flat grid and of the sub-grids of a two-level one
+#define GRID_TOP_DENSITY 0.015625f // cells per triangle of the top level of a two-level grid
+#define GRID_MAX_SUB_RESOLUTION 32 // per axis, so it fits GridTopCell
+
+// The grids keep their cells in compressed sparse row layout: one array with the first entry of every
+// cell and one with the triangle indices of all cells, cell after cell. They are filled in three
+// passes: the jobs count the references of every cell, a prefix sum over the counts gives the first
+// entry of each cell, and the jobs then scatter the triangle indices to their cells. The entries of a
+// cell are sorted afterwards, so the layout does not depend on the order of the jobs.
+//
+// A two-level grid first bins the triangles into a coarse top grid this way. Every top cell then gets a
+// sub-grid with the resolution a flat grid would give its own triangles, and the jobs bin the triangles
+// of each top cell into it; the cells of all sub-grids share the one cellStart and triIndices.
+
+namespace Tmpl8
+{
+    // Bins the triangles into the cells of a grid over bounds, see above; cell c holds
+    // triIndices[cellStart[c]] up to triIndices[cellStart[c + 1]].
+    void BuildGridCells(const std::vector<Tri>& triangles, const aabb& bounds, const int3 resolution, const float3 cellSize, std::vector<uint>& cellStart, std::vector<uint>& triIndices);
+    // Builds a two-level grid with a top level of the given resolution, see above; the cells of top
+    // cell t start at cellStart[topCells[t].firstCell].
+    void BuildTwoLevelGrid(const std::vector<Tri>& triangles, const aabb& bounds, const int3 resolution, const float3 cellSize, std::vector<GridTopCell>& topCells, std::vector<uint>& cellStart, std::vector<uint>& triIndices);
+}
\ No newline at end of file
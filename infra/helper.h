@@ -15,7 +15,7 @@ struct Tri
     float3 centroid;
     int objIdx;
 
-    aabb GetBounds()
+    aabb GetBounds() const
     {
         aabb bounds;
         bounds.Grow(vertex0);
@@ -25,6 +25,24 @@ struct Tri
     }
 };
 
+// intersection-only triangle data for Moller-Trumbore with precomputed edges,
+// kept apart from the shading attributes in Tri so traversal does not pull those into the cache
+struct TriAccel
+{
+    TriAccel() {};
+    TriAccel(const Tri& tri)
+        : vertex0(tri.vertex0), edge1(tri.vertex1 - tri.vertex0), edge2(tri.vertex2 - tri.vertex0), objIdx(tri.objIdx)
+    {};
+    float3 vertex0, edge1, edge2;
+    int objIdx;
+};
+
+inline void BuildTriAccel(const std::vector<Tri>& triangles, std::vector<TriAccel>& triAccel)
+{
+    triAccel.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) triAccel[i] = TriAccel(triangles[i]);
+}
+
 struct Vertex
 {
     float3 position{};
@@ -0,0 +1,398 @@
+#include "precomp.h"
+#include "kd_builder.h"
+
+enum KDEventType { KD_EVENT_END, KD_EVENT_PLANAR, KD_EVENT_START };
+enum KDSide { KD_BOTH, KD_LEFT_ONLY, KD_RIGHT_ONLY };
+
+// At one position on one axis, the triangles that end there come first, then the flat ones, then the
+// ones that start there, which is the order the sweep counts them in.
+struct KDEvent
+{
+    float pos;
+    uint triIdx;
+    uchar axis, type;
+    bool operator<(const KDEvent& e) const
+    {
+        if (pos != e.pos) return pos < e.pos;
+        if (axis != e.axis) return axis < e.axis;
+        return type < e.type;
+    }
+};
+
+struct KDSplit
+{
+    int axis = -1;
+    float pos = 0, cost = 1e30f;
+    bool planarLeft = true; // the triangles in the plane go to the left child
+};
+
+// the nodes and leaf triangles of a subtree, with child and triangle indices relative to it
+struct KDSubtree
+{
+    std::vector<KDTreeNode> nodes;
+    std::vector<uint> triIndices;
+    std::vector<uchar> side; // KDSide per triangle while a node is split
+    std::vector<int> task; // for the top levels: the subtree task of a node, or -1
+    uint deepest = 0;
+};
+
+// a subtree that is left to a worker: the events of its root and the voxel they are in
+struct KDSubtreeTask
+{
+    std::vector<KDEvent> events;
+    uint triCount;
+    aabb voxel;
+    int depth;
+    KDSubtree tree;
+};
+
+struct KDBuildContext
+{
+    const std::vector<Tri>* triangles;
+    int maxDepth;
+    uint taskSize; // nodes with at most this many triangles become tasks, 0 to build everything here
+    std::vector<KDSubtreeTask>* tasks;
+};
+
+static void BuildNode(const KDBuildContext& context, KDSubtree& tree, const uint nodeIdx, std::vector<KDEvent>& events, const uint triCount, const aabb& voxel, const int depth);
+
+struct KDSubtreeJob : public Job
+{
+    void Main()
+    {
+        task->tree.side.resize(context.triangles->size());
+        task->tree.nodes.push_back(KDTreeNode());
+        BuildNode(context, task->tree, 0, task->events, task->triCount, task->voxel, task->depth);
+        // only the running tasks hold a side array, not every task until the nodes are emitted
+        std::vector<uchar>().swap(task->tree.side);
+    }
+    KDBuildContext context;
+    KDSubtreeTask* task;
+};
+
+static float HalfArea(const aabb& box)
+{
+    const float3 e = box.bmax3 - box.bmin3;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+static void AppendEvents(std::vector<KDEvent>& events, const uint triIdx, const aabb& box)
+{
+    for (uchar a = 0; a < 3; a++)
+    {
+        if (box.bmin[a] == box.bmax[a]) events.push_back({ box.bmin[a], triIdx, a, KD_EVENT_PLANAR });
+        else
+        {
+            events.push_back({ box.bmin[a], triIdx, a, KD_EVENT_START });
+            events.push_back({ box.bmax[a], triIdx, a, KD_EVENT_END });
+        }
+    }
+}
+
+// the bounds of the part of the triangle inside voxel, by clipping it against the six planes
+// (Sutherland-Hodgman); false when nothing of it is left
+static bool ClipTriangle(const Tri& tri, const aabb& voxel, aabb& clipped)
+{
+    float3 poly[2][9] = { { tri.vertex0, tri.vertex1, tri.vertex2 } };
+    int count = 3, in = 0;
+    for (int plane = 0; plane < 6 && count > 0; plane++)
+    {
+        const int axis = plane >> 1;
+        const bool isMin = (plane & 1) == 0;
+        const float bound = isMin ? voxel.bmin[axis] : voxel.bmax[axis];
+        const float3* src = poly[in];
+        float3* dst = poly[1 - in];
+        int n = 0;
+        for (int i = 0; i < count; i++)
+        {
+            float3 a = src[i], b = src[(i + 1) % count];
+            const float da = isMin ? a[axis] - bound : bound - a[axis];
+            const float db = isMin ? b[axis] - bound : bound - b[axis];
+            if (da >= 0) dst[n++] = a;
+            if ((da < 0) != (db < 0))
+            {
+                float3 p = a + (b - a) * (da / (da - db));
+                p[axis] = bound; // exactly on the plane, whatever the rounding
+                dst[n++] = p;
+            }
+        }
+        count = n, in = 1 - in;
+    }
+    if (count == 0) return false;
+    clipped = aabb();
+    for (int i = 0; i < count; i++) clipped.Grow(poly[in][i]);
+    // the clipped vertices are rounded, so the bounds are widened a little to keep the whole triangle
+    // part inside them, and then cut back to the voxel
+    const float3 margin = (fabs(clipped.bmin3) + fabs(clipped.bmax3)) * 1e-6f;
+    clipped.bmin3 = fmaxf(clipped.bmin3 - margin, voxel.bmin3), clipped.bmax3 = fminf(clipped.bmax3 + margin, voxel.bmax3);
+    return true;
+}
+
+// the cost of splitting voxel at pos, with the triangles in the plane on the cheaper side
+static float SplitCost(const aabb& voxel, const float voxelArea, const int axis, const float pos, const int NL, const int NR, const int NP, bool& planarLeft)
+{
+    aabb left = voxel, right = voxel;
+    left.bmax[axis] = pos, right.bmin[axis] = pos;
+    const float PL = HalfArea(left) / voxelArea, PR = HalfArea(right) / voxelArea;
+    auto cost = [&](const int nl, const int nr)
+    {
+        const float c = KD_COST_TRAVERSAL + KD_COST_INTERSECTION * (PL * nl + PR * nr);
+        return nl == 0 || nr == 0 ? c * KD_EMPTY_BONUS : c;
+    };
+    const float costLeft = cost(NL + NP, NR), costRight = cost(NL, NR + NP);
+    planarLeft = costLeft < costRight;
+    return min(costLeft, costRight);
+}
+
+// one sweep over the sorted events, for all three axes at once
+static KDSplit FindSplit(const std::vector<KDEvent>& events, const uint triCount, const aabb& voxel)
+{
+    KDSplit best;
+    const float voxelArea = HalfArea(voxel);
+    if (voxelArea <= 0) return best;
+    int NL[3] = { 0, 0, 0 }, NR[3] = { (int)triCount, (int)triCount, (int)triCount };
+    for (size_t i = 0; i < events.size();)
+    {
+        const float pos = events[i].pos;
+        const uchar axis = events[i].axis;
+        int ends = 0, planar = 0, starts = 0;
+        while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == KD_EVENT_END) ends++, i++;
+        while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == KD_EVENT_PLANAR) planar++, i++;
+        while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == KD_EVENT_START) starts++, i++;
+        NR[axis] -= planar + ends;
+        // a plane on the boundary of the voxel would leave one child as large as the node
+        if (pos > voxel.bmin[axis] && pos < voxel.bmax[axis])
+        {
+            bool planarLeft;
+            const float cost = SplitCost(voxel, voxelArea, axis, pos, NL[axis], NR[axis], planar, planarLeft);
+            if (cost < best.cost) best.axis = axis, best.pos = pos, best.cost = cost, best.planarLeft = planarLeft;
+        }
+        NL[axis] += starts + planar;
+    }
+    return best;
+}
+
+static void MakeLeaf(KDSubtree& tree, const uint nodeIdx, const std::vector<KDEvent>& events, const uint triCount)
+{
+    tree.nodes[nodeIdx].first = (uint)tree.triIndices.size();
+    tree.nodes[nodeIdx].data = triCount << 2 | 3;
+    // every triangle has one start or planar event on each axis
+    for (const KDEvent& e : events)
+        if (e.axis == 0 && e.type != KD_EVENT_END) tree.triIndices.push_back(e.triIdx);
+}
+
+static void BuildNode(const KDBuildContext& context, KDSubtree& tree, const uint nodeIdx, std::vector<KDEvent>& events, const uint triCount, const aabb& voxel, const int depth)
+{
+    tree.deepest = max(tree.deepest, (uint)depth);
+    const KDSplit split = triCount == 0 || depth >= context.maxDepth ? KDSplit() : FindSplit(events, triCount, voxel);
+    // terminate when no split is cheaper than testing all triangles
+    if (split.axis < 0 || split.cost > KD_COST_INTERSECTION * triCount)
+    {
+        MakeLeaf(tree, nodeIdx, events, triCount);
+        return;
+    }
+
+    // classify the triangles by their events on the split axis
+    std::vector<uchar>& side = tree.side;
+    for (const KDEvent& e : events) side[e.triIdx] = KD_BOTH;
+    for (const KDEvent& e : events)
+    {
+        if (e.axis != split.axis) continue;
+        if (e.type == KD_EVENT_END && e.pos <= split.pos) side[e.triIdx] = KD_LEFT_ONLY;
+        else if (e.type == KD_EVENT_START && e.pos >= split.pos) side[e.triIdx] = KD_RIGHT_ONLY;
+        else if (e.type == KD_EVENT_PLANAR)
+        {
+            if (e.pos < split.pos || (e.pos == split.pos && split.planarLeft)) side[e.triIdx] = KD_LEFT_ONLY;
+            else side[e.triIdx] = KD_RIGHT_ONLY;
+        }
+    }
+    aabb leftVoxel = voxel, rightVoxel = voxel;
+    leftVoxel.bmax[split.axis] = split.pos;
+    rightVoxel.bmin[split.axis] = split.pos;
+
+    // the events of the triangles on one side stay sorted; those that straddle the plane are clipped
+    // to both children, and only their new events need sorting
+    std::vector<KDEvent> leftOnly, rightOnly, bothLeft, bothRight;
+    uint leftCount = 0, rightCount = 0;
+    for (const KDEvent& e : events)
+    {
+        const bool first = e.axis == 0 && e.type != KD_EVENT_END;
+        if (side[e.triIdx] == KD_LEFT_ONLY) leftOnly.push_back(e), leftCount += first;
+        else if (side[e.triIdx] == KD_RIGHT_ONLY) rightOnly.push_back(e), rightCount += first;
+        else if (first)
+        {
+            const Tri& tri = (*context.triangles)[e.triIdx];
+            aabb clipped;
+            if (ClipTriangle(tri, leftVoxel, clipped)) AppendEvents(bothLeft, e.triIdx, clipped), leftCount++;
+            if (ClipTriangle(tri, rightVoxel, clipped)) AppendEvents(bothRight, e.triIdx, clipped), rightCount++;
+        }
+    }
+    std::vector<KDEvent>().swap(events);
+    std::sort(bothLeft.begin(), bothLeft.end());
+    std::sort(bothRight.begin(), bothRight.end());
+    std::vector<KDEvent> leftEvents(leftOnly.size() + bothLeft.size()), rightEvents(rightOnly.size() + bothRight.size());
+    std::merge(leftOnly.begin(), leftOnly.end(), bothLeft.begin(), bothLeft.end(), leftEvents.begin());
+    std::merge(rightOnly.begin(), rightOnly.end(), bothRight.begin(), bothRight.end(), rightEvents.begin());
+    std::vector<KDEvent>().swap(leftOnly), std::vector<KDEvent>().swap(rightOnly);
+    std::vector<KDEvent>().swap(bothLeft), std::vector<KDEvent>().swap(bothRight);
+
+    // recurse; the left child follows the node, the right one follows the subtree of the left one,
+    // and in the top levels a small enough child is left to a worker
+    auto child = [&](const uint childIdx, std::vector<KDEvent>& childEvents, const uint childCount, const aabb& childVoxel)
+    {
+        if (context.tasks && childCount <= context.taskSize)
+        {
+            tree.task[childIdx] = (int)context.tasks->size();
+            context.tasks->push_back({ std::move(childEvents), childCount, childVoxel, depth + 1 });
+        }
+        else BuildNode(context, tree, childIdx, childEvents, childCount, childVoxel, depth + 1);
+    };
+    tree.nodes.push_back(KDTreeNode());
+    if (context.tasks) tree.task.push_back(-1);
+    child(nodeIdx + 1, leftEvents, leftCount, leftVoxel);
+    const uint rightIdx = (uint)tree.nodes.size();
+    tree.nodes.push_back(KDTreeNode());
+    if (context.tasks) tree.task.push_back(-1);
+    child(rightIdx, rightEvents, rightCount, rightVoxel);
+    tree.nodes[nodeIdx].splitPos = split.pos;
+    tree.nodes[nodeIdx].data = rightIdx << 2 | split.axis;
+}
+
+static void AppendSubtree(const KDSubtree& subtree, std::vector<KDTreeNode>& nodes, std::vector<uint>& triIndices)
+{
+    const uint nodeOffset = (uint)nodes.size(), indexOffset = (uint)triIndices.size();
+    for (KDTreeNode node : subtree.nodes)
+    {
+        if (node.isLeaf()) node.first += indexOffset;
+        else node.data += nodeOffset << 2;
+        nodes.push_back(node);
+    }
+    triIndices.insert(triIndices.end(), subtree.triIndices.begin(), subtree.triIndices.end());
+}
+
+// copies the top levels depth first, with the subtrees of the workers in place of their roots
+static void EmitNodes(const KDSubtree& top, const std::vector<KDSubtreeTask>& tasks, const uint srcIdx, std::vector<KDTreeNode>& nodes, std::vector<uint>& triIndices)
+{
+    if (top.task[srcIdx] >= 0)
+    {
+        AppendSubtree(tasks[top.task[srcIdx]].tree, nodes, triIndices);
+        return;
+    }
+    const KDTreeNode node = top.nodes[srcIdx];
+    const uint dstIdx = (uint)nodes.size();
+    nodes.push_back(node);
+    if (node.isLeaf())
+    {
+        nodes[dstIdx].first = (uint)triIndices.size();
+        triIndices.insert(triIndices.end(), top.triIndices.begin() + node.first, top.triIndices.begin() + node.first + node.triCount());
+        return;
+    }
+    EmitNodes(top, tasks, srcIdx + 1, nodes, triIndices);
+    const uint rightIdx = (uint)nodes.size();
+    EmitNodes(top, tasks, node.right(), nodes, triIndices);
+    nodes[dstIdx].data = rightIdx << 2 | node.axis();
+}
+
+void Tmpl8::BuildKDTreeSAH(const std::vector<Tri>& triangles, const aabb& bounds, std::vector<KDTreeNode>& nodes, std::vector<uint>& triIndices, uint& deepest)
+{
+    const uint N = (uint)triangles.size();
+    std::vector<KDEvent> events;
+    events.reserve(N * 6);
+    uint rootCount = 0;
+    for (uint i = 0; i < N; i++)
+    {
+        aabb box;
+        if (ClipTriangle(triangles[i], bounds, box)) AppendEvents(events, i, box), rootCount++;
+    }
+    std::sort(events.begin(), events.end());
+
+    KDBuildContext context;
+    context.triangles = &triangles;
+    // the depth limit of pbrt, within the traversal stack
+    context.maxDepth = min(KD_STACK_SIZE - 1, (int)roundf(8 + 1.3f * log2f((float)max(N, 1u))));
+    JobManager* jm = JobManager::GetJobManager();
+    context.taskSize = max((uint)KD_MIN_TASK_SIZE, N / (jm->GetNumThreads() * 8));
+    std::vector<KDSubtreeTask> tasks;
+    context.tasks = N > context.taskSize ? &tasks : 0;
+
+    KDSubtree top;
+    top.side.resize(N);
+    top.nodes.push_back(KDTreeNode());
+    top.task.push_back(-1);
+    BuildNode(context, top, 0, events, rootCount, bounds, 0);
+    std::vector<uchar>().swap(top.side);
+    deepest = top.deepest;
+    nodes.clear(), triIndices.clear();
+    if (tasks.empty())
+    {
+        nodes.swap(top.nodes), triIndices.swap(top.triIndices);
+        return;
+    }
+
+    // hand the subtrees below the top levels to the workers
+    context.tasks = 0;
+    std::vector<KDSubtreeJob> jobs(tasks.size());
+    for (uint i = 0; i < tasks.size(); i += 4096)
+    {
+        for (uint j = i; j < min((uint)tasks.size(), i + 4096); j++)
+        {
+            jobs[j].context = context, jobs[j].task = &tasks[j];
+            jm->AddJob2(&jobs[j]);
+        }
+        jm->RunJobs();
+    }
+    for (const KDSubtreeTask& task : tasks) deepest = max(deepest, task.tree.deepest);
+    EmitNodes(top, tasks, 0, nodes, triIndices);
+}
+
+// Pushes the rope on face down from nodeIdx as long as the face, inside bmin and bmax, lies on one
+// side of the split plane. A plane on the axis of the face is crossed into the child next to it.
+static uint OptimizeRope(const std::vector<KDTreeNode>& nodes, uint nodeIdx, const uint face, const float* bmin, const float* bmax)
+{
+    const uint faceAxis = face >> 1;
+    while (!nodes[nodeIdx].isLeaf())
+    {
+        const KDTreeNode& node = nodes[nodeIdx];
+        const uint axis = node.axis();
+        if (axis == faceAxis) nodeIdx = (face & 1) ? nodeIdx + 1 : node.right();
+        else if (bmax[axis] <= node.splitPos) nodeIdx = nodeIdx + 1;
+        else if (bmin[axis] >= node.splitPos) nodeIdx = node.right();
+        else break;
+    }
+    return nodeIdx;
+}
+
+// ropes holds the neighbours of the node, the ones of its children are pushed down from them as the
+// recursion goes, so no rope is walked down more than once per level
+static void BuildRopes(std::vector<KDTreeNode>& nodes, const uint nodeIdx, const uint* ropes, const aabb& bounds, std::vector<KDRopeLeaf>& leaves)
+{
+    uint optimized[6];
+    for (uint face = 0; face < 6; face++) optimized[face] = ropes[face] ? OptimizeRope(nodes, ropes[face], face, bounds.bmin, bounds.bmax) : 0;
+    KDTreeNode& node = nodes[nodeIdx];
+    if (node.isLeaf())
+    {
+        KDRopeLeaf leaf;
+        for (int axis = 0; axis < 3; axis++) leaf.bmin[axis] = bounds.bmin[axis], leaf.bmax[axis] = bounds.bmax[axis];
+        for (uint face = 0; face < 6; face++) leaf.rope[face] = optimized[face];
+        leaf.first = node.first;
+        node.first = (uint)leaves.size();
+        leaves.push_back(leaf);
+        return;
+    }
+    const uint axis = node.axis(), rightIdx = node.right();
+    aabb leftBounds = bounds, rightBounds = bounds;
+    leftBounds.bmax[axis] = rightBounds.bmin[axis] = node.splitPos;
+    uint leftRopes[6], rightRopes[6];
+    for (uint face = 0; face < 6; face++) leftRopes[face] = rightRopes[face] = optimized[face];
+    leftRopes[axis * 2 + 1] = rightIdx, rightRopes[axis * 2] = nodeIdx + 1;
+    BuildRopes(nodes, nodeIdx + 1, leftRopes, leftBounds, leaves);
+    BuildRopes(nodes, rightIdx, rightRopes, rightBounds, leaves);
+}
+
+void Tmpl8::BuildKDRopes(std::vector<KDTreeNode>& nodes, const aabb& bounds, std::vector<KDRopeLeaf>& leaves)
+{
+    leaves.clear();
+    const uint ropes[6] = { 0, 0, 0, 0, 0, 0 };
+    BuildRopes(nodes, 0, ropes, bounds, leaves);
+    leaves.shrink_to_fit();
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "blas_kdtree.h"
+
+#define KD_COST_TRAVERSAL 15.0f // cost of stepping through an interior node, KT in Wald and Havran
+#define KD_COST_INTERSECTION 20.0f // cost of a ray triangle test, KI
+#define KD_EMPTY_BONUS 0.8f // a split that cuts off empty space has its cost scaled by this
+#define KD_MIN_TASK_SIZE 4096 // smaller subtrees are built by the thread that splits them off
+
+// The SAH kd-trees are built as in "On building fast kd-Trees for Ray Tracing, and on doing that in
+// O(N log N)" (Wald and Havran 2006). Every triangle adds a start and an end event on each axis, or a
+// planar event where it is flat, at the bounds of the part of it inside the node. The events are sorted
+// once; a sweep over them then finds the best plane on all three axes, counting the triangles on each
+// side as it passes. The events of a triangle on one side of the plane stay in order, and only the
+// triangles that straddle it are clipped to the two children and get new events, so the children never
+// sort more than those. The top levels are split on the calling thread, the subtrees below them are
+// built by the job system.
+
+namespace Tmpl8
+{
+    // Builds the nodes of a kd-tree over the triangles inside bounds, depth first as in KDTreeNode,
+    // and the triangle indices of its leaves; deepest is set to the depth of the deepest leaf.
+    void BuildKDTreeSAH(const std::vector<Tri>& triangles, const aabb& bounds, std::vector<KDTreeNode>& nodes, std::vector<uint>& triIndices, uint& deepest);
+    // Links every leaf of the tree to its neighbours, see KDRopeLeaf. A rope points at the smallest
+    // node that still covers the whole face, so the ray descends as little as possible behind it.
+    void BuildKDRopes(std::vector<KDTreeNode>& nodes, const aabb& bounds, std::vector<KDRopeLeaf>& leaves);
+}
\ No newline at end of file
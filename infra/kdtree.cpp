@@ -1,26 +1,36 @@
 #include "precomp.h"
 #include "kdtree.h"
+#include "kd_builder.h"
 
 void KDTree::Build()
 {
     auto startTime = std::chrono::high_resolution_clock::now();
     triangleBounds.resize(triangles.size());
+    UpdateBounds();
+#ifdef KD_SAH
+    BuildKDTreeSAH(triangles, localBounds, kdNodes, triIndices, maxDepth);
+#else
     // populate triangle index array
-    std::vector<uint> triIndices;
-    triIndices.resize(triangles.size());
+    std::vector<uint> triIdx;
+    triIdx.resize(triangles.size());
     for (int i = 0; i < triangles.size(); i++)
     {
         // setup indices
-        triIndices[i] = i;
+        triIdx[i] = i;
     }
-    UpdateBounds();
-    // assign all triangles to root node
-    rootNode = new KDTreeNode();
-    rootNode->aabbMin = localBounds.bmin3;
-    rootNode->aabbMax = localBounds.bmax3;
-    rootNode->triIndices = triIndices;
-    // subdivide recursively
-    Subdivide(rootNode, 0);
+    // assign all triangles to the root node, the children are appended as it is subdivided
+    kdNodes.clear();
+    triIndices.clear();
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(rootNodeIdx, triIdx, localBounds, 0);
+#endif
+    kdNodes.shrink_to_fit();
+    triIndices.shrink_to_fit();
+    nodesUsed = (uint)kdNodes.size();
+    BuildTriAccel(triangles, triAccel);
+#ifdef KD_ROPES
+    BuildKDRopes(kdNodes, localBounds, ropeLeaves);
+#endif
     auto endTime = std::chrono::high_resolution_clock::now();
     buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 }
@@ -42,28 +52,38 @@ void KDTree::UpdateBounds()
 }
 
 
-void KDTree::Subdivide(KDTreeNode* node, int depth)
+void KDTree::MakeLeaf(const uint nodeIdx, const std::vector<uint>& triIdx)
+{
+    kdNodes[nodeIdx].first = (uint)triIndices.size();
+    kdNodes[nodeIdx].data = (uint)triIdx.size() << 2 | 3;
+    triIndices.insert(triIndices.end(), triIdx.begin(), triIdx.end());
+}
+
+// triIdx holds the triangles of the node and is released once they are split over the children
+void KDTree::Subdivide(const uint nodeIdx, std::vector<uint>& triIdx, const aabb& bounds, int depth)
 {
     // terminate recursion
-    if (depth >= m_maxBuildDepth) return;
-    uint triCount = node->triIndices.size();
-    if (triCount <= 2) return;
+    uint triCount = triIdx.size();
+    if (depth >= m_maxBuildDepth || triCount <= 2)
+    {
+        MakeLeaf(nodeIdx, triIdx);
+        return;
+    }
     if (depth > maxDepth) maxDepth = depth;
 
     // split plane axis and position
-    float3 extent = node->aabbMax - node->aabbMin;
+    float3 extent = bounds.bmax3 - bounds.bmin3;
     int axis = 0;
     if (extent.y > extent.x) axis = 1;
     if (extent.z > extent[axis]) axis = 2;
-    float distance = extent[axis] * 0.5f;
-    float splitPos = node->aabbMin[axis] + distance;
+    float splitPos = bounds.bmin[axis] + extent[axis] * 0.5f;
 
     std::vector<uint> leftTriIdxs;
     std::vector<uint> rightTriIdxs;
 
     for (int i = 0; i < triCount; i++)
     {
-        uint idx = node->triIndices[i];
+        uint idx = triIdx[i];
         if (triangleBounds[idx].bmax[axis] < splitPos)
         {
             leftTriIdxs.push_back(idx);
@@ -78,33 +98,21 @@ void KDTree::Subdivide(KDTreeNode* node, int depth)
             rightTriIdxs.push_back(idx);
         }
     }
-
-    KDTreeNode* leftChild = new KDTreeNode();
-    KDTreeNode* rightChild = new KDTreeNode();
-    leftChild->triIndices = leftTriIdxs;
-    rightChild->triIndices = rightTriIdxs;
-    node->left = leftChild;
-    node->right = rightChild;
-    nodesUsed++; nodesUsed++;
-
-    node->splitAxis = axis;
-    node->splitDistance = distance;
+    std::vector<uint>().swap(triIdx);
 
     // update the bounds of nodes
-    leftChild->aabbMin = node->aabbMin;
-    leftChild->aabbMax = node->aabbMax;
-    leftChild->aabbMax[axis] = splitPos;
+    aabb leftBounds = bounds, rightBounds = bounds;
+    leftBounds.bmax[axis] = splitPos;
+    rightBounds.bmin[axis] = splitPos;
 
-    rightChild->aabbMin = node->aabbMin;
-    rightChild->aabbMax = node->aabbMax;
-    rightChild->aabbMin[axis] = splitPos;
-
-    node->triIndices.clear();
-    node->isLeaf = false;
-
-    // recurse
-    Subdivide(leftChild, depth + 1);
-    Subdivide(rightChild, depth + 1);
+    // recurse; the left child follows the node, the right one follows the subtree of the left one
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(nodeIdx + 1, leftTriIdxs, leftBounds, depth + 1);
+    const uint rightIdx = (uint)kdNodes.size();
+    kdNodes.push_back(KDTreeNode());
+    Subdivide(rightIdx, rightTriIdxs, rightBounds, depth + 1);
+    kdNodes[nodeIdx].splitPos = splitPos;
+    kdNodes[nodeIdx].data = rightIdx << 2 | axis;
 }
 
 bool KDTree::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tminOut, float& tmaxOut)
@@ -120,98 +128,153 @@ bool KDTree::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax,
     return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 
-void KDTree::IntersectTri(Ray& ray, const Tri& tri, const uint triIdx)
+void KDTree::IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx)
 {
-    const float3 edge1 = tri.vertex1 - tri.vertex0;
-    const float3 edge2 = tri.vertex2 - tri.vertex0;
-    const float3 h = cross(ray.D, edge2);
-    const float a = dot(edge1, h);
+    const float3 h = cross(ray.D, tri.edge2);
+    const float a = dot(tri.edge1, h);
     if (a > -0.0001f && a < 0.0001f) return; // ray parallel to triangle
     const float f = 1 / a;
     const float3 s = ray.O - tri.vertex0;
     const float u = f * dot(s, h);
     if (u < 0 || u > 1) return;
-    const float3 q = cross(s, edge1);
+    const float3 q = cross(s, tri.edge1);
     const float v = f * dot(ray.D, q);
     if (v < 0 || u + v > 1) return;
-    const float t = f * dot(edge2, q);
+    const float t = f * dot(tri.edge2, q);
     if (t > 0.0001f)
     {
         if (t < ray.t) ray.t = min(ray.t, t), ray.objIdx = tri.objIdx, ray.triIdx = triIdx, ray.barycentric = float2(u, v);
     }
 }
 
-void KDTree::IntersectKDTree(Ray& ray, KDTreeNode* node)
+int KDTree::GetTriangleCount() const
+{
+    return triangles.size();
+}
+
+#ifdef KD_ROPES
+// The ray walks from leaf to leaf without a stack: it leaves a cell through the face it reaches first
+// and descends from the node behind that face to the leaf where it enters, see KDRopeLeaf.
+void KDTree::Intersect(Ray& ray)
 {
     float tmin, tmax;
-    if (node == nullptr) return;
-    ray.traversed++;
-    if (!IntersectAABB(ray, node->aabbMin, node->aabbMax, tmin, tmax)) return;
-    if (node->isLeaf)
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return;
+    float3 entry = ray.O + ray.D * max(tmin, 0.0f);
+    uint nodeIdx = rootNodeIdx;
+    while (1)
     {
-        uint triCount = node->triIndices.size();
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        ray.traversed++;
+        if (!node.isLeaf())
+        {
+            nodeIdx = DescendKDRope(node, nodeIdx, entry, ray.D);
+            continue;
+        }
+        const KDRopeLeaf& leaf = ropeLeaves[node.first];
+        const uint triCount = node.triCount();
         for (uint i = 0; i < triCount; i++)
         {
-            uint triIdx = node->triIndices[i];
-            IntersectTri(ray, triangles[triIdx], triIdx);
-            ray.tested++;
+            uint triIdx = triIndices[leaf.first + i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
         }
-        return;
+        ray.tested += triCount;
+        uint face;
+        const float tExit = ExitKDLeaf(leaf, ray, face, entry);
+        // a hit inside the cell is in front of all the cells after it
+        if (ray.t <= tExit || leaf.rope[face] == 0) return;
+        nodeIdx = leaf.rope[face];
     }
+}
 
-    int axis = node->splitAxis;
-    float splitPos = node->aabbMin[node->splitAxis] + node->splitDistance;
-    float t = (splitPos - ray.O[axis]) / ray.D[axis];
-
-    if (ray.D[axis] > 0)
+bool KDTree::IsOccluded(const Ray& ray)
+{
+    Ray shadow = Ray(ray);
+    float tmin, tmax;
+    if (!IntersectAABB(shadow, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return false;
+    float3 entry = shadow.O + shadow.D * max(tmin, 0.0f);
+    uint nodeIdx = rootNodeIdx;
+    while (1)
     {
-        // t <= tmin, only the right node is intersected
-        if (t < tmin + 0.001)
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        if (!node.isLeaf())
         {
-            IntersectKDTree(ray, node->right);
+            nodeIdx = DescendKDRope(node, nodeIdx, entry, shadow.D);
+            continue;
         }
-        // t >= tmax, only the left node is intersected
-        else if (t > tmax - 0.001)
+        const KDRopeLeaf& leaf = ropeLeaves[node.first];
+        for (uint i = 0; i < node.triCount(); i++)
         {
-            IntersectKDTree(ray, node->left);
-        }
-        else
-        {
-            IntersectKDTree(ray, node->left);
-            if (ray.t < t) return;
-            IntersectKDTree(ray, node->right);
+            uint triIdx = triIndices[leaf.first + i];
+            IntersectTri(shadow, triAccel[triIdx], triIdx);
+            if (shadow.t < ray.t) return true;
         }
+        uint face;
+        const float tExit = ExitKDLeaf(leaf, shadow, face, entry);
+        if (tExit >= ray.t || leaf.rope[face] == 0) return false;
+        nodeIdx = leaf.rope[face];
     }
-    else
+}
+#else
+void KDTree::Intersect(Ray& ray)
+{
+    float tmin, tmax;
+    if (!IntersectAABB(ray, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return;
+    tmin = max(tmin, 0.0f);
+    KDTraversalEntry stack[KD_STACK_SIZE];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
     {
-        // t <= tmin, only the left node is intersected
-        if (t < tmin + 0.001)
-        {
-            IntersectKDTree(ray, node->left);
-        }
-        // t >= tmax, only the left node is intersected
-        else if (t > tmax - 0.001)
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        ray.traversed++;
+        if (!node.isLeaf())
         {
-            IntersectKDTree(ray, node->right);
+            DescendKDTree(node, nodeIdx, ray, tmin, tmax, stack, stackPtr);
+            continue;
         }
-        else
+        const uint triCount = node.triCount();
+        for (uint i = 0; i < triCount; i++)
         {
-            IntersectKDTree(ray, node->right);
-            if (ray.t < t) return;
-            IntersectKDTree(ray, node->left);
+            uint triIdx = triIndices[node.first + i];
+            IntersectTri(ray, triAccel[triIdx], triIdx);
         }
+        ray.tested += triCount;
+        if (stackPtr == 0) return;
+        // a hit in front of the next cell is in front of all the cells left on the stack
+        const KDTraversalEntry& entry = stack[--stackPtr];
+        if (ray.t < entry.tmin) return;
+        nodeIdx = entry.nodeIdx, tmin = entry.tmin, tmax = entry.tmax;
     }
 }
 
-int KDTree::GetTriangleCount() const
-{
-    return triangles.size();
-}
-
-void KDTree::Intersect(Ray& ray)
+// Any hit below ray.t occludes, so the first leaf with a hit ends the search.
+bool KDTree::IsOccluded(const Ray& ray)
 {
-    IntersectKDTree(ray, rootNode);
+    Ray shadow = Ray(ray);
+    float tmin, tmax;
+    if (!IntersectAABB(shadow, localBounds.bmin3, localBounds.bmax3, tmin, tmax)) return false;
+    tmin = max(tmin, 0.0f);
+    KDTraversalEntry stack[KD_STACK_SIZE];
+    uint stackPtr = 0, nodeIdx = rootNodeIdx;
+    while (1)
+    {
+        const KDTreeNode& node = kdNodes[nodeIdx];
+        if (!node.isLeaf())
+        {
+            DescendKDTree(node, nodeIdx, shadow, tmin, tmax, stack, stackPtr);
+            continue;
+        }
+        for (uint i = 0; i < node.triCount(); i++)
+        {
+            uint triIdx = triIndices[node.first + i];
+            IntersectTri(shadow, triAccel[triIdx], triIdx);
+            if (shadow.t < ray.t) return true;
+        }
+        if (stackPtr == 0) return false;
+        const KDTraversalEntry& entry = stack[--stackPtr];
+        nodeIdx = entry.nodeIdx, tmin = entry.tmin, tmax = entry.tmax;
+    }
 }
+#endif
 
 float3 KDTree::GetNormal(const uint triIdx, const float2 barycentric) const
 {
@@ -14,22 +14,26 @@ namespace Tmpl8
 	{
 	private:
 		void UpdateBounds();
-		void Subdivide(KDTreeNode* node, int depth);
+		void Subdivide(const uint nodeIdx, std::vector<uint>& triIdx, const aabb& bounds, int depth);
+		void MakeLeaf(const uint nodeIdx, const std::vector<uint>& triIdx);
 		bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax, float& tmin, float& tmax);
-		void IntersectTri(Ray& ray, const Tri& tri, const uint triIdx);
-		void IntersectKDTree(Ray& ray, KDTreeNode* node);
+		void IntersectTri(Ray& ray, const TriAccel& tri, const uint triIdx);
 	public:
 		KDTree() = default;
 		void Build();
 		void Intersect(Ray& ray);
+		bool IsOccluded(const Ray& ray);
 		float3 GetNormal(const uint triIdx, const float2 barycentric) const;
 		float2 GetUV(const uint triIdx, const float2 barycentric) const;
 		int GetTriangleCount() const;
 	private:
 		int m_maxBuildDepth = 20;
 	public:
-		KDTreeNode* rootNode;
+		std::vector<KDTreeNode> kdNodes; // depth first, see KDTreeNode
+		std::vector<uint> triIndices; // the triangles of the leaves, one range per leaf
+		std::vector<KDRopeLeaf> ropeLeaves; // empty without KD_ROPES
 		std::vector<Tri> triangles;
+		std::vector<TriAccel> triAccel; // hot copy of the triangles for intersection
 		std::vector<aabb> triangleBounds;
 		uint rootNodeIdx = 0, nodesUsed = 1;
 		aabb localBounds;
@@ -0,0 +1,230 @@
+#pragma once
+
+#define RAY_PACKETS // primary rays are traced as square packets through BVH, BLASBVH and TLASBVH
+#define RAY_PACKET_WIDTH 4 // 2 for 2x2 packets, 4 for 4x4 packets
+#define RAY_PACKET_SIZE (RAY_PACKET_WIDTH * RAY_PACKET_WIDTH)
+#define RAY_PACKET_GROUPS (RAY_PACKET_SIZE / 4) // SSE lane groups of four rays
+
+// reference: Large Ray Packets for Real-time Whitted Ray Tracing by Ryan Overbeck, Ravi Ramamoorthi and William R. Mark
+// reference: Ray Tracing Deformable Scenes using Dynamic Bounding Volume Hierarchies by Ingo Wald, Solomon Boulos and Peter Shirley
+
+// The rays of a packet are stored per component, four rays per SSE register. A packet enters a node
+// with the index of its first active ray; the rays before it are known to miss the node. A child is
+// tested against that ray first, then against the interval bounds of the whole packet, and only then
+// ray by ray, so a coherent packet mostly pays for a single slab test per node.
+
+namespace Tmpl8
+{
+	struct ALIGN(64) RayPacket
+	{
+		union { __m128 ox4[RAY_PACKET_GROUPS]; float ox[RAY_PACKET_SIZE]; };
+		union { __m128 oy4[RAY_PACKET_GROUPS]; float oy[RAY_PACKET_SIZE]; };
+		union { __m128 oz4[RAY_PACKET_GROUPS]; float oz[RAY_PACKET_SIZE]; };
+		union { __m128 dx4[RAY_PACKET_GROUPS]; float dx[RAY_PACKET_SIZE]; };
+		union { __m128 dy4[RAY_PACKET_GROUPS]; float dy[RAY_PACKET_SIZE]; };
+		union { __m128 dz4[RAY_PACKET_GROUPS]; float dz[RAY_PACKET_SIZE]; };
+		union { __m128 rdx4[RAY_PACKET_GROUPS]; float rdx[RAY_PACKET_SIZE]; };
+		union { __m128 rdy4[RAY_PACKET_GROUPS]; float rdy[RAY_PACKET_SIZE]; };
+		union { __m128 rdz4[RAY_PACKET_GROUPS]; float rdz[RAY_PACKET_SIZE]; };
+		union { __m128 t4[RAY_PACKET_GROUPS]; float t[RAY_PACKET_SIZE]; };
+		union { __m128 u4[RAY_PACKET_GROUPS]; float u[RAY_PACKET_SIZE]; };
+		union { __m128 v4[RAY_PACKET_GROUPS]; float v[RAY_PACKET_SIZE]; };
+		int objIdx[RAY_PACKET_SIZE], triIdx[RAY_PACKET_SIZE];
+		float3 oMin, oMax, rdMin, rdMax; // interval bounds of the packet
+		bool coherent = false; // the reciprocal directions agree in sign per axis, required by the interval test
+		int traversed = 0, tested = 0;
+
+		// gathers RAY_PACKET_SIZE rays; their t is the distance to search and their hit is kept if nothing is closer
+		void Load(const Ray* rays)
+		{
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			{
+				const Ray& ray = rays[i];
+				ox[i] = ray.O.x, oy[i] = ray.O.y, oz[i] = ray.O.z;
+				dx[i] = ray.D.x, dy[i] = ray.D.y, dz[i] = ray.D.z;
+				rdx[i] = ray.rD.x, rdy[i] = ray.rD.y, rdz[i] = ray.rD.z;
+				t[i] = ray.t, u[i] = ray.barycentric.x, v[i] = ray.barycentric.y;
+				objIdx[i] = ray.objIdx, triIdx[i] = ray.triIdx;
+			}
+			traversed = tested = 0;
+			UpdateBounds();
+		}
+
+		// writes the hits back; every ray is charged the traversal steps of the whole packet
+		void Store(Ray* rays) const
+		{
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			{
+				Ray& ray = rays[i];
+				ray.t = t[i], ray.barycentric = float2(u[i], v[i]);
+				ray.objIdx = objIdx[i], ray.triIdx = triIdx[i];
+				ray.traversed += traversed, ray.tested += tested;
+			}
+		}
+
+		// the packet in the space of an instance; t carries over, it is the same ray parameter in both spaces
+		void Transform(const RayPacket& packet, const mat4& M)
+		{
+			const __m128 m0 = _mm_set1_ps(M.cell[0]), m1 = _mm_set1_ps(M.cell[1]), m2 = _mm_set1_ps(M.cell[2]), m3 = _mm_set1_ps(M.cell[3]);
+			const __m128 m4 = _mm_set1_ps(M.cell[4]), m5 = _mm_set1_ps(M.cell[5]), m6 = _mm_set1_ps(M.cell[6]), m7 = _mm_set1_ps(M.cell[7]);
+			const __m128 m8 = _mm_set1_ps(M.cell[8]), m9 = _mm_set1_ps(M.cell[9]), m10 = _mm_set1_ps(M.cell[10]), m11 = _mm_set1_ps(M.cell[11]);
+			const __m128 one = _mm_set1_ps(1);
+			for (int g = 0; g < RAY_PACKET_GROUPS; g++)
+			{
+				const __m128 x = packet.ox4[g], y = packet.oy4[g], z = packet.oz4[g];
+				ox4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m1, y)), _mm_add_ps(_mm_mul_ps(m2, z), m3));
+				oy4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m4, x), _mm_mul_ps(m5, y)), _mm_add_ps(_mm_mul_ps(m6, z), m7));
+				oz4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m8, x), _mm_mul_ps(m9, y)), _mm_add_ps(_mm_mul_ps(m10, z), m11));
+				const __m128 a = packet.dx4[g], b = packet.dy4[g], c = packet.dz4[g];
+				dx4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, a), _mm_mul_ps(m1, b)), _mm_mul_ps(m2, c));
+				dy4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m4, a), _mm_mul_ps(m5, b)), _mm_mul_ps(m6, c));
+				dz4[g] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m8, a), _mm_mul_ps(m9, b)), _mm_mul_ps(m10, c));
+				rdx4[g] = _mm_div_ps(one, dx4[g]), rdy4[g] = _mm_div_ps(one, dy4[g]), rdz4[g] = _mm_div_ps(one, dz4[g]);
+			}
+			CopyHits(packet);
+			UpdateBounds();
+		}
+
+		void CopyHits(const RayPacket& packet)
+		{
+			memcpy(t, packet.t, sizeof(t)), memcpy(u, packet.u, sizeof(u)), memcpy(v, packet.v, sizeof(v));
+			memcpy(objIdx, packet.objIdx, sizeof(objIdx)), memcpy(triIdx, packet.triIdx, sizeof(triIdx));
+			traversed = packet.traversed, tested = packet.tested;
+		}
+
+		// takes the hits of an instance-space copy of this packet, which belong to instance objIdx,
+		// or to the object at that offset from it for an instance of a nested TLAS
+		void CopyHits(const RayPacket& packet, const int idx, const bool offset = false)
+		{
+			for (int i = 0; i < RAY_PACKET_SIZE; i++) if (packet.t[i] < t[i])
+			{
+				t[i] = packet.t[i], u[i] = packet.u[i], v[i] = packet.v[i];
+				objIdx[i] = offset ? idx + packet.objIdx[i] : idx, triIdx[i] = packet.triIdx[i];
+			}
+			traversed = packet.traversed, tested = packet.tested;
+		}
+
+		void UpdateBounds()
+		{
+			oMin = oMax = float3(ox[0], oy[0], oz[0]);
+			rdMin = rdMax = float3(rdx[0], rdy[0], rdz[0]);
+			for (int i = 1; i < RAY_PACKET_SIZE; i++)
+			{
+				const float3 O(ox[i], oy[i], oz[i]), rD(rdx[i], rdy[i], rdz[i]);
+				oMin = fminf(oMin, O), oMax = fmaxf(oMax, O);
+				rdMin = fminf(rdMin, rD), rdMax = fmaxf(rdMax, rD);
+			}
+			// axis-parallel rays have infinite reciprocals, which the interval test cannot handle either
+			coherent = (rdMin.x > 0 || rdMax.x < 0) && (rdMin.y > 0 || rdMax.y < 0) && (rdMin.z > 0 || rdMax.z < 0) &&
+				fmaxf(rdMax, -rdMin).x < 1e30f && fmaxf(rdMax, -rdMin).y < 1e30f && fmaxf(rdMax, -rdMin).z < 1e30f;
+		}
+	};
+
+	struct RayPacketStackEntry { uint node, first; };
+
+	// interval of (plane - [omin, omax]) * [rdmin, rdmax]
+	inline void PacketSlabInterval(const float plane, const float omin, const float omax, const float rdmin, const float rdmax, float& lo, float& hi)
+	{
+		const float a = (plane - omax) * rdmin, b = (plane - omax) * rdmax;
+		const float c = (plane - omin) * rdmin, d = (plane - omin) * rdmax;
+		lo = min(min(a, b), min(c, d)), hi = max(max(a, b), max(c, d));
+	}
+
+	// returns the first ray from `first` on that hits the box, with its entry distance, or RAY_PACKET_SIZE
+	inline uint IntersectPacketAABB(const RayPacket& p, const uint first, const float3& bmin, const float3& bmax, float& dist)
+	{
+		// first-hit test: the active ray that hit the parent is likely to hit the child too
+		{
+			float tx1 = (bmin.x - p.ox[first]) * p.rdx[first], tx2 = (bmax.x - p.ox[first]) * p.rdx[first];
+			float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+			float ty1 = (bmin.y - p.oy[first]) * p.rdy[first], ty2 = (bmax.y - p.oy[first]) * p.rdy[first];
+			tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+			float tz1 = (bmin.z - p.oz[first]) * p.rdz[first], tz2 = (bmax.z - p.oz[first]) * p.rdz[first];
+			tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+			if (tmax >= tmin && tmin < p.t[first] && tmax > 0) { dist = tmin; return first; }
+		}
+		// interval test: no ray hits the box if even the bounds of all origins and directions miss it
+		if (p.coherent)
+		{
+			float enterLo[3], enterHi[3], exitLo[3], exitHi[3];
+			PacketSlabInterval(p.rdMin.x > 0 ? bmin.x : bmax.x, p.oMin.x, p.oMax.x, p.rdMin.x, p.rdMax.x, enterLo[0], enterHi[0]);
+			PacketSlabInterval(p.rdMin.y > 0 ? bmin.y : bmax.y, p.oMin.y, p.oMax.y, p.rdMin.y, p.rdMax.y, enterLo[1], enterHi[1]);
+			PacketSlabInterval(p.rdMin.z > 0 ? bmin.z : bmax.z, p.oMin.z, p.oMax.z, p.rdMin.z, p.rdMax.z, enterLo[2], enterHi[2]);
+			PacketSlabInterval(p.rdMin.x > 0 ? bmax.x : bmin.x, p.oMin.x, p.oMax.x, p.rdMin.x, p.rdMax.x, exitLo[0], exitHi[0]);
+			PacketSlabInterval(p.rdMin.y > 0 ? bmax.y : bmin.y, p.oMin.y, p.oMax.y, p.rdMin.y, p.rdMax.y, exitLo[1], exitHi[1]);
+			PacketSlabInterval(p.rdMin.z > 0 ? bmax.z : bmin.z, p.oMin.z, p.oMax.z, p.rdMin.z, p.rdMax.z, exitLo[2], exitHi[2]);
+			const float tEnter = max(enterLo[0], max(enterLo[1], enterLo[2]));
+			const float tExit = min(exitHi[0], min(exitHi[1], exitHi[2]));
+			__m128 tmax4 = p.t4[0];
+			for (int g = 1; g < RAY_PACKET_GROUPS; g++) tmax4 = _mm_max_ps(tmax4, p.t4[g]);
+			tmax4 = _mm_max_ps(tmax4, _mm_shuffle_ps(tmax4, tmax4, _MM_SHUFFLE(1, 0, 3, 2)));
+			tmax4 = _mm_max_ps(tmax4, _mm_shuffle_ps(tmax4, tmax4, _MM_SHUFFLE(2, 3, 0, 1)));
+			if (tEnter > tExit || tExit <= 0 || tEnter >= _mm_cvtss_f32(tmax4)) return RAY_PACKET_SIZE;
+		}
+		// the remaining rays, four at a time
+		for (uint g = (first + 1) / 4; g < RAY_PACKET_GROUPS; g++)
+		{
+			const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.x), p.ox4[g]), p.rdx4[g]);
+			const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.x), p.ox4[g]), p.rdx4[g]);
+			const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.y), p.oy4[g]), p.rdy4[g]);
+			const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.y), p.oy4[g]), p.rdy4[g]);
+			const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.z), p.oz4[g]), p.rdz4[g]);
+			const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.z), p.oz4[g]), p.rdz4[g]);
+			union { __m128 tmin4; float tmin[4]; };
+			tmin4 = _mm_max_ps(_mm_min_ps(tx1, tx2), _mm_max_ps(_mm_min_ps(ty1, ty2), _mm_min_ps(tz1, tz2)));
+			const __m128 tmax4 = _mm_min_ps(_mm_max_ps(tx1, tx2), _mm_min_ps(_mm_max_ps(ty1, ty2), _mm_max_ps(tz1, tz2)));
+			int mask = _mm_movemask_ps(_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax4, tmin4), _mm_cmplt_ps(tmin4, p.t4[g])),
+				_mm_cmpgt_ps(tmax4, _mm_setzero_ps())));
+			// lanes up to `first` were tested above or miss the parent
+			const int skip = (int)(first + 1) - (int)(g * 4);
+			if (skip > 0) mask &= ~((1 << skip) - 1);
+			if (!mask) continue;
+			int lane = 0;
+			while (!(mask & 1)) mask >>= 1, lane++;
+			dist = tmin[lane];
+			return g * 4 + lane;
+		}
+		return RAY_PACKET_SIZE;
+	}
+
+	// Moller-Trumbore of one triangle against the rays from `first` on, four at a time
+	inline void IntersectPacketTri(RayPacket& p, const TriAccel& tri, const uint first, const int objIdx, const int triIdx)
+	{
+		const __m128 e1x = _mm_set1_ps(tri.edge1.x), e1y = _mm_set1_ps(tri.edge1.y), e1z = _mm_set1_ps(tri.edge1.z);
+		const __m128 e2x = _mm_set1_ps(tri.edge2.x), e2y = _mm_set1_ps(tri.edge2.y), e2z = _mm_set1_ps(tri.edge2.z);
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1), eps = _mm_set1_ps(0.0001f);
+		for (uint g = first / 4; g < RAY_PACKET_GROUPS; g++)
+		{
+			const __m128 dx = p.dx4[g], dy = p.dy4[g], dz = p.dz4[g];
+			// h = cross(D, edge2)
+			const __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			const __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			const __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+			const __m128 f = _mm_div_ps(one, a);
+			// s = O - vertex0
+			const __m128 sx = _mm_sub_ps(p.ox4[g], _mm_set1_ps(tri.vertex0.x));
+			const __m128 sy = _mm_sub_ps(p.oy4[g], _mm_set1_ps(tri.vertex0.y));
+			const __m128 sz = _mm_sub_ps(p.oz4[g], _mm_set1_ps(tri.vertex0.z));
+			const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+			// q = cross(s, edge1)
+			const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+			const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+			const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+			const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+			const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+			// the same rejection tests as the scalar code
+			__m128 hit = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), a), eps);
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, p.t4[g])));
+			int mask = _mm_movemask_ps(hit);
+			if (!mask) continue;
+			p.t4[g] = _mm_blendv_ps(p.t4[g], t, hit);
+			p.u4[g] = _mm_blendv_ps(p.u4[g], u, hit);
+			p.v4[g] = _mm_blendv_ps(p.v4[g], v, hit);
+			for (int lane = 0; mask; lane++, mask >>= 1)
+				if (mask & 1) p.objIdx[g * 4 + lane] = objIdx, p.triIdx[g * 4 + lane] = triIdx;
+		}
+	}
+}
\ No newline at end of file
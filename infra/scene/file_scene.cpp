@@ -174,14 +174,27 @@ void FileScene::FindNearest(Ray& ray)
 	acc.Intersect(ray);
 }
 
+// RAY_PACKET_SIZE coherent rays, such as a square of camera rays; the BVH and the BVH4 trace them as
+// one packet, the grid and the kd-tree have no packet traversal and trace them one by one
+void FileScene::FindNearestPacket(Ray* rays)
+{
+	for (int i = 0; i < RAY_PACKET_SIZE; i++) light.Intersect(rays[i]), floor.Intersect(rays[i]);
+#if defined(USE_BVH) || defined(USE_BVH4)
+	RayPacket packet;
+	packet.Load(rays);
+	acc.IntersectPacket(packet);
+	packet.Store(rays);
+#else
+	for (int i = 0; i < RAY_PACKET_SIZE; i++) acc.Intersect(rays[i]);
+#endif
+}
+
 bool FileScene::IsOccluded(const Ray& ray)
 {
 	// from tmpl8rt_IGAD
 	if (light.IsOccluded(ray)) return true;
-	Ray shadow = Ray(ray);
-	shadow.t = 1e34f;
-	acc.Intersect(shadow);
-	if (shadow.objIdx > -1) return true;
+	// any-hit query up to ray.t, geometry behind the light does not count
+	if (acc.IsOccluded(ray)) return true;
 	// skip planes
 	return false;
 }
@@ -234,9 +247,17 @@ std::chrono::microseconds FileScene::GetBuildTime() const
 	return acc.buildTime;
 }
 
+std::chrono::microseconds FileScene::GetSerialBuildTime() const
+{
+#if defined(USE_BVH) || defined(USE_BVH4)
+	return acc.serialBuildTime;
+#endif
+	return std::chrono::microseconds(0);
+}
+
 uint FileScene::GetMaxTreeDepth() const
 {
-#ifdef USE_BVH
+#if defined(USE_BVH) || defined(USE_BVH4)
 	return acc.maxDepth;
 #endif
 #ifdef USE_KDTree
@@ -2,12 +2,14 @@
 
 #include "base_scene.h"
 #include "bvh.h"
+#include "bvh4.h"
 #include "grid.h"
 #include "model.h"
 #include "kdtree.h"
 #include "rapidxml.hpp"
 
 //#define USE_BVH
+//#define USE_BVH4 // BVH collapsed into 4-wide nodes, SSE child tests
 //#define USE_Grid
 #define USE_KDTree
 
@@ -25,17 +27,22 @@ namespace Tmpl8
 		float3 GetLightPos() const;
 		float3 GetLightColor() const;
 		void FindNearest(Ray& ray);
+		void FindNearestPacket(Ray* rays);
 		bool IsOccluded(const Ray& ray);
 		float3 GetAlbedo(int objIdx, float3 I) const;
 		HitInfo GetHitInfo(const Ray& ray, const float3 I);
 		int GetTriangleCount() const;
 		std::chrono::microseconds GetBuildTime() const;
+		std::chrono::microseconds GetSerialBuildTime() const;
 		uint GetMaxTreeDepth() const;
 	public:
 		float animTime = 0;
 #ifdef USE_BVH
 		BVH acc;
 #endif
+#ifdef USE_BVH4
+		BVH4 acc;
+#endif
 #ifdef USE_Grid
 		Grid acc;
 #endif
@@ -3,6 +3,7 @@
 
 TLASFileScene::TLASFileScene(const string& filePath)
 {
+	auto startTime = std::chrono::high_resolution_clock::now();
 	errorMaterial.albedo = float3(255, 192, 203) / 255.f;
 
 	SceneData sceneData = LoadSceneFile(filePath);
@@ -22,6 +23,7 @@ TLASFileScene::TLASFileScene(const string& filePath)
 	skydome = Texture(sceneData.skydomeLocation);
 
 	objCount = sceneData.objects.size();
+	objects = sceneData.objects;
 
 	materialCount = sceneData.materials.size();
 
@@ -37,59 +39,277 @@ TLASFileScene::TLASFileScene(const string& filePath)
 			materials[i]->textureDiffuse = std::make_unique<Texture>(sceneData.materials[i].textureLocation);
 	}
 
-#ifdef TLAS_USE_BVH
-	std::vector<BLASBVH*> blas;
-	blas.resize(objCount);
-	for (int i = 0; i < objCount; i++)
+	// one BLAS per distinct model and structure, shared by the instances of all objects that use it
+#ifdef TLAS_MIXED
+	std::unordered_map<std::string, BLASBVH*> bvhMeshes;
+	std::unordered_map<std::string, BLASBVH4*> bvh4Meshes;
+	std::unordered_map<std::string, BLASGrid*> gridMeshes;
+	std::unordered_map<std::string, BLASKDTree*> kdtreeMeshes;
+	// the tuned structure of a model and its BVH builder, as the winner may be a BVH built with LBVH
+	std::unordered_map<std::string, std::pair<BLASType, BVHBuilder>> tunedModels;
+	// takes over the winner TuneBLAS built, unless the model already has a BLAS of that structure
+	auto adopt = [](auto& meshes, const std::string& model, auto* built)
 	{
-		ObjectData& objectData = sceneData.objects[i];
-		mat4 T = mat4::Translate(objectData.position)
-			* mat4::RotateX(objectData.rotation.x * Deg2Red)
-			* mat4::RotateY(objectData.rotation.y * Deg2Red)
-			* mat4::RotateZ(objectData.rotation.z * Deg2Red);
-		mat4 S = mat4::Scale(objectData.scale);
-		blas[i] = new BLASBVH(objIdUsed, objectData.modelLocation, T, S);
-		blas[i]->matIdx = objectData.materialIdx;
-		objIdUsed++;
+		if (!built) return;
+		auto& mesh = meshes[model];
+		if (mesh) delete built;
+		else mesh = built;
+	};
+	// adds an instance of the model of an object in the structure it asks for, and returns that structure
+	// and the index of the instance among those of its kind; only a BVH can deform
+	auto addInstance = [&](TLASInstanceLists& lists, const ObjectData& objectData, const int objIdx, const mat4& T, const bool deforming, uint& index)
+	{
+		const std::string& model = objectData.modelLocation;
+		int structure = deforming ? BLAS_TYPE_BVH : objectData.structure < 0 ? TLAS_DEFAULT_STRUCTURE : objectData.structure;
+		BVHBuildSettings settings = objectData.buildSettings;
+		if (structure == TLAS_STRUCTURE_AUTO)
+		{
+			auto tuned = tunedModels.find(model);
+			if (tuned == tunedModels.end())
+			{
+				tunings.push_back(TuneBLAS(model, settings));
+				BLASTuning& tuning = tunings.back();
+				adopt(bvhMeshes, model, tuning.bvh), adopt(bvh4Meshes, model, tuning.bvh4);
+				adopt(gridMeshes, model, tuning.grid), adopt(kdtreeMeshes, model, tuning.kdtree);
+				tuning.bvh = 0, tuning.bvh4 = 0, tuning.grid = 0, tuning.kdtree = 0;
+				const BVHBuilder builder = tuning.best == BLAS_CANDIDATE_BVH_LBVH ? BVH_BUILDER_LBVH : BVH_BUILDER_SAH;
+				tuned = tunedModels.insert({ model, { GetCandidateType(tuning.best), builder } }).first;
+			}
+			structure = tuned->second.first, settings.builder = tuned->second.second;
+		}
+		switch (structure)
+		{
+		case BLAS_TYPE_BVH4:
+		{
+			BLASBVH4*& mesh = bvh4Meshes[model];
+			if (!mesh) mesh = new BLASBVH4(objIdx, model, settings);
+			index = lists.bvh4.size(), lists.bvh4.push_back(BLASInstance<BLASBVH4>(mesh, objIdx, objectData.materialIdx, T));
+			return BLAS_TYPE_BVH4;
+		}
+		case BLAS_TYPE_GRID:
+		{
+			BLASGrid*& mesh = gridMeshes[model];
+			if (!mesh) mesh = new BLASGrid(objIdx, model);
+			index = lists.grid.size(), lists.grid.push_back(BLASInstance<BLASGrid>(mesh, objIdx, objectData.materialIdx, T));
+			return BLAS_TYPE_GRID;
+		}
+		case BLAS_TYPE_KDTREE:
+		{
+			BLASKDTree*& mesh = kdtreeMeshes[model];
+			if (!mesh) mesh = new BLASKDTree(objIdx, model);
+			index = lists.kdtree.size(), lists.kdtree.push_back(BLASInstance<BLASKDTree>(mesh, objIdx, objectData.materialIdx, T));
+			return BLAS_TYPE_KDTREE;
+		}
+		default:
+		{
+			// a deforming mesh gets a BLAS of its own, as its instances would all follow the wave
+			BLASBVH* mesh = deforming ? 0 : bvhMeshes[model];
+			if (!mesh) mesh = new BLASBVH(objIdx, model, settings);
+			if (deforming) deformedMeshes.push_back(mesh);
+			else bvhMeshes[model] = mesh;
+			index = lists.bvh.size(), lists.bvh.push_back(BLASInstance<BLASBVH>(mesh, objIdx, objectData.materialIdx, T));
+			return BLAS_TYPE_BVH;
+		}
+		}
+	};
+	// every group becomes a TLAS of its own, instanced by the objects that place it
+	for (const GroupData& group : sceneData.groups)
+	{
+		TLASInstanceLists lists;
+		int objIdx = 0;
+		for (const ObjectData& objectData : group.objects)
+		{
+			const mat4 T = GetObjectTransform(objectData, 0);
+			if (objectData.groupIdx >= 0)
+			{
+				lists.nested.push_back(BLASInstance<TLASBVH>(groupTLAS[objectData.groupIdx], objIdx, -1, T));
+				objIdx += groupTLAS[objectData.groupIdx]->objectCount;
+				continue;
+			}
+			uint index;
+			addInstance(lists, objectData, objIdx++, T, false, index);
+		}
+		groupTLAS.push_back(new TLASBVH(lists));
 	}
-	tlas = TLASBVH(blas);
-#endif // TLAS_USE_BVH
-#ifdef TLAS_USE_Grid
-	std::vector<BLASGrid*> blas;
-	blas.resize(objCount);
+	TLASInstanceLists lists;
+	std::vector<BLASType> instanceTypes;
 	for (int i = 0; i < objCount; i++)
 	{
 		ObjectData& objectData = sceneData.objects[i];
-		mat4 T = mat4::Translate(objectData.position)
-			* mat4::RotateX(objectData.rotation.x * Deg2Red)
-			* mat4::RotateY(objectData.rotation.y * Deg2Red)
-			* mat4::RotateZ(objectData.rotation.z * Deg2Red);
-		mat4 S = mat4::Scale(objectData.scale);
-		blas[i] = new BLASGrid(objIdUsed, objectData.modelLocation, T, S);
-		blas[i]->matIdx = objectData.materialIdx;
+		if (objectData.groupIdx >= 0)
+		{
+			objectInstances.push_back({ (uint)i, (uint)lists.nested.size(), mat4::Identity() });
+			instanceTypes.push_back(BLAS_TYPE_TLAS);
+			lists.nested.push_back(BLASInstance<TLASBVH>(groupTLAS[objectData.groupIdx], objIdUsed, -1, GetObjectTransform(objectData, 0)));
+			objIdUsed += groupTLAS[objectData.groupIdx]->objectCount;
+			continue;
+		}
+		const bool deforming = objectData.wave.amplitude != 0;
+		if (deforming) deformedInstances.push_back(objectInstances.size());
+		uint index;
+		instanceTypes.push_back(addInstance(lists, objectData, objIdUsed, GetObjectTransform(objectData, 0), deforming, index));
+		objectInstances.push_back({ (uint)i, index, mat4::Identity() });
 		objIdUsed++;
 	}
-	tlas = TLASGrid(blas);
-#endif // TLAS_USE_Grid
-#ifdef TLAS_USE_KDTree
-	std::vector<BLASKDTree*> blas;
-	blas.resize(objCount);
+	tlas = TLASBVH(lists);
+	// the TLAS numbers the instances of each kind in turn
+	for (uint i = 0; i < objectInstances.size(); i++)
+		objectInstances[i].instanceIdx = tlas.GetInstanceIdx(instanceTypes[i], objectInstances[i].instanceIdx);
+#endif // TLAS_MIXED
+#ifdef TLAS_USE_BVH4
+	// TLASBVH4 cannot nest: a group is expanded into its objects, each placed by the transforms of the
+	// groups it is in
+	std::vector<std::vector<std::pair<const ObjectData*, mat4>>> expanded(sceneData.groups.size());
+	for (uint g = 0; g < sceneData.groups.size(); g++) for (const ObjectData& objectData : sceneData.groups[g].objects)
+	{
+		const mat4 T = GetObjectTransform(objectData, 0);
+		if (objectData.groupIdx < 0) expanded[g].push_back({ &objectData, T });
+		else for (const auto& member : expanded[objectData.groupIdx]) expanded[g].push_back({ member.first, T * member.second });
+	}
+	std::unordered_map<std::string, BLASBVH4*> meshes;
+	std::vector<BLASInstance<BLASBVH4>> instances;
 	for (int i = 0; i < objCount; i++)
 	{
 		ObjectData& objectData = sceneData.objects[i];
-		mat4 T = mat4::Translate(objectData.position)
-			* mat4::RotateX(objectData.rotation.x * Deg2Red)
-			* mat4::RotateY(objectData.rotation.y * Deg2Red)
-			* mat4::RotateZ(objectData.rotation.z * Deg2Red);
-		mat4 S = mat4::Scale(objectData.scale);
-		blas[i] = new BLASKDTree(objIdUsed, objectData.modelLocation, T, S);
-		blas[i]->matIdx = objectData.materialIdx;
+		if (objectData.groupIdx >= 0)
+		{
+			for (const auto& member : expanded[objectData.groupIdx])
+			{
+				BLASBVH4*& mesh = meshes[member.first->modelLocation];
+				if (!mesh) mesh = new BLASBVH4(objIdUsed, member.first->modelLocation, member.first->buildSettings);
+				objectInstances.push_back({ (uint)i, (uint)instances.size(), member.second });
+				instances.push_back(BLASInstance<BLASBVH4>(mesh, objIdUsed++, member.first->materialIdx, GetObjectTransform(objectData, 0) * member.second));
+			}
+			continue;
+		}
+		// a deforming mesh gets a BLAS of its own, as its instances would all follow the wave
+		const bool deforming = objectData.wave.amplitude != 0;
+		BLASBVH4* mesh = deforming ? 0 : meshes[objectData.modelLocation];
+		if (!mesh) mesh = new BLASBVH4(objIdUsed, objectData.modelLocation, objectData.buildSettings);
+		if (deforming) deformedInstances.push_back(objectInstances.size()), deformedMeshes.push_back(mesh);
+		else meshes[objectData.modelLocation] = mesh;
+		objectInstances.push_back({ (uint)i, (uint)instances.size(), mat4::Identity() });
+		instances.push_back(BLASInstance<BLASBVH4>(mesh, objIdUsed, objectData.materialIdx, GetObjectTransform(objectData, 0)));
 		objIdUsed++;
 	}
-	tlas = TLASKDTree(blas);
-#endif // USE_KDTree
+	tlas = TLASBVH4(instances);
+#endif // TLAS_USE_BVH4
+	for (uint i = 0; i < objectInstances.size(); i++)
+		if (!objects[objectInstances[i].object].keyframes.empty()) animatedInstances.push_back(i);
 
 	SetTime(0);
+	auto endTime = std::chrono::high_resolution_clock::now();
+	loadTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+// places an object at time t: translation, rotation and scale, the scale applied first. Between two
+// keyframes, position, rotation and scale are interpolated linearly; the keyframes repeat after the last.
+mat4 TLASFileScene::GetObjectTransform(const ObjectData& objectData, const float t)
+{
+	float3 position = objectData.position, rotation = objectData.rotation, scale = objectData.scale;
+	const std::vector<Keyframe>& keyframes = objectData.keyframes;
+	if (!keyframes.empty())
+	{
+		const float duration = keyframes.back().time;
+		const float time = duration > 0 ? fmodf(t, duration) : 0;
+		uint k = 0;
+		while (k + 1 < keyframes.size() && keyframes[k + 1].time <= time) k++;
+		const Keyframe& a = keyframes[k];
+		const Keyframe& b = keyframes[min(k + 1, (uint)keyframes.size() - 1)];
+		const float f = b.time > a.time ? clamp((time - a.time) / (b.time - a.time), 0.0f, 1.0f) : 0;
+		position = lerp(a.position, b.position, f);
+		rotation = lerp(a.rotation, b.rotation, f);
+		scale = lerp(a.scale, b.scale, f);
+	}
+	return mat4::Translate(position)
+		* mat4::RotateX(rotation.x * Deg2Red)
+		* mat4::RotateY(rotation.y * Deg2Red)
+		* mat4::RotateZ(rotation.z * Deg2Red)
+		* mat4::Scale(scale);
+}
+
+// an <object> of the scene or of a group, placing a model or one of the groups defined before it
+static ObjectData LoadObject(rapidxml::xml_node<>* objNode, const std::vector<GroupData>& groups)
+{
+	ObjectData obj;
+	if (rapidxml::xml_node<>* groupNode = objNode->first_node("group_name"))
+	{
+		const std::string name = groupNode->value();
+		for (int g = 0; g < groups.size(); g++) if (groups[g].name == name) obj.groupIdx = g;
+		if (obj.groupIdx < 0) throw std::runtime_error("Unknown group " + name + ", a group must be defined before it is placed");
+	}
+	else
+	{
+		obj.modelLocation = objNode->first_node("model_location")->value();
+		obj.materialIdx = std::stoi(objNode->first_node("material_idx")->value());
+	}
+
+	for (rapidxml::xml_node<>* posNode = objNode->first_node("position")->first_node(); posNode; posNode = posNode->next_sibling()) 
+	{
+		int index = posNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
+		obj.position[index] = std::stof(posNode->value());
+	}
+
+	for (rapidxml::xml_node<>* rotNode = objNode->first_node("rotation")->first_node(); rotNode; rotNode = rotNode->next_sibling()) 
+	{
+		int index = rotNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
+		obj.rotation[index] = std::stof(rotNode->value());
+	}
+
+	for (rapidxml::xml_node<>* scaleNode = objNode->first_node("scale")->first_node(); scaleNode; scaleNode = scaleNode->next_sibling())
+	{
+		int index = scaleNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
+		obj.scale[index] = std::stof(scaleNode->value());
+	}
+
+	if (rapidxml::xml_node<>* builderNode = objNode->first_node("builder"))
+	{
+		std::string builder = builderNode->value();
+		if (builder == "lbvh") obj.buildSettings.builder = BVH_BUILDER_LBVH;
+		else if (builder == "hlbvh") obj.buildSettings.builder = BVH_BUILDER_HLBVH;
+	}
+	if (rapidxml::xml_node<>* structureNode = objNode->first_node("structure"))
+	{
+		std::string structure = structureNode->value();
+		if (structure == "bvh") obj.structure = BLAS_TYPE_BVH;
+		else if (structure == "bvh4") obj.structure = BLAS_TYPE_BVH4;
+		else if (structure == "grid") obj.structure = BLAS_TYPE_GRID;
+		else if (structure == "kdtree") obj.structure = BLAS_TYPE_KDTREE;
+		else if (structure == "auto") obj.structure = TLAS_STRUCTURE_AUTO;
+	}
+	if (rapidxml::xml_node<>* iterationsNode = objNode->first_node("optimize_iterations"))
+		obj.buildSettings.optimizeIterations = std::stoi(iterationsNode->value());
+	if (rapidxml::xml_node<>* budgetNode = objNode->first_node("optimize_ms"))
+		obj.buildSettings.optimizeBudget = std::stof(budgetNode->value());
+
+	// <keyframe> nodes with a <time> and optionally <position>, <rotation> and <scale>, in order of time;
+	// what a keyframe leaves out is taken from the object
+	if (rapidxml::xml_node<>* keyframesNode = objNode->first_node("keyframes"))
+	{
+		for (rapidxml::xml_node<>* keyNode = keyframesNode->first_node("keyframe"); keyNode; keyNode = keyNode->next_sibling("keyframe"))
+		{
+			Keyframe keyframe = { std::stof(keyNode->first_node("time")->value()), obj.position, obj.rotation, obj.scale };
+			float3* values[3] = { &keyframe.position, &keyframe.rotation, &keyframe.scale };
+			const char* names[3] = { "position", "rotation", "scale" };
+			for (int v = 0; v < 3; v++) if (rapidxml::xml_node<>* valueNode = keyNode->first_node(names[v]))
+			{
+				for (rapidxml::xml_node<>* axisNode = valueNode->first_node(); axisNode; axisNode = axisNode->next_sibling())
+				{
+					int index = axisNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
+					(*values[v])[index] = std::stof(axisNode->value());
+				}
+			}
+			obj.keyframes.push_back(keyframe);
+		}
+	}
+
+	if (rapidxml::xml_node<>* waveNode = objNode->first_node("wave"))
+	{
+		obj.wave.amplitude = std::stof(waveNode->first_node("amplitude")->value());
+		obj.wave.wavelength = std::stof(waveNode->first_node("wavelength")->value());
+		obj.wave.speed = std::stof(waveNode->first_node("speed")->value());
+	}
+	return obj;
 }
 
 SceneData TLASFileScene::LoadSceneFile(const string& filePath)
@@ -116,31 +336,32 @@ SceneData TLASFileScene::LoadSceneFile(const string& filePath)
 	sceneData.planeTextureLocation = root->first_node("plane_texture_location")->value();
 	sceneData.skydomeLocation = root->first_node("skydome_location")->value();
 
-	// Extract object information
-	for (rapidxml::xml_node<>* objNode = root->first_node("objects")->first_node("object"); objNode; objNode = objNode->next_sibling()) 
+	// Extract group information; groups are optional, and are defined before the objects that place them
+	if (rapidxml::xml_node<>* groupsNode = root->first_node("groups"))
 	{
-		ObjectData obj;
-		obj.modelLocation = objNode->first_node("model_location")->value();
-		obj.materialIdx = std::stoi(objNode->first_node("material_idx")->value());
-
-		for (rapidxml::xml_node<>* posNode = objNode->first_node("position")->first_node(); posNode; posNode = posNode->next_sibling()) 
+		for (rapidxml::xml_node<>* groupNode = groupsNode->first_node("group"); groupNode; groupNode = groupNode->next_sibling("group"))
 		{
-			int index = posNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
-			obj.position[index] = std::stof(posNode->value());
-		}
-
-		for (rapidxml::xml_node<>* rotNode = objNode->first_node("rotation")->first_node(); rotNode; rotNode = rotNode->next_sibling()) 
-		{
-			int index = rotNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
-			obj.rotation[index] = std::stof(rotNode->value());
-		}
-
-		for (rapidxml::xml_node<>* scaleNode = objNode->first_node("scale")->first_node(); scaleNode; scaleNode = scaleNode->next_sibling())
-		{
-			int index = scaleNode->name()[0] - 'x'; // 'x', 'y', 'z' map to 0, 1, 2
-			obj.scale[index] = std::stof(scaleNode->value());
+			GroupData group;
+			group.name = groupNode->first_node("name")->value();
+			for (rapidxml::xml_node<>* objNode = groupNode->first_node("objects")->first_node("object"); objNode; objNode = objNode->next_sibling())
+			{
+				// a group is built once into a TLAS of its own, which SetTime does not update
+				ObjectData obj = LoadObject(objNode, sceneData.groups);
+				if (!obj.keyframes.empty() || obj.wave.amplitude != 0)
+					throw std::runtime_error("Group " + group.name + " animates an object, <keyframes> and <wave> only work on the objects of the scene");
+				group.objects.push_back(obj);
+			}
+			sceneData.groups.push_back(group);
 		}
+	}
 
+	// Extract object information
+	for (rapidxml::xml_node<>* objNode = root->first_node("objects")->first_node("object"); objNode; objNode = objNode->next_sibling()) 
+	{
+		// keyframes move a placed group as a whole, a wave would have to deform the meshes of the group
+		ObjectData obj = LoadObject(objNode, sceneData.groups);
+		if (obj.groupIdx >= 0 && obj.wave.amplitude != 0)
+			throw std::runtime_error("An object that places group " + sceneData.groups[obj.groupIdx].name + " has a <wave>, only meshes deform");
 		sceneData.objects.push_back(obj);
 	}
 
@@ -165,9 +386,46 @@ SceneData TLASFileScene::LoadSceneFile(const string& filePath)
 	return sceneData;
 }
 
+// The wave moves the rest pose up and down. Normals follow the inverse transpose of the Jacobian of the
+// displacement, which for a wave with slope s at a vertex comes down to n - (s, 0, 0) * n.y; they are
+// left unnormalized, GetNormal normalizes the interpolated normal.
+static void DeformWave(const WaveData& wave, const float t, const Tri& rest, Tri& tri)
+{
+	const float k = 2 * PI / wave.wavelength;
+	auto displace = [&](const float3& p, const float3& n, float3& q, float3& m)
+	{
+		const float phase = k * (p.x - wave.speed * t);
+		q = p + float3(0, wave.amplitude * sinf(phase), 0);
+		m = n - float3(wave.amplitude * k * cosf(phase) * n.y, 0, 0);
+	};
+	tri = rest;
+	displace(rest.vertex0, rest.normal0, tri.vertex0, tri.normal0);
+	displace(rest.vertex1, rest.normal1, tri.vertex1, tri.normal1);
+	displace(rest.vertex2, rest.normal2, tri.vertex2, tri.normal2);
+}
+
+// deforms the meshes with a wave, moves the objects with keyframes and updates the TLAS
 void TLASFileScene::SetTime(float t)
 {
 	animTime = t;
+	if (animatedInstances.empty() && deformedInstances.empty()) return;
+	auto startTime = std::chrono::high_resolution_clock::now();
+	for (uint d = 0; d < deformedInstances.size(); d++)
+	{
+		const ObjectInstance& o = objectInstances[deformedInstances[d]];
+		const WaveData& wave = objects[o.object].wave;
+		deformedMeshes[d]->Deform([&wave, t](const Tri& rest, Tri& tri) { DeformWave(wave, t, rest, tri); });
+		// the instance bounds follow the bounds of the mesh
+		tlas.SetTransform(o.instanceIdx, GetObjectTransform(objects[o.object], t));
+	}
+	for (uint i : animatedInstances)
+	{
+		const ObjectInstance& o = objectInstances[i];
+		tlas.SetTransform(o.instanceIdx, GetObjectTransform(objects[o.object], t) * o.local);
+	}
+	tlas.Update();
+	auto endTime = std::chrono::high_resolution_clock::now();
+	updateTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 }
 
 float3 TLASFileScene::GetSkyColor(const Ray& ray) const
@@ -205,14 +463,26 @@ void TLASFileScene::FindNearest(Ray& ray)
 	tlas.Intersect(ray);
 }
 
+// RAY_PACKET_SIZE coherent rays, such as a square of camera rays; the TLAS traces them as one packet
+void TLASFileScene::FindNearestPacket(Ray* rays)
+{
+	for (int i = 0; i < RAY_PACKET_SIZE; i++) light.Intersect(rays[i]), floor.Intersect(rays[i]);
+#ifdef TLAS_MIXED
+	RayPacket packet;
+	packet.Load(rays);
+	tlas.IntersectPacket(packet);
+	packet.Store(rays);
+#else
+	for (int i = 0; i < RAY_PACKET_SIZE; i++) tlas.Intersect(rays[i]);
+#endif
+}
+
 bool TLASFileScene::IsOccluded(const Ray& ray)
 {
 	// from tmpl8rt_IGAD
 	if (light.IsOccluded(ray)) return true;
-	Ray shadow = Ray(ray);
-	shadow.t = 1e34f;
-	tlas.Intersect(shadow);
-	if (shadow.objIdx > -1) return true;
+	// any-hit query up to ray.t, geometry behind the light does not count
+	if (tlas.IsOccluded(ray)) return true;
 	// skip planes
 	return false;
 }
@@ -233,24 +503,19 @@ HitInfo TLASFileScene::GetHitInfo(const Ray& ray, const float3 I)
 		hitInfo.material = &primitiveMaterials[1];
 		break;
 	default:
-#ifdef TLAS_USE_BVH
-		BLASBVH* bvh = tlas.blas[ray.objIdx - 2];
-		hitInfo.normal = bvh->GetNormal(ray.triIdx, ray.barycentric);
-		hitInfo.uv = bvh->GetUV(ray.triIdx, ray.barycentric);
-		hitInfo.material = materials[bvh->matIdx];
-#endif // USE_BVH
-#ifdef TLAS_USE_Grid
-		BLASGrid* grid = tlas.blas[ray.objIdx - 2];
-		hitInfo.normal = grid->GetNormal(ray.triIdx, ray.barycentric);
-		hitInfo.uv = grid->GetUV(ray.triIdx, ray.barycentric);
-		hitInfo.material = materials[grid->matIdx];
-#endif // USE_Grid
-#ifdef TLAS_USE_KDTree
-		BLASKDTree* kdtree = tlas.blas[ray.objIdx - 2];
-		hitInfo.normal = kdtree->GetNormal(ray.triIdx, ray.barycentric);
-		hitInfo.uv = kdtree->GetUV(ray.triIdx, ray.barycentric);
-		hitInfo.material = materials[kdtree->matIdx];
-#endif // USE_KDTree
+	{
+#ifdef TLAS_MIXED
+		// the normal goes through the transforms of all TLASes on the way to the instance
+		int matIdx;
+		tlas.GetSurface(ray.objIdx, ray.triIdx, ray.barycentric, hitInfo.normal, hitInfo.uv, matIdx);
+		hitInfo.material = materials[matIdx];
+#else
+		const auto& instance = tlas.instances[ray.objIdx - 2];
+		hitInfo.normal = instance.GetNormal(ray.triIdx, ray.barycentric);
+		hitInfo.uv = instance.GetUV(ray.triIdx, ray.barycentric);
+		hitInfo.material = materials[instance.matIdx];
+#endif
+	}
 		break;
 	}
 
@@ -265,43 +530,162 @@ float3 TLASFileScene::GetAlbedo(int objIdx, float3 I) const
 	return float3(0);
 }
 
+// triangles in the scene, counting those of a shared BLAS once per instance
 int TLASFileScene::GetTriangleCount() const
 {
+#ifdef TLAS_MIXED
+	return tlas.GetTriangleCount();
+#else
 	int count = 0;
-	for (int i = 0; i < objCount; i++)
+	for (int i = 0; i < tlas.instances.size(); i++)
 	{
-		count += tlas.blas[i]->GetTriangleCount();
+		count += tlas.instances[i].blas->GetTriangleCount();
 	}
 	return count;
+#endif
+}
+
+int TLASFileScene::GetMeshCount() const
+{
+	return tlas.GetMeshCount();
+}
+
+// instances of a model in the scene, counting those that groups place
+int TLASFileScene::GetInstanceCount() const
+{
+#ifdef TLAS_MIXED
+	return tlas.objectCount;
+#else
+	return tlas.instances.size();
+#endif
+}
+
+std::chrono::microseconds TLASFileScene::GetLoadTime() const
+{
+	return loadTime;
+}
+
+size_t TLASFileScene::GetMemoryUsage() const
+{
+	return tlas.GetMemoryUsage();
+}
+
+// the last TLAS update of SetTime, including the transforms of the instances
+std::chrono::microseconds TLASFileScene::GetUpdateTime() const
+{
+	return updateTime;
+}
+
+bool TLASFileScene::IsTLASRebuilt() const
+{
+	return tlas.rebuilt;
+}
+
+uint TLASFileScene::GetTLASRefitCount() const
+{
+	return tlas.refitCount;
+}
+
+uint TLASFileScene::GetTLASRebuildCount() const
+{
+	return tlas.rebuildCount;
+}
+
+int TLASFileScene::GetDeformedMeshCount() const
+{
+	return deformedMeshes.size();
+}
+
+// the deformation and refit of the meshes in the last SetTime, part of the update time
+std::chrono::microseconds TLASFileScene::GetBLASRefitTime() const
+{
+	std::chrono::microseconds time(0);
+	for (int i = 0; i < deformedMeshes.size(); i++) time += deformedMeshes[i]->refitTime;
+	return time;
+}
+
+// the last rebuild of each deformed mesh, which may have run in the background
+std::chrono::microseconds TLASFileScene::GetBLASRebuildTime() const
+{
+	std::chrono::microseconds time(0);
+	for (int i = 0; i < deformedMeshes.size(); i++) time += deformedMeshes[i]->rebuildTime;
+	return time;
+}
+
+uint TLASFileScene::GetBLASRefitCount() const
+{
+	uint count = 0;
+	for (int i = 0; i < deformedMeshes.size(); i++) count += deformedMeshes[i]->refitCount;
+	return count;
+}
+
+uint TLASFileScene::GetBLASRebuildCount() const
+{
+	uint count = 0;
+	for (int i = 0; i < deformedMeshes.size(); i++) count += deformedMeshes[i]->rebuildCount;
+	return count;
 }
 
 std::chrono::microseconds TLASFileScene::GetBuildTime() const
 {
 	std::chrono::microseconds time(0);
-	for (int i = 0; i < objCount; i++)
+	for (int i = 0; i < tlas.blas.size(); i++)
 	{
 		time += tlas.blas[i]->buildTime;
 	}
+	for (int i = 0; i < tlas.bvh4BLAS.size(); i++) time += tlas.bvh4BLAS[i]->buildTime;
+	for (int i = 0; i < tlas.gridBLAS.size(); i++) time += tlas.gridBLAS[i]->buildTime;
+	for (int i = 0; i < tlas.kdtreeBLAS.size(); i++) time += tlas.kdtreeBLAS[i]->buildTime;
 	time += tlas.buildTime;
+	for (int i = 0; i < tlas.nestedTLAS.size(); i++) time += tlas.nestedTLAS[i]->buildTime;
 	return time;
 }
 
+std::chrono::microseconds TLASFileScene::GetSerialBuildTime() const
+{
+	std::chrono::microseconds time(0);
+	// only the BVHs have a parallel builder
+	for (int i = 0; i < tlas.blas.size(); i++)
+	{
+		time += tlas.blas[i]->serialBuildTime;
+	}
+	for (int i = 0; i < tlas.bvh4BLAS.size(); i++) time += tlas.bvh4BLAS[i]->serialBuildTime;
+	if (time.count() > 0) time += tlas.buildTime;
+	return time;
+}
+
+// the BLAS lists of the TLAS include the BLASes of the groups below it
 uint TLASFileScene::GetMaxTreeDepth() const
 {
-#ifdef TLAS_USE_BVH
 	uint maxDepth = 0;
-	for (int i = 0; i < objCount; i++)
+	for (int i = 0; i < tlas.blas.size(); i++)
 	{
 		if (tlas.blas[i]->maxDepth > maxDepth) maxDepth = tlas.blas[i]->maxDepth;
 	}
+	for (int i = 0; i < tlas.bvh4BLAS.size(); i++) maxDepth = max(maxDepth, tlas.bvh4BLAS[i]->maxDepth);
+	for (int i = 0; i < tlas.kdtreeBLAS.size(); i++) maxDepth = max(maxDepth, tlas.kdtreeBLAS[i]->maxDepth);
 	return maxDepth;
-#endif
-#ifdef TLAS_KDTree
-	for (int i = 0; i < objCount; i++)
+}
+
+// the BVHs first, then the grids and kd-trees
+std::vector<BLASBuildInfo> TLASFileScene::GetBLASBuildInfo() const
+{
+	std::vector<BLASBuildInfo> info;
+	std::vector<const BLASBVH*> bvhs(tlas.blas.begin(), tlas.blas.end());
+	bvhs.insert(bvhs.end(), tlas.bvh4BLAS.begin(), tlas.bvh4BLAS.end());
+	for (const BLASBVH* mesh : bvhs)
 	{
-		if (tlas.blas[i]->maxDepth > maxDepth) maxDepth = tlas.blas[i]->maxDepth;
+		static const char* builderNames[3] = { "SAH", "LBVH", "HLBVH" };
+		info.push_back({ builderNames[mesh->builder], mesh->GetTriangleCount(), mesh->buildTime, mesh->optimizeTime, mesh->sahCostBeforeOptimize, mesh->sahCost, (int)mesh->nodesUsed, mesh->duplication });
 	}
-	return maxDepth;
-#endif
-	return 0;
+	for (const BLASGrid* mesh : tlas.gridBLAS)
+		info.push_back({ "grid", mesh->GetTriangleCount(), mesh->buildTime, std::chrono::microseconds(0), 0, 0, 0, 1 });
+	for (const BLASKDTree* mesh : tlas.kdtreeBLAS)
+		info.push_back({ "kd-tree", mesh->GetTriangleCount(), mesh->buildTime, std::chrono::microseconds(0), 0, 0, 0, 1 });
+	return info;
+}
+
+const std::vector<BLASTuning>& TLASFileScene::GetBLASTunings() const
+{
+	return tunings;
 }
\ No newline at end of file
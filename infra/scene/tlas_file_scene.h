@@ -5,13 +5,31 @@
 #include "blas_grid.h"
 #include "blas_kdtree.h"
 #include "tlas_bvh.h"
-#include "tlas_grid.h"
-#include "tlas_kdtree.h"
+#include "tlas_bvh4.h"
+#include "blas_tuner.h"
 #include "rapidxml.hpp"
 
 #define TLAS_USE_BVH
+//#define TLAS_USE_BVH4 // BVH collapsed into 4-wide nodes, SSE child tests
 //#define TLAS_USE_Grid
 //#define TLAS_USE_KDTree
+//#define TLAS_USE_Auto // every mesh gets the structure that traces the sample rays of blas_tuner.h fastest
+
+// Apart from TLASBVH4, the TLAS is a TLASBVH, whose leaves can hold any structure. TLAS_USE_BVH, _Grid,
+// _KDTree and _Auto pick the structure of the meshes that do not choose one with <structure>.
+#ifndef TLAS_USE_BVH4
+#define TLAS_MIXED
+#endif
+#define TLAS_STRUCTURE_AUTO BLAS_TYPE_COUNT // <structure>auto</structure>, decided by TuneBLAS
+#if defined(TLAS_USE_Grid)
+#define TLAS_DEFAULT_STRUCTURE BLAS_TYPE_GRID
+#elif defined(TLAS_USE_KDTree)
+#define TLAS_DEFAULT_STRUCTURE BLAS_TYPE_KDTREE
+#elif defined(TLAS_USE_Auto)
+#define TLAS_DEFAULT_STRUCTURE TLAS_STRUCTURE_AUTO
+#else
+#define TLAS_DEFAULT_STRUCTURE BLAS_TYPE_BVH
+#endif
 
 namespace Tmpl8
 {
@@ -21,12 +39,54 @@ namespace Tmpl8
 		float3 absorption;
 		std::string textureLocation;
 	};
+	// placement of an object at a point in time
+	struct Keyframe {
+		float time;
+		float3 position;
+		float3 rotation;
+		float3 scale;
+	};
+	// travelling sine wave along x in object space, which moves the vertices of a mesh up and down
+	struct WaveData {
+		float amplitude = 0;
+		float wavelength = 1;
+		float speed = 1;
+	};
 	struct ObjectData {
 		std::string modelLocation;
 		int materialIdx;
 		float3 position;
 		float3 rotation;
 		float3 scale;
+		BVHBuildSettings buildSettings; // optional <builder> (sah, lbvh or hlbvh), <optimize_iterations> and <optimize_ms>
+		std::vector<Keyframe> keyframes; // optional <keyframes>, played in a loop; replace position, rotation and scale
+		WaveData wave; // optional <wave> with <amplitude>, <wavelength> and <speed>; the mesh is then not shared
+		int groupIdx = -1; // optional <group_name> instead of <model_location>: places a group
+		int structure = -1; // optional <structure>: bvh, bvh4, grid, kdtree or auto, a BLASType; a deforming mesh is always a BVH
+	};
+	// objects that are placed together, by the objects that refer to the group; a group can place earlier groups
+	struct GroupData {
+		std::string name;
+		std::vector<ObjectData> objects;
+	};
+	// an instance in the TLAS of the scene: of an object, or, when the TLAS cannot nest, of one of the
+	// objects in the group of an object, placed within it by local
+	struct ObjectInstance {
+		uint object;
+		uint instanceIdx;
+		mat4 local;
+	};
+
+	// build statistics of one BLAS, shown in the UI
+	struct BLASBuildInfo {
+		const char* builder;
+		int triangleCount;
+		std::chrono::microseconds buildTime;
+		std::chrono::microseconds optimizeTime;
+		float sahCostBeforeOptimize;
+		float sahCost;
+		int nodeCount; // 0 for the grids and kd-trees
+		float duplication; // triangle references per triangle, above 1 with spatial splits
 	};
 
 	// Define a structure to hold scene information
@@ -36,6 +96,7 @@ namespace Tmpl8
 		std::string planeTextureLocation;
 		std::string skydomeLocation;
 		std::vector<ObjectData> objects;
+		std::vector<GroupData> groups;
 		std::vector<MaterialData> materials;
 	};
 
@@ -45,27 +106,42 @@ namespace Tmpl8
 	public:
 		TLASFileScene(const string& filePath);
 		SceneData LoadSceneFile(const string& filePath);
+		static mat4 GetObjectTransform(const ObjectData& objectData, const float t);
 		void SetTime(float t);
 		float3 GetSkyColor(const Ray& ray) const;
 		float3 GetLightPos() const;
 		float3 GetLightColor() const;
 		void FindNearest(Ray& ray);
+		void FindNearestPacket(Ray* rays);
 		bool IsOccluded(const Ray& ray);
 		float3 GetAlbedo(int objIdx, float3 I) const;
 		HitInfo GetHitInfo(const Ray& ray, const float3 I);
 		int GetTriangleCount() const;
+		int GetMeshCount() const;
+		int GetInstanceCount() const;
+		std::chrono::microseconds GetLoadTime() const;
+		size_t GetMemoryUsage() const;
+		std::chrono::microseconds GetUpdateTime() const;
+		bool IsTLASRebuilt() const;
+		uint GetTLASRefitCount() const;
+		uint GetTLASRebuildCount() const;
+		int GetDeformedMeshCount() const;
+		std::chrono::microseconds GetBLASRefitTime() const;
+		std::chrono::microseconds GetBLASRebuildTime() const;
+		uint GetBLASRefitCount() const;
+		uint GetBLASRebuildCount() const;
 		std::chrono::microseconds GetBuildTime() const;
+		std::chrono::microseconds GetSerialBuildTime() const;
 		uint GetMaxTreeDepth() const;
+		std::vector<BLASBuildInfo> GetBLASBuildInfo() const;
+		const std::vector<BLASTuning>& GetBLASTunings() const;
 	public:
 		float animTime = 0;
-#ifdef TLAS_USE_BVH
+#ifdef TLAS_MIXED
 		TLASBVH tlas;
 #endif
-#ifdef TLAS_USE_Grid
-		TLASGrid tlas;
-#endif
-#ifdef TLAS_USE_KDTree
-		TLASKDTree tlas;
+#ifdef TLAS_USE_BVH4
+		TLASBVH4 tlas;
 #endif
 		string sceneName;
 		Texture skydome;
@@ -74,6 +150,22 @@ namespace Tmpl8
 		int objIdUsed = 2;
 		int objCount = 0;
 		int materialCount = 0;
+		std::chrono::microseconds loadTime{ 0 };
+		std::chrono::microseconds updateTime{ 0 };
+		std::vector<ObjectData> objects;
+		std::vector<ObjectInstance> objectInstances;
+		std::vector<uint> animatedInstances; // of objects with keyframes, updated by SetTime
+		// instances of objects with a wave and their meshes, deformed by SetTime; only the BVHs can refit
+		std::vector<uint> deformedInstances;
+#ifdef TLAS_USE_BVH4
+		std::vector<BLASBVH4*> deformedMeshes;
+#else
+		std::vector<BLASBVH*> deformedMeshes;
+#endif
+#ifdef TLAS_MIXED
+		std::vector<TLASBVH*> groupTLAS; // one per group, instanced by the TLAS of the scene
+#endif
+		std::vector<BLASTuning> tunings; // one per model with the auto structure
 		Material errorMaterial;
 		Material primitiveMaterials[3];
 		std::vector<Material*> materials;
@@ -0,0 +1,199 @@
+#include "precomp.h"
+#include "tlas_builder.h"
+
+static float MergedArea(const TLASNode& a, const TLASNode& b)
+{
+	const float3 e = fmaxf(a.aabbMax, b.aabbMax) - fminf(a.aabbMin, b.aabbMin);
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// the all-pairs clustering of Walter et al. 2008, for small scenes
+static int FindBestMatch(const TLASNode* nodes, const uint* list, const int N, const int A)
+{
+	float smallest = 1e30f;
+	int bestB = -1;
+	for (int B = 0; B < N; B++) if (B != A)
+	{
+		const float surfaceArea = MergedArea(nodes[list[A]], nodes[list[B]]);
+		if (surfaceArea < smallest) smallest = surfaceArea, bestB = B;
+	}
+	return bestB;
+}
+
+static void ClusterAllPairs(TLASNode* nodes, uint& nodesUsed, const uint leafCount)
+{
+	std::vector<uint> nodeIdx(leafCount);
+	int nodeIndices = leafCount;
+	for (uint i = 0; i < leafCount; i++) nodeIdx[i] = i + 1;
+	int A = 0, B = FindBestMatch(nodes, nodeIdx.data(), nodeIndices, A);
+	while (nodeIndices > 1)
+	{
+		int C = FindBestMatch(nodes, nodeIdx.data(), nodeIndices, B);
+		if (A == C)
+		{
+			const uint nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
+			TLASNode& newNode = nodes[nodesUsed];
+			newNode.left = nodeIdxA, newNode.right = nodeIdxB;
+			newNode.aabbMin = fminf(nodes[nodeIdxA].aabbMin, nodes[nodeIdxB].aabbMin);
+			newNode.aabbMax = fmaxf(nodes[nodeIdxA].aabbMax, nodes[nodeIdxB].aabbMax);
+			nodeIdx[A] = nodesUsed++;
+			nodeIdx[B] = nodeIdx[nodeIndices - 1];
+			B = FindBestMatch(nodes, nodeIdx.data(), --nodeIndices, A);
+		}
+		else A = B, B = C;
+	}
+	nodes[0] = nodes[nodeIdx[A]];
+}
+
+// the nearest neighbour search of a PLOC pass is split over the workers
+static struct TLASClusterJob : public Job
+{
+	void Main()
+	{
+		for (uint i = first; i < last; i++)
+		{
+			const uint lo = i > TLAS_PLOC_RADIUS ? i - TLAS_PLOC_RADIUS : 0, hi = min(count, i + TLAS_PLOC_RADIUS + 1);
+			// candidates are ranked by the merged area, then by their distance along the curve, then
+			// by whether the pair starts at an even position, then by that position; no two pairs rank
+			// the same, so the best pair of a pass is always mutual, and equal boxes pair up as (0, 1),
+			// (2, 3), ... instead of all merging into one chain
+			float smallest = 0;
+			uint best = i, bestDist = 0, bestOdd = 0;
+			for (uint j = lo; j < hi; j++) if (j != i)
+			{
+				float surfaceArea = MergedArea(nodes[clusters[i]], nodes[clusters[j]]);
+				if (surfaceArea != surfaceArea) surfaceArea = INFINITY; // empty boxes give NaN
+				const uint dist = j < i ? i - j : j - i, odd = min(i, j) & 1;
+				if (best == i || surfaceArea < smallest ||
+					(surfaceArea == smallest && (dist < bestDist || (dist == bestDist && odd < bestOdd))))
+					smallest = surfaceArea, best = j, bestDist = dist, bestOdd = odd;
+			}
+			neighbour[i] = best;
+		}
+	}
+	TLASClusterJob* Init(const TLASNode* n, const uint* c, uint* nb, uint cnt, uint f, uint l)
+	{
+		nodes = n, clusters = c, neighbour = nb, count = cnt, first = f, last = l;
+		return this;
+	}
+	const TLASNode* nodes;
+	const uint* clusters;
+	uint* neighbour;
+	uint count, first, last;
+} tlasClusterJob[64];
+
+// spreads the lowest 10 bits of v, leaving two zero bits between each
+static uint ExpandMortonBits(uint v)
+{
+	v &= 0x3ff;
+	v = (v | v << 16) & 0x30000ff;
+	v = (v | v << 8) & 0x300f00f;
+	v = (v | v << 4) & 0x30c30c3;
+	v = (v | v << 2) & 0x9249249;
+	return v;
+}
+
+static void ClusterLocallyOrdered(TLASNode* nodes, uint& nodesUsed, const uint leafCount)
+{
+	// Morton codes of the box centers, 10 bits per axis
+	float3 cmin(1e30f), cmax(-1e30f);
+	for (uint i = 1; i <= leafCount; i++)
+	{
+		const float3 c = (nodes[i].aabbMin + nodes[i].aabbMax) * 0.5f;
+		cmin = fminf(cmin, c), cmax = fmaxf(cmax, c);
+	}
+	float3 scale, extent = cmax - cmin;
+	for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0 ? 1024 * 0.9999f / extent[a] : 0;
+	std::vector<uint> codes(leafCount), sortedCodes(leafCount), clusters(leafCount), sortedClusters(leafCount);
+	for (uint i = 0; i < leafCount; i++)
+	{
+		const float3 p = ((nodes[i + 1].aabbMin + nodes[i + 1].aabbMax) * 0.5f - cmin) * scale;
+		codes[i] = ExpandMortonBits((uint)p.x) << 2 | ExpandMortonBits((uint)p.y) << 1 | ExpandMortonBits((uint)p.z);
+		clusters[i] = i + 1;
+	}
+	// LSD radix sort of the 30-bit codes, 8 bits per pass
+	for (uint shift = 0; shift < 30; shift += 8)
+	{
+		uint offset[256] = {};
+		for (uint i = 0; i < leafCount; i++) offset[(codes[i] >> shift) & 255]++;
+		// a pass in which all codes have the same digit changes nothing
+		if (offset[(codes[0] >> shift) & 255] == leafCount) continue;
+		for (uint d = 0, sum = 0; d < 256; d++) { const uint c = offset[d]; offset[d] = sum, sum += c; }
+		for (uint i = 0; i < leafCount; i++)
+		{
+			const uint slot = offset[(codes[i] >> shift) & 255]++;
+			sortedCodes[slot] = codes[i], sortedClusters[slot] = clusters[i];
+		}
+		codes.swap(sortedCodes), clusters.swap(sortedClusters);
+	}
+	// merge mutual nearest neighbours along the curve until one cluster is left
+	std::vector<uint> neighbour(leafCount);
+	JobManager* jm = JobManager::GetJobManager();
+	uint count = leafCount;
+	while (count > 1)
+	{
+		const uint jobCount = clamp((int)(count / 4096), 1, 64), jobSize = (count + jobCount - 1) / jobCount;
+		for (uint i = 0; i < jobCount; i++) tlasClusterJob[i].Init(nodes, clusters.data(), neighbour.data(), count, i * jobSize, min(count, (i + 1) * jobSize));
+		if (jobCount == 1) tlasClusterJob[0].Main();
+		else
+		{
+			for (uint i = 0; i < jobCount; i++) jm->AddJob2(&tlasClusterJob[i]);
+			jm->RunJobs();
+		}
+		// a merged cluster takes the place of its left half, keeping the order along the curve
+		for (uint i = 0; i < count; i++)
+		{
+			const uint j = neighbour[i];
+			if (j <= i || neighbour[j] != i) continue;
+			TLASNode& newNode = nodes[nodesUsed];
+			newNode.left = clusters[i], newNode.right = clusters[j];
+			newNode.aabbMin = fminf(nodes[clusters[i]].aabbMin, nodes[clusters[j]].aabbMin);
+			newNode.aabbMax = fmaxf(nodes[clusters[i]].aabbMax, nodes[clusters[j]].aabbMax);
+			clusters[i] = nodesUsed++, clusters[j] = 0;
+		}
+		uint kept = 0;
+		for (uint i = 0; i < count; i++) if (clusters[i]) clusters[kept++] = clusters[i];
+		count = kept;
+	}
+	nodes[0] = nodes[clusters[0]];
+}
+
+void Tmpl8::BuildTLASNodes(TLASNode* nodes, uint& nodesUsed, const uint leafCount)
+{
+	nodesUsed = leafCount + 1;
+	if (leafCount <= TLAS_EXACT_CLUSTER_MAX) ClusterAllPairs(nodes, nodesUsed, leafCount);
+	else ClusterLocallyOrdered(nodes, nodesUsed, leafCount);
+}
+
+void Tmpl8::RefitTLASNodes(TLASNode* nodes, const uint nodesUsed, const uint leafCount)
+{
+	// the builders only merge existing nodes, so every child has a lower index than its parent
+	for (uint i = leafCount + 1; i < nodesUsed; i++)
+	{
+		TLASNode& node = nodes[i];
+		node.aabbMin = fminf(nodes[node.left].aabbMin, nodes[node.right].aabbMin);
+		node.aabbMax = fmaxf(nodes[node.left].aabbMax, nodes[node.right].aabbMax);
+	}
+	// the root is a copy of the last merged node, or of the only leaf
+	if (nodes[0].isLeaf()) nodes[0] = nodes[1];
+	else
+	{
+		nodes[0].aabbMin = fminf(nodes[nodes[0].left].aabbMin, nodes[nodes[0].right].aabbMin);
+		nodes[0].aabbMax = fmaxf(nodes[nodes[0].left].aabbMax, nodes[nodes[0].right].aabbMax);
+	}
+}
+
+float Tmpl8::CalculateTLASCost(const TLASNode* nodes, const uint nodesUsed, const uint leafCount)
+{
+	const float3 e = nodes[0].aabbMax - nodes[0].aabbMin;
+	const float rootArea = e.x * e.y + e.y * e.z + e.z * e.x;
+	if (nodes[0].isLeaf() || rootArea <= 0) return 1;
+	// nodes[0] copies the last merged node, which the loop already counts
+	float cost = 0;
+	for (uint i = leafCount + 1; i < nodesUsed; i++)
+	{
+		const float3 d = nodes[i].aabbMax - nodes[i].aabbMin;
+		cost += d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+	return cost / rootArea;
+}
\ No newline at end of file
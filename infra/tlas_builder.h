@@ -0,0 +1,34 @@
+#pragma once
+
+#define TLAS_EXACT_CLUSTER_MAX 256 // up to this many instances, clustering searches all pairs
+#define TLAS_PLOC_RADIUS 16 // neighbours searched on each side along the Morton curve
+#define TLAS_STACK_SIZE 256
+#define TLAS_REBUILD_RATIO 1.3f // an update rebuilds when refitting made the tree this much more expensive than the last build
+
+// The TLAS of every acceleration structure is built bottom-up by agglomerative clustering: the two
+// nodes that form the smallest box are merged until one is left. Searching all pairs is quadratic,
+// so larger scenes use locally-ordered clustering (PLOC, Meister and Bittner 2018): the instances
+// are sorted along a Morton curve and every cluster only looks for its best match among the
+// TLAS_PLOC_RADIUS clusters on either side. Clusters that pick each other are merged, all of them
+// in the same pass, until a single cluster remains.
+
+namespace Tmpl8
+{
+    struct TLASNode
+    {
+        float3 aabbMin = float3(0);
+        uint left = 0; // 0 for a leaf
+        float3 aabbMax = float3(0);
+        union { uint right; uint BLAS = 0; }; // an interior node stores its right child, a leaf its BLAS instance
+        bool isLeaf() const { return left == 0; }
+    };
+
+    // Builds the interior nodes over the leaves in nodes[1..leafCount], which the caller has filled
+    // in; the root ends up in nodes[0]. nodes needs room for 2 * leafCount nodes.
+    void BuildTLASNodes(TLASNode* nodes, uint& nodesUsed, const uint leafCount);
+    // Recomputes the bounds of the interior nodes after the caller has updated the leaves; the
+    // topology stays the same, so moving instances slowly make the tree worse.
+    void RefitTLASNodes(TLASNode* nodes, const uint nodesUsed, const uint leafCount);
+    // SAH cost of the interior nodes relative to the root, to decide between refitting and rebuilding
+    float CalculateTLASCost(const TLASNode* nodes, const uint nodesUsed, const uint leafCount);
+}
\ No newline at end of file
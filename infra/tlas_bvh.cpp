@@ -1,72 +1,185 @@
 #include "precomp.h"
 #include "tlas_bvh.h"
 
-TLASBVH::TLASBVH(std::vector<BLASBVH*> bvhList)
+TLASBVH::TLASBVH(const std::vector<BLASInstance<BLASBVH>>& instanceList)
+	: TLASBVH(TLASInstanceLists{ instanceList })
 {
-	blasCount = bvhList.size();
-	// copy a pointer to the array of bottom level accstructs
-	for (int i = 0; i < blasCount; i++)
+}
+
+TLASBVH::TLASBVH(const TLASInstanceLists& instanceLists)
+{
+	instances = instanceLists.bvh;
+	bvh4Instances = instanceLists.bvh4;
+	gridInstances = instanceLists.grid;
+	kdtreeInstances = instanceLists.kdtree;
+	nested = instanceLists.nested;
+	const size_t counts[BLAS_TYPE_COUNT] = { instances.size(), bvh4Instances.size(), gridInstances.size(), kdtreeInstances.size(), nested.size() };
+	for (int type = 0; type < BLAS_TYPE_COUNT; type++) firstInstance[type + 1] = firstInstance[type] + (uint)counts[type];
+	instanceCount = firstInstance[BLAS_TYPE_COUNT];
+	blas = DistinctBLAS(instances);
+	bvh4BLAS = DistinctBLAS(bvh4Instances);
+	gridBLAS = DistinctBLAS(gridInstances);
+	kdtreeBLAS = DistinctBLAS(kdtreeInstances);
+	// the structures and TLASes below the nested TLASes, each once
+	std::unordered_set<void*> seen;
+	for (BLASBVH* mesh : blas) seen.insert(mesh);
+	for (BLASBVH4* mesh : bvh4BLAS) seen.insert(mesh);
+	for (BLASGrid* mesh : gridBLAS) seen.insert(mesh);
+	for (BLASKDTree* mesh : kdtreeBLAS) seen.insert(mesh);
+	for (TLASBVH* child : DistinctBLAS(nested))
+	{
+		if (seen.insert(child).second) nestedTLAS.push_back(child);
+		for (TLASBVH* below : child->nestedTLAS) if (seen.insert(below).second) nestedTLAS.push_back(below);
+		for (BLASBVH* mesh : child->blas) if (seen.insert(mesh).second) blas.push_back(mesh);
+		for (BLASBVH4* mesh : child->bvh4BLAS) if (seen.insert(mesh).second) bvh4BLAS.push_back(mesh);
+		for (BLASGrid* mesh : child->gridBLAS) if (seen.insert(mesh).second) gridBLAS.push_back(mesh);
+		for (BLASKDTree* mesh : child->kdtreeBLAS) if (seen.insert(mesh).second) kdtreeBLAS.push_back(mesh);
+	}
+	// object indices per leaf, so a hit can be traced back to its instance
+	for (uint i = 0; i < instanceCount; i++)
 	{
-		blas.push_back(bvhList[i]);
+		const uint leaf = GetLeaf(i);
+		VisitLeaf(leaf, [&](const auto& instance) { objectLeaves.push_back({ instance.objIdx, leaf }); });
+		objectCount += leaf >> TLAS_LEAF_TYPE_SHIFT == BLAS_TYPE_TLAS ? nested[leaf & TLAS_LEAF_INDEX_MASK].blas->objectCount : 1;
 	}
+	std::sort(objectLeaves.begin(), objectLeaves.end());
 	// allocate TLAS nodes
-	tlasNode = (TLASBVHNode*)_aligned_malloc(sizeof(TLASBVHNode) * 2 * blasCount, 64);
+	tlasNode = (TLASBVHNode*)_aligned_malloc(sizeof(TLASBVHNode) * 2 * instanceCount, 64);
 	Build();
 }
 
+// the leaf of an instance: its kind in the top bits, its index among the instances of that kind below
+uint TLASBVH::GetLeaf(const uint instanceIdx) const
+{
+	uint type = 0;
+	while (instanceIdx >= firstInstance[type + 1]) type++;
+	return type << TLAS_LEAF_TYPE_SHIFT | (instanceIdx - firstInstance[type]);
+}
+
 void TLASBVH::Build()
 {
 	auto startTime = std::chrono::high_resolution_clock::now();
-	// assign a TLASleaf node to each BLAS
-	int nodeIdx[256], nodeIndices = blasCount;
-	nodesUsed = 1;
-	for (uint i = 0; i < blasCount; i++)
+	// assign a TLASleaf node to each instance
+	for (uint i = 0; i < instanceCount; i++)
 	{
-		nodeIdx[i] = nodesUsed;
-		tlasNode[nodesUsed].aabbMin = blas[i]->worldBounds.bmin3;
-		tlasNode[nodesUsed].aabbMax = blas[i]->worldBounds.bmax3;
-		tlasNode[nodesUsed].BLAS = i;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		const uint leaf = GetLeaf(i);
+		VisitLeaf(leaf, [&](const auto& instance)
+		{
+			tlasNode[i + 1].aabbMin = instance.worldBounds.bmin3;
+			tlasNode[i + 1].aabbMax = instance.worldBounds.bmax3;
+		});
+		tlasNode[i + 1].BLAS = leaf;
+		tlasNode[i + 1].left = 0; // makes it a leaf
 	}
+	BuildTLASNodes(tlasNode, nodesUsed, instanceCount);
+	builtCost = cost = CalculateTLASCost(tlasNode, nodesUsed, instanceCount);
+	auto endTime = std::chrono::high_resolution_clock::now();
+	buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+// instanceIdx counts the instances of each kind in turn, in the order of BLASType
+void TLASBVH::SetTransform(const uint instanceIdx, const mat4& transform)
+{
+	VisitLeaf(GetLeaf(instanceIdx), [&](auto& instance) { instance.SetTransform(transform); });
+}
 
-	// use agglomerative clustering to build the TLAS
-	int A = 0, B = FindBestMatch(nodeIdx, nodeIndices, A);
-	while (nodeIndices > 1)
+// updates the leaves to the bounds of the instances, keeping the topology of the last build
+void TLASBVH::Refit()
+{
+	for (uint i = 0; i < instanceCount; i++)
 	{
-		int C = FindBestMatch(nodeIdx, nodeIndices, B);
-		if (A == C)
+		VisitLeaf(GetLeaf(i), [&](const auto& instance)
 		{
-			int nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
-			TLASBVHNode& nodeA = tlasNode[nodeIdxA];
-			TLASBVHNode& nodeB = tlasNode[nodeIdxB];
-			TLASBVHNode& newNode = tlasNode[nodesUsed];
-			newNode.leftRight = nodeIdxA + (nodeIdxB << 16);
-			newNode.aabbMin = fminf(nodeA.aabbMin, nodeB.aabbMin);
-			newNode.aabbMax = fmaxf(nodeA.aabbMax, nodeB.aabbMax);
-			nodeIdx[A] = nodesUsed++;
-			nodeIdx[B] = nodeIdx[nodeIndices - 1];
-			B = FindBestMatch(nodeIdx, --nodeIndices, A);
-		}
-		else A = B, B = C;
+			tlasNode[i + 1].aabbMin = instance.worldBounds.bmin3;
+			tlasNode[i + 1].aabbMax = instance.worldBounds.bmax3;
+		});
 	}
-	tlasNode[0] = tlasNode[nodeIdx[A]];
+	RefitTLASNodes(tlasNode, nodesUsed, instanceCount);
+	cost = CalculateTLASCost(tlasNode, nodesUsed, instanceCount);
+}
+
+// after instances moved: refit, and rebuild when that left the tree too expensive to traverse
+void TLASBVH::Update()
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	Refit();
+	rebuilt = cost > builtCost * TLAS_REBUILD_RATIO;
+	if (rebuilt) Build(), rebuildCount++;
+	else refitCount++;
 	auto endTime = std::chrono::high_resolution_clock::now();
-	buildTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+	updateTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+size_t TLASBVH::GetNodeMemoryUsage() const
+{
+	return sizeof(TLASBVHNode) * 2 * instanceCount + instances.capacity() * sizeof(BLASInstance<BLASBVH>) +
+		bvh4Instances.capacity() * sizeof(BLASInstance<BLASBVH4>) + gridInstances.capacity() * sizeof(BLASInstance<BLASGrid>) +
+		kdtreeInstances.capacity() * sizeof(BLASInstance<BLASKDTree>) + nested.capacity() * sizeof(BLASInstance<TLASBVH>) +
+		objectLeaves.capacity() * sizeof(std::pair<int, uint>);
 }
 
-int TLASBVH::FindBestMatch(int* list, int N, int A)
+// the nodes and instances of this TLAS, of each nested TLAS once and of each distinct BLAS once,
+// however often they are instanced
+size_t TLASBVH::GetMemoryUsage() const
 {
-	float smallest = 1e30f;
-	int bestB = -1;
-	for (int B = 0; B < N; B++) if (B != A)
+	size_t bytes = GetNodeMemoryUsage();
+	for (const TLASBVH* child : nestedTLAS) bytes += child->GetNodeMemoryUsage();
+	for (const BLASBVH* mesh : blas) bytes += mesh->GetMemoryUsage();
+	for (const BLASBVH4* mesh : bvh4BLAS) bytes += mesh->GetMemoryUsage();
+	for (const BLASGrid* mesh : gridBLAS) bytes += mesh->GetMemoryUsage();
+	for (const BLASKDTree* mesh : kdtreeBLAS) bytes += mesh->GetMemoryUsage();
+	return bytes;
+}
+
+aabb TLASBVH::GetBounds() const
+{
+	return aabb(tlasNode[0].aabbMin, tlasNode[0].aabbMax);
+}
+
+// triangles below this TLAS, counting those of a shared BLAS or nested TLAS once per instance
+int TLASBVH::GetTriangleCount() const
+{
+	int count = 0;
+	for (const BLASInstance<BLASBVH>& instance : instances) count += instance.blas->GetTriangleCount();
+	for (const BLASInstance<BLASBVH4>& instance : bvh4Instances) count += instance.blas->GetTriangleCount();
+	for (const BLASInstance<BLASGrid>& instance : gridInstances) count += instance.blas->GetTriangleCount();
+	for (const BLASInstance<BLASKDTree>& instance : kdtreeInstances) count += instance.blas->GetTriangleCount();
+	for (const BLASInstance<TLASBVH>& instance : nested) count += instance.blas->GetTriangleCount();
+	return count;
+}
+
+// the distinct meshes below this TLAS, of all kinds
+int TLASBVH::GetMeshCount() const
+{
+	return blas.size() + bvh4BLAS.size() + gridBLAS.size() + kdtreeBLAS.size();
+}
+
+// the normal, in the space of this TLAS, the uv and the material of a hit with object index objIdx,
+// looked up through the nested TLASes
+void TLASBVH::GetSurface(const int objIdx, const uint triIdx, const float2 barycentric, float3& normal, float2& uv, int& matIdx) const
+{
+	// the leaf with the last first object index at or below objIdx
+	const uint leaf = (std::upper_bound(objectLeaves.begin(), objectLeaves.end(), std::make_pair(objIdx, 0xffffffffu)) - 1)->second;
+	const uint i = leaf & TLAS_LEAF_INDEX_MASK;
+	switch (leaf >> TLAS_LEAF_TYPE_SHIFT)
 	{
-		float3 bmax = fmaxf(tlasNode[list[A]].aabbMax, tlasNode[list[B]].aabbMax);
-		float3 bmin = fminf(tlasNode[list[A]].aabbMin, tlasNode[list[B]].aabbMin);
-		float3 e = bmax - bmin;
-		float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-		if (surfaceArea < smallest) smallest = surfaceArea, bestB = B;
+	case BLAS_TYPE_BVH:
+		normal = instances[i].GetNormal(triIdx, barycentric), uv = instances[i].GetUV(triIdx, barycentric), matIdx = instances[i].matIdx;
+		break;
+	case BLAS_TYPE_BVH4:
+		normal = bvh4Instances[i].GetNormal(triIdx, barycentric), uv = bvh4Instances[i].GetUV(triIdx, barycentric), matIdx = bvh4Instances[i].matIdx;
+		break;
+	case BLAS_TYPE_GRID:
+		normal = gridInstances[i].GetNormal(triIdx, barycentric), uv = gridInstances[i].GetUV(triIdx, barycentric), matIdx = gridInstances[i].matIdx;
+		break;
+	case BLAS_TYPE_KDTREE:
+		normal = kdtreeInstances[i].GetNormal(triIdx, barycentric), uv = kdtreeInstances[i].GetUV(triIdx, barycentric), matIdx = kdtreeInstances[i].matIdx;
+		break;
+	default:
+		nested[i].blas->GetSurface(objIdx - nested[i].objIdx, triIdx, barycentric, normal, uv, matIdx);
+		normal = normalize(TransformVector(normal, nested[i].normalT));
+		break;
 	}
-	return bestB;
 }
 
 float TLASBVH::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
@@ -82,19 +195,19 @@ float TLASBVH::IntersectAABB(const Ray& ray, const float3 bmin, const float3 bma
 
 void TLASBVH::Intersect(Ray& ray)
 {
-	TLASBVHNode* node = &tlasNode[0], * stack[64];
+	TLASBVHNode* node = &tlasNode[0], * stack[TLAS_STACK_SIZE];
 	uint stackPtr = 0;
 	while (1)
 	{
 		ray.traversed++;
 		if (node->isLeaf())
 		{
-			blas[node->BLAS]->Intersect(ray);
+			VisitLeaf(node->BLAS, [&](const auto& instance) { instance.Intersect(ray); });
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
-		TLASBVHNode* child1 = &tlasNode[node->leftRight & 0xffff];
-		TLASBVHNode* child2 = &tlasNode[node->leftRight >> 16];
+		TLASBVHNode* child1 = &tlasNode[node->left];
+		TLASBVHNode* child2 = &tlasNode[node->right];
 		float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
 		float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
 		if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
@@ -108,4 +221,78 @@ void TLASBVH::Intersect(Ray& ray)
 			if (dist2 != 1e30f) stack[stackPtr++] = child2;
 		}
 	}
+}
+
+// returns at the first BLAS that reports a hit below ray.t, so the children are not sorted
+bool TLASBVH::IsOccluded(const Ray& ray)
+{
+	TLASBVHNode* node = &tlasNode[0], * stack[TLAS_STACK_SIZE];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			bool occluded = false;
+			VisitLeaf(node->BLAS, [&](const auto& instance) { occluded = instance.IsOccluded(ray); });
+			if (occluded) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		TLASBVHNode* child1 = &tlasNode[node->left];
+		TLASBVHNode* child2 = &tlasNode[node->right];
+		const bool hit1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax) != 1e30f;
+		const bool hit2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax) != 1e30f;
+		if (hit1)
+		{
+			node = child1;
+			if (hit2) stack[stackPtr++] = child2;
+		}
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false;
+		else node = stack[--stackPtr];
+	}
+}
+
+// the ranged packet traversal of BLASBVH, handing the first active ray on to the BLAS
+void TLASBVH::IntersectPacket(RayPacket& packet, uint first)
+{
+	RayPacketStackEntry stack[TLAS_STACK_SIZE];
+	uint stackPtr = 0, nodeIdx = 0;
+	while (1)
+	{
+		packet.traversed++;
+		TLASBVHNode& node = tlasNode[nodeIdx];
+		if (node.isLeaf())
+		{
+			// grids and kd-trees have no packet traversal and take the rays one by one
+			const uint i = node.BLAS & TLAS_LEAF_INDEX_MASK;
+			switch (node.BLAS >> TLAS_LEAF_TYPE_SHIFT)
+			{
+			case BLAS_TYPE_BVH: instances[i].IntersectPacket(packet, first); break;
+			case BLAS_TYPE_BVH4: bvh4Instances[i].IntersectPacket(packet, first); break;
+			case BLAS_TYPE_GRID: gridInstances[i].IntersectRays(packet, first); break;
+			case BLAS_TYPE_KDTREE: kdtreeInstances[i].IntersectRays(packet, first); break;
+			default: nested[i].IntersectPacket(packet, first); break;
+			}
+			if (stackPtr == 0) break;
+			stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+			continue;
+		}
+		uint child1 = node.left, child2 = node.right;
+		float dist1 = 1e30f, dist2 = 1e30f;
+		uint first1 = IntersectPacketAABB(packet, first, tlasNode[child1].aabbMin, tlasNode[child1].aabbMax, dist1);
+		uint first2 = IntersectPacketAABB(packet, first, tlasNode[child2].aabbMin, tlasNode[child2].aabbMax, dist2);
+		if (first1 == RAY_PACKET_SIZE && first2 == RAY_PACKET_SIZE)
+		{
+			if (stackPtr == 0) break;
+			stackPtr--, nodeIdx = stack[stackPtr].node, first = stack[stackPtr].first;
+			continue;
+		}
+		if (first1 == RAY_PACKET_SIZE || (first2 != RAY_PACKET_SIZE && dist2 < dist1))
+		{
+			swap(child1, child2), swap(first1, first2);
+		}
+		if (first2 != RAY_PACKET_SIZE) stack[stackPtr].node = child2, stack[stackPtr++].first = first2;
+		nodeIdx = child1, first = first1;
+	}
 }
\ No newline at end of file
@@ -1,33 +1,101 @@
 #pragma once
 
 #include "blas_bvh.h"
+#include "blas_bvh4.h"
+#include "blas_grid.h"
+#include "blas_kdtree.h"
+#include "blas_instance.h"
+#include "tlas_builder.h"
+
+#define TLAS_LEAF_TYPE_SHIFT 28 // a leaf stores the BLASType of its instance in the top bits of its index
+#define TLAS_LEAF_INDEX_MASK ((1u << TLAS_LEAF_TYPE_SHIFT) - 1)
 
 namespace Tmpl8
 {
-    struct TLASBVHNode
+    typedef TLASNode TLASBVHNode;
+
+    // the kinds of structure a TLASBVH can instance
+    enum BLASType { BLAS_TYPE_BVH, BLAS_TYPE_BVH4, BLAS_TYPE_GRID, BLAS_TYPE_KDTREE, BLAS_TYPE_TLAS, BLAS_TYPE_COUNT };
+
+    // a TLASBVH can be instanced in another one
+    class TLASBVH;
+    template <>
+    struct InstanceTraits<TLASBVH> { static const bool nested = true; };
+
+    // the instances of a TLASBVH, one list per kind of structure
+    struct TLASInstanceLists
     {
-        float3 aabbMin = float3(0);
-        uint leftRight = 0; // 2x16 bits
-        float3 aabbMax = float3(0);
-        uint BLAS = 0;
-        bool isLeaf() { return leftRight == 0; }
+        std::vector<BLASInstance<BLASBVH>> bvh;
+        std::vector<BLASInstance<BLASBVH4>> bvh4;
+        std::vector<BLASInstance<BLASGrid>> grid;
+        std::vector<BLASInstance<BLASKDTree>> kdtree;
+        std::vector<BLASInstance<TLASBVH>> nested;
     };
 
+    // A leaf of a TLASBVH holds an instance of any kind of BLAS, or of another TLASBVH, so every mesh
+    // can use the structure that suits it, and a scene can be built from modules that are placed many
+    // times: the modules are stored once and traversal chains the transforms on the way down. A leaf
+    // only switches on the kind of its instance; below it, the BLAS runs its own traversal. The
+    // instances are numbered per kind, in the order of BLASType.
     class TLASBVH
     {
     private:
         float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
-        int FindBestMatch(int* list, int N, int A);
+        size_t GetNodeMemoryUsage() const;
+        uint GetLeaf(const uint instanceIdx) const;
+        // calls f with the instance a leaf refers to
+        template <class F> void VisitLeaf(const uint leaf, F&& f)
+        {
+            const uint i = leaf & TLAS_LEAF_INDEX_MASK;
+            switch (leaf >> TLAS_LEAF_TYPE_SHIFT)
+            {
+            case BLAS_TYPE_BVH: f(instances[i]); break;
+            case BLAS_TYPE_BVH4: f(bvh4Instances[i]); break;
+            case BLAS_TYPE_GRID: f(gridInstances[i]); break;
+            case BLAS_TYPE_KDTREE: f(kdtreeInstances[i]); break;
+            default: f(nested[i]); break;
+            }
+        }
     public:
         TLASBVH() = default;
-        TLASBVH(std::vector<BLASBVH*> bvhList);
+        TLASBVH(const std::vector<BLASInstance<BLASBVH>>& instanceList);
+        TLASBVH(const TLASInstanceLists& instanceLists);
         void Build();
+        void SetTransform(const uint instanceIdx, const mat4& transform);
+        void Refit();
+        void Update();
         void Intersect(Ray& ray);
-    private:
+        bool IsOccluded(const Ray& ray);
+        size_t GetMemoryUsage() const;
+        void IntersectPacket(RayPacket& packet, uint first = 0);
+        aabb GetBounds() const;
+        int GetTriangleCount() const;
+        int GetMeshCount() const;
+        uint GetInstanceIdx(const BLASType type, const uint idx) const { return firstInstance[type] + idx; }
+        void GetSurface(const int objIdx, const uint triIdx, const float2 barycentric, float3& normal, float2& uv, int& matIdx) const;
+    protected:
         TLASBVHNode* tlasNode;
-        uint nodesUsed = 0, blasCount;
+        uint nodesUsed = 0, instanceCount;
+        uint firstInstance[BLAS_TYPE_COUNT + 1] = {}; // the instances of each kind start here
     public:
+        std::vector<BLASInstance<BLASBVH>> instances;
+        std::vector<BLASInstance<BLASBVH4>> bvh4Instances;
+        std::vector<BLASInstance<BLASGrid>> gridInstances;
+        std::vector<BLASInstance<BLASKDTree>> kdtreeInstances;
+        std::vector<BLASInstance<TLASBVH>> nested; // instances of other TLASes
+        // the distinct structures of the instances, including those of the nested TLASes
         std::vector<BLASBVH*> blas;
+        std::vector<BLASBVH4*> bvh4BLAS;
+        std::vector<BLASGrid*> gridBLAS;
+        std::vector<BLASKDTree*> kdtreeBLAS;
+        std::vector<TLASBVH*> nestedTLAS; // the distinct TLASes below this one, at any depth
+        int objectCount = 0; // object indices used by the instances, a nested TLAS counting its own
         std::chrono::microseconds buildTime;
+        std::chrono::microseconds updateTime{ 0 };
+        float cost = 0, builtCost = 0; // CalculateTLASCost now and after the last build
+        bool rebuilt = false; // the last Update rebuilt the tree instead of only refitting it
+        uint refitCount = 0, rebuildCount = 0;
+    private:
+        std::vector<std::pair<int, uint>> objectLeaves; // first object index of each leaf, sorted, for GetSurface
     };
 }
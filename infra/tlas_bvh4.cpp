@@ -0,0 +1,148 @@
+#include "precomp.h"
+#include "tlas_bvh4.h"
+
+TLASBVH4::TLASBVH4(const std::vector<BLASInstance<BLASBVH4>>& instanceList)
+	: TLASBVH(std::vector<BLASInstance<BLASBVH>>(instanceList.begin(), instanceList.end())),
+	instances4(instanceList), blas4(DistinctBLAS(instanceList))
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	tlas4Nodes.clear();
+	Collapse(0);
+	auto endTime = std::chrono::high_resolution_clock::now();
+	buildTime += std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+void TLASBVH4::Build()
+{
+	TLASBVH::Build();
+	auto startTime = std::chrono::high_resolution_clock::now();
+	tlas4Nodes.clear();
+	Collapse(0);
+	auto endTime = std::chrono::high_resolution_clock::now();
+	buildTime += std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+void TLASBVH4::SetTransform(const uint instanceIdx, const mat4& transform)
+{
+	TLASBVH::SetTransform(instanceIdx, transform);
+	instances4[instanceIdx].SetTransform(transform);
+}
+
+// the 4-wide nodes are collapsed again from the refitted or rebuilt binary TLAS
+void TLASBVH4::Update()
+{
+	TLASBVH::Update();
+	auto startTime = std::chrono::high_resolution_clock::now();
+	tlas4Nodes.clear();
+	Collapse(0);
+	auto endTime = std::chrono::high_resolution_clock::now();
+	updateTime += std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+}
+
+// the binary TLAS of the base class is kept next to the 4-wide nodes
+size_t TLASBVH4::GetMemoryUsage() const
+{
+	size_t bytes = sizeof(TLASBVHNode) * 2 * instanceCount + instances.capacity() * sizeof(BLASInstance<BLASBVH>);
+	bytes += tlas4Nodes.capacity() * sizeof(BVH4Node) + instances4.capacity() * sizeof(BLASInstance<BLASBVH4>);
+	for (const BLASBVH4* mesh : blas4) bytes += mesh->GetMemoryUsage();
+	return bytes;
+}
+
+uint TLASBVH4::Collapse(const uint nodeIdx)
+{
+	// gather up to four children by repeatedly opening the interior child with the largest surface area
+	uint children[4], childCount = 0;
+	TLASBVHNode& node = tlasNode[nodeIdx];
+	if (node.isLeaf()) children[childCount++] = nodeIdx; // a single instance
+	else children[childCount++] = node.left, children[childCount++] = node.right;
+	while (childCount < 4)
+	{
+		int best = -1;
+		float bestArea = -1;
+		for (uint i = 0; i < childCount; i++)
+		{
+			TLASBVHNode& child = tlasNode[children[i]];
+			if (child.isLeaf()) continue;
+			const float3 e = child.aabbMax - child.aabbMin;
+			const float area = e.x * e.y + e.y * e.z + e.z * e.x;
+			if (area > bestArea) bestArea = area, best = i;
+		}
+		if (best == -1) break;
+		const TLASBVHNode& open = tlasNode[children[best]];
+		children[childCount++] = open.right;
+		children[best] = open.left;
+	}
+
+	const uint idx = tlas4Nodes.size();
+	tlas4Nodes.push_back(BVH4Node());
+	BVH4Node wide;
+	for (uint i = 0; i < 4; i++)
+	{
+		if (i >= childCount)
+		{
+			wide.bminx[i] = wide.bminy[i] = wide.bminz[i] = 1e30f;
+			wide.bmaxx[i] = wide.bmaxy[i] = wide.bmaxz[i] = -1e30f;
+			wide.child[i] = BVH4_EMPTY, wide.triCount[i] = 0;
+			continue;
+		}
+		TLASBVHNode& child = tlasNode[children[i]];
+		wide.bminx[i] = child.aabbMin.x, wide.bminy[i] = child.aabbMin.y, wide.bminz[i] = child.aabbMin.z;
+		wide.bmaxx[i] = child.aabbMax.x, wide.bmaxy[i] = child.aabbMax.y, wide.bmaxz[i] = child.aabbMax.z;
+		if (child.isLeaf())
+			wide.child[i] = child.BLAS, wide.triCount[i] = 1;
+		else
+			wide.child[i] = Collapse(children[i]), wide.triCount[i] = 0;
+	}
+	tlas4Nodes[idx] = wide;
+	return idx;
+}
+
+void TLASBVH4::Intersect(Ray& ray)
+{
+	const BVH4Ray ray4(ray);
+	BVH4StackEntry stack[BVH4_STACK_SIZE];
+	uint stackPtr = 0;
+	const BVH4Node* node = &tlas4Nodes[0];
+	while (node)
+	{
+		ray.traversed++;
+		__m128 dist4;
+		const int mask = IntersectBVH4Children(*node, ray4, ray.t, dist4);
+		PushBVH4Children(*node, mask, dist4, stack, stackPtr);
+		node = 0;
+		while (stackPtr > 0)
+		{
+			const BVH4StackEntry entry = stack[--stackPtr];
+			// a closer hit may have been found since this child was pushed
+			if (entry.dist >= ray.t) continue;
+			if (entry.triCount == 0)
+			{
+				node = &tlas4Nodes[entry.child];
+				break;
+			}
+			ray.traversed++;
+			instances4[entry.child].Intersect(ray);
+		}
+	}
+}
+
+bool TLASBVH4::IsOccluded(const Ray& ray)
+{
+	const BVH4Ray ray4(ray);
+	BVH4StackEntry stack[BVH4_STACK_SIZE];
+	uint stackPtr = 0;
+	stack[stackPtr++] = { 0, 0, 0 };
+	while (stackPtr > 0)
+	{
+		const BVH4StackEntry entry = stack[--stackPtr];
+		if (entry.triCount > 0)
+		{
+			if (instances4[entry.child].IsOccluded(ray)) return true;
+			continue;
+		}
+		__m128 dist4;
+		const int mask = IntersectBVH4Children(tlas4Nodes[entry.child], ray4, ray.t, dist4);
+		PushBVH4ChildrenUnordered(tlas4Nodes[entry.child], mask, stack, stackPtr);
+	}
+	return false;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "tlas_bvh.h"
+#include "blas_bvh4.h"
+
+namespace Tmpl8
+{
+    // TLAS collapsed into 4-wide nodes; a leaf child stores the instance index and a triCount of 1
+    class TLASBVH4 : public TLASBVH
+    {
+    private:
+        uint Collapse(const uint nodeIdx);
+    public:
+        TLASBVH4() = default;
+        TLASBVH4(const std::vector<BLASInstance<BLASBVH4>>& instanceList);
+        void Build();
+        void SetTransform(const uint instanceIdx, const mat4& transform);
+        void Update();
+        void Intersect(Ray& ray);
+        bool IsOccluded(const Ray& ray);
+        size_t GetMemoryUsage() const;
+    private:
+        std::vector<BVH4Node> tlas4Nodes;
+        std::vector<BLASInstance<BLASBVH4>> instances4;
+        std::vector<BLASBVH4*> blas4;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#define TRI_PACKS // leaf triangles in 8-wide SoA packs, tested with AVX2 when the CPU supports it
+#define TRI_PACK_WIDTH 8
+
+// A leaf (or grid cell) stores its triangles in packs of eight, one float per lane per component,
+// so one ray is tested against all of them at once and the closest hit is picked with a horizontal min.
+// CPUs without AVX2 keep the scalar Moller-Trumbore loop over triAccel.
+
+namespace Tmpl8
+{
+	struct ALIGN(64) TriPack
+	{
+		union { __m256 v0x8; float v0x[8]; }; union { __m256 v0y8; float v0y[8]; }; union { __m256 v0z8; float v0z[8]; }; // 96 bytes
+		union { __m256 e1x8; float e1x[8]; }; union { __m256 e1y8; float e1y[8]; }; union { __m256 e1z8; float e1z[8]; }; // 96 bytes
+		union { __m256 e2x8; float e2x[8]; }; union { __m256 e2y8; float e2y[8]; }; union { __m256 e2z8; float e2z[8]; }; // 96 bytes
+		int triIdx[8];              // 32 bytes; total: 320 bytes
+		// Unused lanes have zero edges, which the parallel test rejects, and triIdx -1.
+	};
+
+	// the leaf path is picked once per build, from the instruction sets of this CPU
+	inline bool UseTriPacks()
+	{
+#ifdef TRI_PACKS
+		// AVX-512 machines run the same 8-wide kernel
+		return CPUCaps::HW_AVX2 || CPUCaps::HW_AVX512F;
+#else
+		return false;
+#endif
+	}
+
+	// appends (count + 7) / 8 packs holding the triangles triIdx[0..count)
+	template <class Index>
+	inline void AppendTriPacks(const std::vector<TriAccel>& triAccel, const Index* triIdx, const uint count, std::vector<TriPack>& packs)
+	{
+		for (uint first = 0; first < count; first += TRI_PACK_WIDTH)
+		{
+			TriPack pack;
+			memset(&pack, 0, sizeof(TriPack));
+			for (uint lane = 0; lane < TRI_PACK_WIDTH; lane++)
+			{
+				pack.triIdx[lane] = -1;
+				if (first + lane >= count) continue;
+				const TriAccel& tri = triAccel[triIdx[first + lane]];
+				pack.v0x[lane] = tri.vertex0.x, pack.v0y[lane] = tri.vertex0.y, pack.v0z[lane] = tri.vertex0.z;
+				pack.e1x[lane] = tri.edge1.x, pack.e1y[lane] = tri.edge1.y, pack.e1z[lane] = tri.edge1.z;
+				pack.e2x[lane] = tri.edge2.x, pack.e2y[lane] = tri.edge2.y, pack.e2z[lane] = tri.edge2.z;
+				pack.triIdx[lane] = (int)triIdx[first + lane];
+			}
+			packs.push_back(pack);
+		}
+	}
+
+	// Moller-Trumbore on the lanes set in laneMask; on a closer hit, ray.t, triIdx and barycentric are
+	// updated and true is returned, the caller sets objIdx.
+	inline bool IntersectTriPack(const TriPack& pack, Ray& ray, const int laneMask)
+	{
+		const __m256 dx = _mm256_set1_ps(ray.D.x), dy = _mm256_set1_ps(ray.D.y), dz = _mm256_set1_ps(ray.D.z);
+		// h = cross(D, edge2)
+		const __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, pack.e2z8), _mm256_mul_ps(dz, pack.e2y8));
+		const __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, pack.e2x8), _mm256_mul_ps(dx, pack.e2z8));
+		const __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, pack.e2y8), _mm256_mul_ps(dy, pack.e2x8));
+		const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pack.e1x8, hx), _mm256_mul_ps(pack.e1y8, hy)), _mm256_mul_ps(pack.e1z8, hz));
+		const __m256 f = _mm256_div_ps(_mm256_set1_ps(1), a);
+		// s = O - vertex0
+		const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.O.x), pack.v0x8);
+		const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.O.y), pack.v0y8);
+		const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.O.z), pack.v0z8);
+		const __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+		// q = cross(s, edge1)
+		const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, pack.e1z8), _mm256_mul_ps(sz, pack.e1y8));
+		const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, pack.e1x8), _mm256_mul_ps(sx, pack.e1z8));
+		const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, pack.e1y8), _mm256_mul_ps(sy, pack.e1x8));
+		const __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+		const __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pack.e2x8, qx), _mm256_mul_ps(pack.e2y8, qy)), _mm256_mul_ps(pack.e2z8, qz)));
+		// the same rejection tests as the scalar code, on all lanes
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+		const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		__m256 hit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(laneMask), bits), bits));
+		const __m256 absA = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(absA, _mm256_set1_ps(0.0001f), _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(0.0001f), _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(ray.t), _CMP_LT_OQ)));
+		const int mask = _mm256_movemask_ps(hit);
+		if (!mask) return false;
+		// horizontal min over the hit lanes; the lowest lane wins ties, like the scalar loop
+		const __m256 tHit = _mm256_blendv_ps(_mm256_set1_ps(1e30f), t, hit);
+		__m256 tMin = _mm256_min_ps(tHit, _mm256_permute2f128_ps(tHit, tHit, 1));
+		tMin = _mm256_min_ps(tMin, _mm256_shuffle_ps(tMin, tMin, _MM_SHUFFLE(1, 0, 3, 2)));
+		tMin = _mm256_min_ps(tMin, _mm256_shuffle_ps(tMin, tMin, _MM_SHUFFLE(2, 3, 0, 1)));
+		int closest = _mm256_movemask_ps(_mm256_cmp_ps(tHit, tMin, _CMP_EQ_OQ)) & mask, lane = 0;
+		while (!(closest & 1)) closest >>= 1, lane++;
+		union { __m256 t8; float tl[8]; }; union { __m256 u8; float ul[8]; }; union { __m256 v8; float vl[8]; };
+		t8 = t, u8 = u, v8 = v;
+		ray.t = tl[lane], ray.triIdx = pack.triIdx[lane], ray.barycentric = float2(ul[lane], vl[lane]);
+		return true;
+	}
+}
\ No newline at end of file